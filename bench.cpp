@@ -0,0 +1,1029 @@
+/**
+ * Micro-benchmarks for the shell's hot paths
+ *
+ * Usage (after running make bench): ./benchmarks [filter]
+ *
+ * Every benchmark whose name contains filter is run (all of them if filter is
+ * omitted). Results go to stdout; they are timings, not pass/fail checks, so
+ * they are deliberately kept out of the tests executable.
+ */
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "builtins.h"
+#include "jobs.h"
+#include "line_reader.h"
+#include "parallel.h"
+#include "path_cache.h"
+#include "script.h"
+#include "shell.h"
+#include "spawn.h"
+#include "substitution.h"
+#include "variables.h"
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+/**
+ * Runs body rounds times and returns the average time per round in
+ * nanoseconds
+ */
+double time_ns(long rounds, const std::function<void()>& body) {
+    clock_type::time_point start = clock_type::now();
+    for (long i = 0; i < rounds; i++) body();
+    std::chrono::duration<double, std::nano> elapsed = clock_type::now() - start;
+    return elapsed.count() / rounds;
+}
+
+/**
+ * Prints one result line. baseline_ns, when non-zero, is the figure this
+ * result is compared against.
+ */
+void report(const char* label, double ns, const char* unit,
+            double baseline_ns = 0) {
+    printf("  %-34s %12.1f ns/%s", label, ns, unit);
+    if (baseline_ns > 0) printf("   (%.2fx)", baseline_ns / ns);
+    printf("\n");
+}
+
+/**
+ * Reads every line of data/in*.txt, without trailing newlines
+ */
+std::vector<std::string> load_data_corpus() {
+    std::vector<std::string> lines;
+    for (int i = 0;; i++) {
+        std::ifstream in("data/in" + std::to_string(i) + ".txt");
+        if (!in) break;
+        std::string line;
+        while (std::getline(in, line)) lines.push_back(line);
+    }
+    return lines;
+}
+
+/**
+ * The strtok-based parse this shell shipped with: clone the line, count the
+ * tokens with one strtok pass, restore the clone and fill argv with a second
+ * pass. Kept here as the baseline for the single-pass tokenizer.
+ */
+command* legacy_parse(char* line) {
+    char* line_copy = new char[strlen(line) + 1];
+    strcpy(line_copy, line);
+
+    int argc = 0;
+    char* currentToken = strtok(line_copy, " \t\n");
+    while (currentToken != NULL) {
+        argc++;
+        currentToken = strtok(NULL, " \t\n");
+    }
+
+    command* cmd = create_command(argc);
+
+    strcpy(line_copy, line);
+    currentToken = strtok(line_copy, " \t\n");
+    for (int i = 0; i < argc && currentToken != NULL; i++) {
+        strncpy(cmd->argv[i], currentToken, MAX_ARG_LEN - 1);
+        cmd->argv[i][MAX_ARG_LEN - 1] = '\0';
+        currentToken = strtok(NULL, " \t\n");
+    }
+
+    delete[] line_copy;
+    return cmd;
+}
+
+/**
+ * Parses (and cleans up) every line of lines with parse_fn, rounds times over,
+ * returning the average cost per line
+ */
+double time_parse(std::vector<std::string>& lines, long rounds,
+                  command* (*parse_fn)(char*)) {
+    double per_round = time_ns(rounds, [&]() {
+        for (std::string& line : lines) cleanup(parse_fn(&line[0]));
+    });
+    return per_round / lines.size();
+}
+
+void bench_parse() {
+    std::vector<std::string> corpus = load_data_corpus();
+    if (!corpus.empty()) {
+        const long rounds = 20000;
+        printf("parse: data/in*.txt corpus (%zu lines x %ld rounds)\n",
+               corpus.size(), rounds);
+        double legacy = time_parse(corpus, rounds, legacy_parse);
+        report("legacy two-pass strtok parse", legacy, "line");
+        report("single-pass tokenize parse", time_parse(corpus, rounds, parse),
+               "line", legacy);
+    }
+
+    // A generated script in the shape of our batch jobs
+    const long script_lines = 1000000;
+    std::vector<std::string> script;
+    script.reserve(script_lines);
+    for (long i = 0; i < script_lines; i++)
+        script.push_back("  cp -p   /var/lib/jobs/input_" + std::to_string(i) +
+                         ".dat /var/lib/jobs/out/  \t");
+    printf("parse: synthetic script (%ld lines)\n", script_lines);
+    double legacy = time_parse(script, 1, legacy_parse);
+    report("legacy two-pass strtok parse", legacy, "line");
+    report("single-pass tokenize parse", time_parse(script, 1, parse), "line",
+           legacy);
+}
+
+void bench_pool() {
+    std::vector<std::string> corpus = load_data_corpus();
+    if (corpus.empty()) return;
+    const long rounds = 20000;
+    printf("pool: parse + cleanup of data/in*.txt (%zu lines x %ld rounds)\n",
+           corpus.size(), rounds);
+
+    // Emptying the pool after every command means every parse allocates and
+    // every cleanup frees, as before the pool existed
+    double unpooled = time_ns(rounds, [&]() {
+        for (std::string& line : corpus) {
+            cleanup(parse(&line[0]));
+            command_pool_clear();
+        }
+    }) / corpus.size();
+    report("allocate + free per command", unpooled, "line");
+
+    command_pool_clear();
+    double pooled = time_ns(rounds, [&]() {
+        for (std::string& line : corpus) cleanup(parse(&line[0]));
+    }) / corpus.size();
+    report("recycled through command pool", pooled, "line", unpooled);
+
+    command_pool_stats stats;
+    get_command_pool_stats(&stats);
+    printf("  pool: %lu hits, %lu misses, %d pooled\n", stats.hits,
+           stats.misses, stats.pooled);
+}
+
+/**
+ * Forks a child that writes data into a pipe and exits. Returns the read end
+ */
+int feed_pipe(const std::string& data, pid_t* writer) {
+    int pipe_fd[2];
+    if (pipe(pipe_fd) != 0) {
+        perror("pipe failed");
+        exit(EXIT_FAILURE);
+    }
+    *writer = fork();
+    if (*writer == 0) {
+        close(pipe_fd[0]);
+        for (size_t done = 0; done < data.size();) {
+            ssize_t count =
+                write(pipe_fd[1], data.data() + done, data.size() - done);
+            if (count <= 0) _exit(EXIT_FAILURE);
+            done += count;
+        }
+        _exit(EXIT_SUCCESS);
+    }
+    close(pipe_fd[1]);
+    return pipe_fd[0];
+}
+
+void bench_reader() {
+    const long script_lines = 1000000;
+    std::string script;
+    for (long i = 0; i < script_lines; i++)
+        script += "touch /var/lib/jobs/out/result_" + std::to_string(i) + "\n";
+    printf("reader: %ld lines piped into stdin\n", script_lines);
+
+    // What _main used to do: fgets into a MAX_LINE_SIZE buffer
+    pid_t writer;
+    int fd = feed_pipe(script, &writer);
+    FILE* in = fdopen(fd, "r");
+    char input[MAX_LINE_SIZE + 1];
+    long lines = 0;
+    double fgets_ns = time_ns(1, [&]() {
+        while (fgets(input, MAX_LINE_SIZE, in) != NULL) {
+            input[strcspn(input, "\n")] = '\0';
+            lines++;
+        }
+    }) / script_lines;
+    fclose(in);
+    waitpid(writer, NULL, 0);
+    report("fgets(MAX_LINE_SIZE)", fgets_ns, "line");
+
+    fd = feed_pipe(script, &writer);
+    line_reader reader;
+    line_reader_init(&reader, fd);
+    double reader_ns = time_ns(1, [&]() {
+        while (read_line(&reader, NULL) != NULL) lines++;
+    }) / script_lines;
+    line_reader_free(&reader);
+    close(fd);
+    waitpid(writer, NULL, 0);
+    report("line_reader", reader_ns, "line", fgets_ns);
+}
+
+void bench_script() {
+    const long script_lines = 1000000;
+    char path[] = "/tmp/thsh_bench_XXXXXX";
+    int fd = mkstemp(path);
+    FILE* out = fdopen(fd, "w");
+    for (long i = 0; i < script_lines; i++)
+        fprintf(out, "chmod 0644 /var/lib/jobs/out/result_%ld\n", i);
+    fclose(out);
+    printf("script: generated %ld-line script file\n", script_lines);
+
+    // One read + parse round trip per line, as when the script is fed to
+    // stdin
+    double per_line = time_ns(1, [&]() {
+        int in = open(path, O_RDONLY);
+        line_reader reader;
+        line_reader_init(&reader, in);
+        char* line;
+        while ((line = read_line(&reader, NULL)) != NULL) cleanup(parse(line));
+        line_reader_free(&reader);
+        close(in);
+    }) / script_lines;
+    report("read_line + parse per line", per_line, "line");
+
+    // mmap + tokenize everything up front, then materialize each command
+    double load_ns = 0;
+    double ahead = time_ns(1, [&]() {
+        script s;
+        load_ns = time_ns(1, [&]() { load_script(path, &s); });
+        for (int i = 0; i < s.line_count; i++) cleanup(script_command(&s, i));
+        free_script(&s);
+    }) / script_lines;
+    report("load_script + script_command", ahead, "line", per_line);
+    printf("  load_script (mmap + scan) alone: %.1f ms\n", load_ns / 1e6);
+    unlink(path);
+}
+
+/**
+ * Sets $PATH to 15 entries, with /usr/bin last, the worst case for looking up
+ * programs such as mv. Returns the previous $PATH
+ */
+std::string use_deep_path() {
+    std::string original = getenv("PATH");
+    std::string deep;
+    const char* dirs[] = {"/usr/local/sbin", "/usr/local/bin", "/usr/sbin",
+                          "/sbin", "/opt/bin", "/snap/bin", "/usr/games",
+                          "/usr/local/games", "/root/.local/bin", "/root/bin",
+                          "/usr/lib/jvm/bin", "/usr/local/go/bin",
+                          "/opt/tools/bin", "/var/lib/bin"};
+    for (const char* dir : dirs) deep += std::string(dir) + ":";
+    deep += "/usr/bin";
+    setenv("PATH", deep.c_str(), 1);
+    return original;
+}
+
+/**
+ * The original find_full_path search: build and stat a candidate in every
+ * $PATH directory until one is a regular file
+ */
+bool legacy_search(const char* name) {
+    char* path_copy = strdup(getenv("PATH"));
+    bool found = false;
+    for (char* dir = strtok(path_copy, ":"); dir != NULL && !found;
+         dir = strtok(NULL, ":")) {
+        char full_path[MAX_LINE_SIZE];
+        snprintf(full_path, sizeof(full_path), "%s/%s", dir, name);
+        struct stat buffer;
+        found = stat(full_path, &buffer) == 0 && S_ISREG(buffer.st_mode);
+    }
+    free(path_copy);
+    return found;
+}
+
+void bench_path() {
+    std::string original = use_deep_path();
+    const long rounds = 20000;
+    printf("path: lookup of mv with /usr/bin 15th in $PATH (%ld rounds)\n",
+           rounds);
+
+    double legacy = time_ns(rounds, [&]() { legacy_search("mv"); });
+    report("stat in every $PATH directory", legacy, "lookup");
+    path_cache_lookup("mv");
+    double indexed = time_ns(rounds, [&]() {
+        path_cache_remove("mv");
+        path_cache_lookup("mv");
+    });
+    report("directory index + fstatat", indexed, "lookup", legacy);
+    double cached = time_ns(rounds, [&]() { path_cache_lookup("mv"); });
+    report("hashed command cache", cached, "lookup", legacy);
+
+    printf("path: lookup of thisisnotacommand (%ld rounds)\n", rounds);
+    legacy = time_ns(rounds, [&]() { legacy_search("thisisnotacommand"); });
+    report("stat in every $PATH directory", legacy, "lookup");
+    double negative = time_ns(rounds, [&]() {
+        path_cache_lookup("thisisnotacommand");
+    });
+    report("directory index", negative, "lookup", legacy);
+
+    setenv("PATH", original.c_str(), 1);
+}
+
+/**
+ * Number of path components the kernel looks up to resolve path
+ */
+int path_components(const std::string& path) {
+    int count = 0;
+    for (size_t i = 0; i < path.size(); i++)
+        if (path[i] != '/' && (i == 0 || path[i - 1] == '/')) count++;
+    return count;
+}
+
+void bench_probe() {
+    std::string original = use_deep_path();
+    std::vector<std::string> dirs;
+    std::string path_env = getenv("PATH");
+    for (size_t start = 0, end; start <= path_env.size(); start = end + 1) {
+        end = path_env.find(':', start);
+        if (end == std::string::npos) end = path_env.size();
+        dirs.push_back(path_env.substr(start, end - start));
+    }
+    setenv("PATH", original.c_str(), 1);
+
+    // Every directory probed for mv, as a search that only finds it in the
+    // last one does
+    const long rounds = 20000;
+    printf("probe: mv in each of %zu $PATH directories (%ld rounds)\n",
+           dirs.size(), rounds);
+
+    long walked = 0;
+    for (const std::string& dir : dirs) walked += path_components(dir) + 1;
+    double legacy = time_ns(rounds, [&]() {
+        for (const std::string& dir : dirs) {
+            char full_path[MAX_LINE_SIZE];
+            snprintf(full_path, sizeof(full_path), "%s/%s", dir.c_str(), "mv");
+            struct stat st;
+            stat(full_path, &st);
+        }
+    });
+    report("snprintf + stat(dir/name)", legacy, "search");
+    // Fewer when a directory is missing: the walk stops at the first
+    // component that doesn't exist
+    printf("    %zu stat calls, up to %ld path components looked up\n",
+           dirs.size(), walked);
+
+    std::vector<int> fds;
+    for (const std::string& dir : dirs)
+        fds.push_back(open(dir.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC));
+    long calls = 0;
+    long lookups = 0;
+    double relative = time_ns(rounds, [&]() {
+        calls = lookups = 0;
+        for (int fd : fds) {
+            // A directory that doesn't exist is already known to have no mv
+            if (fd < 0) continue;
+            struct stat st;
+            calls++;
+            lookups++;
+            if (fstatat(fd, "mv", &st, 0) == 0 && S_ISREG(st.st_mode)) {
+                calls++;
+                lookups++;
+                faccessat(fd, "mv", X_OK, AT_EACCESS);
+            }
+        }
+    });
+    report("fstatat + faccessat(O_PATH fd)", relative, "search", legacy);
+    printf("    %ld fstatat/faccessat calls, %ld path components looked up\n",
+           calls, lookups);
+    for (int fd : fds)
+        if (fd >= 0) close(fd);
+}
+
+/**
+ * Resident set size of this process, in MiB
+ */
+long rss_mib() {
+    long pages = 0, resident = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (statm != NULL) {
+        if (fscanf(statm, "%ld %ld", &pages, &resident) != 2) resident = 0;
+        fclose(statm);
+    }
+    return resident * getpagesize() / (1024 * 1024);
+}
+
+/**
+ * Starts and reaps program (from fd, if not -1) with backend, rounds times
+ * over, returning the average time per launch
+ */
+double time_spawn(spawn_backend backend, long rounds,
+                  std::string program = "/usr/bin/true", int fd = -1) {
+    command* cmd = parse(&program[0]);
+    set_spawn_backend(backend);
+    double ns = time_ns(rounds, [&]() {
+        pid_t pid = spawn_command(cmd, fd, NULL);
+        if (pid > 0) waitpid(pid, NULL, 0);
+    });
+    set_spawn_backend(SPAWN_VFORK);
+    cleanup(cmd);
+    return ns;
+}
+
+void bench_spawn() {
+    const long rounds = 500;
+    printf("spawn: /usr/bin/true launches as the heap grows (%ld rounds)\n",
+           rounds);
+
+    // Touched, so every page is resident and has to be mapped in the child
+    std::vector<char*> ballast;
+    const long steps_mib[] = {0, 256, 1024, 2048};
+    long allocated = 0;
+    for (long mib : steps_mib) {
+        if (mib > allocated) {
+            size_t size = (mib - allocated) * 1024 * 1024;
+            char* block = new char[size];
+            memset(block, 1, size);
+            ballast.push_back(block);
+            allocated = mib;
+        }
+        printf("  shell RSS %ld MiB\n", rss_mib());
+        double forked = time_spawn(SPAWN_FORK, rounds);
+        report("fork + execv", forked, "launch");
+        report("posix_spawn", time_spawn(SPAWN_POSIX_SPAWN, rounds),
+               "launch", forked);
+        report("clone(CLONE_VM | CLONE_VFORK)",
+               time_spawn(SPAWN_VFORK, rounds), "launch", forked);
+    }
+    for (char* block : ballast) delete[] block;
+}
+
+/**
+ * Copies the file at from to a new file at to, with mode 0755
+ */
+void copy_program(const char* from, const char* to) {
+    std::ifstream in(from, std::ios::binary);
+    std::ofstream out(to, std::ios::binary);
+    out << in.rdbuf();
+    out.close();
+    chmod(to, 0755);
+}
+
+void bench_exec() {
+    const long rounds = 2000;
+    // A copy of true at the bottom of 32 nested directories, such as deep
+    // tool chains or container layers make for
+    char root[] = "/tmp/thsh_bench_XXXXXX";
+    mkdtemp(root);
+    std::string deep = root;
+    std::vector<std::string> dirs;
+    for (int i = 0; i < 32; i++) {
+        deep += "/level" + std::to_string(i);
+        mkdir(deep.c_str(), 0755);
+        dirs.push_back(deep);
+    }
+    std::string program = deep + "/true";
+    copy_program("/usr/bin/true", program.c_str());
+
+    const char* programs[] = {"/usr/bin/true", program.c_str()};
+    for (const char* path : programs) {
+        printf("exec: %s (%d path components, %ld rounds)\n",
+               path == programs[0] ? "/usr/bin/true" : "true, 32 levels deep",
+               path_components(path), rounds);
+        double by_path = time_spawn(SPAWN_VFORK, rounds, path);
+        report("execve(path)", by_path, "launch");
+        int fd = open(path, O_PATH | O_CLOEXEC);
+        report("execveat(O_PATH fd, AT_EMPTY_PATH)",
+               time_spawn(SPAWN_VFORK, rounds, path, fd), "launch", by_path);
+        close(fd);
+    }
+
+    unlink(program.c_str());
+    while (!dirs.empty()) {
+        rmdir(dirs.back().c_str());
+        dirs.pop_back();
+    }
+    rmdir(root);
+}
+
+/**
+ * What running line cost before echo and friends were builtins: look the
+ * program up, start it and wait for it
+ */
+void run_as_program(std::string& line) {
+    command* cmd = parse(&line[0]);
+    if (find_full_path(cmd)) {
+        pid_t pid = spawn_command(cmd, -1, NULL);
+        if (pid > 0) waitpid(pid, NULL, 0);
+    }
+    cleanup(cmd);
+}
+
+void bench_builtins() {
+    const long rounds = 2000;
+    // The kind of lines a script generating a report is made of
+    std::vector<std::string> lines;
+    for (long i = 0; i < rounds; i++) {
+        if (i % 4 == 3)
+            lines.push_back("printf %s=%d\\n line " + std::to_string(i));
+        else
+            lines.push_back("echo line " + std::to_string(i) + " of the report");
+    }
+    printf("builtins: echo-heavy script, stdout to /dev/null (%ld lines)\n",
+           rounds);
+
+    // Time the lines, not the terminal
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+
+    size_t next = 0;
+    double spawned = time_ns(rounds, [&]() {
+        std::string line = lines[next++ % lines.size()];
+        run_as_program(line);
+    });
+    double in_process = time_ns(rounds, [&]() {
+        std::string line = lines[next++ % lines.size()];
+        command* cmd = parse(&line[0]);
+        execute(cmd);
+        cleanup(cmd);
+    });
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+
+    report("/usr/bin/echo and printf", spawned, "line");
+    printf("  %-34s %12.0f lines/s\n", "", 1e9 / spawned);
+    report("in-process echo and printf", in_process, "line", spawned);
+    printf("  %-34s %12.0f lines/s\n", "", 1e9 / in_process);
+}
+
+/**
+ * The strcmp chains is_builtin and do_builtin ran before the builtin table:
+ * the position of name in the chain, or -1. Kept as the baseline for
+ * find_builtin
+ */
+int legacy_builtin_index(const char* name) {
+    const char* chain[] = {"cd",   "exit", "hash",  "echo",
+                           "pwd",  "true", "false", "printf"};
+    for (int i = 0; i < 8; i++)
+        if (strcmp(name, chain[i]) == 0) return i;
+    return -1;
+}
+
+/**
+ * Checks every word of line for a builtin, the old way and through
+ * find_builtin
+ */
+void time_lookup(const char* label, std::string line, long rounds) {
+    command* cmd = parse(&line[0]);
+    printf("  %s\n", label);
+
+    // Each word as the command name, so builtins see their usual arguments
+    command one = *cmd;
+    volatile long found = 0;
+    double chained = time_ns(rounds, [&]() {
+        for (int i = 0; i < cmd->argc; i++) {
+            // Once to classify, once more to dispatch
+            if (legacy_builtin_index(cmd->argv[i]) >= 0)
+                found += legacy_builtin_index(cmd->argv[i]);
+        }
+    });
+    double hashed = time_ns(rounds, [&]() {
+        for (int i = 0; i < cmd->argc; i++) {
+            one.argv = cmd->argv + i;
+            one.argc = 1;
+            if (find_builtin(&one) != NULL) found++;
+        }
+    });
+    report("strcmp chain, twice", chained / cmd->argc, "name");
+    report("perfect hash, once", hashed / cmd->argc, "name",
+           chained / cmd->argc);
+    cleanup(cmd);
+}
+
+void bench_lookup() {
+    const long rounds = 1000000;
+    printf("lookup: builtin check of a command name (%ld rounds)\n", rounds);
+    // Programs used to lose to every comparison
+    time_lookup("programs", "ls grep sed awk sort cat head tail", rounds);
+    time_lookup("builtins", "cd exit hash echo pwd true false printf",
+                rounds);
+}
+
+/**
+ * Executes line (parsed afresh) and returns what execute returned
+ */
+int execute_line(std::string line) {
+    command* cmd = parse(&line[0]);
+    int status = execute(cmd);
+    cleanup(cmd);
+    return status;
+}
+
+void bench_jobs() {
+    const long workers = 500;
+    printf("jobs: %ld workers of sleep 0.05, all reaped\n", workers);
+
+    // One at a time, as before &
+    double one_by_one = time_ns(1, [&]() {
+        for (long i = 0; i < workers / 10; i++) execute_line("sleep 0.05");
+    }) * 10;
+    report("in the foreground (estimated)", one_by_one / workers, "worker");
+
+    double background = time_ns(1, [&]() {
+        for (long i = 0; i < workers; i++) execute_line("sleep 0.05 &");
+        execute_line("wait");
+    });
+    report("as background jobs, then wait", background / workers, "worker",
+           one_by_one / workers);
+    printf("  %-34s %12d\n", "jobs left", jobs_count());
+}
+
+// Runs lines through a parallel run, returning the most output it held in
+// memory
+size_t run_parallel(const std::vector<std::string>& lines,
+                    const parallel_options& options) {
+    parallel_run run;
+    parallel_start(&run, &options);
+    for (std::string line : lines) {
+        command* cmd = parse(&line[0]);
+        parallel_submit(&run, cmd, line.data(), line.size());
+        cleanup(cmd);
+    }
+    parallel_finish(&run);
+    return run.most_buffered;
+}
+
+void bench_parallel() {
+    std::vector<std::string> lines(200, "sleep 0.05");
+    printf("parallel: a script of %zu lines of sleep 0.05\n", lines.size());
+
+    // Line after line, as run_script does (a tenth of them, scaled up)
+    double serial = time_ns(1, [&]() {
+        for (size_t i = 0; i < lines.size() / 10; i++) execute_line(lines[i]);
+    }) * 10;
+    report("one line at a time (estimated)", serial / lines.size(), "line");
+
+    parallel_options options;
+    parallel_default_options(&options);
+    for (int jobs : {8, 64}) {
+        options.jobs = jobs;
+        double parallel = time_ns(1, [&]() { run_parallel(lines, options); });
+        std::string label = "--jobs " + std::to_string(jobs);
+        report(label.c_str(), parallel / lines.size(), "line",
+               serial / lines.size());
+    }
+}
+
+void bench_keep_order() {
+    std::vector<std::string> lines(64, "seq 100000");
+    printf("keep-order: %zu lines of seq 100000 (576 KiB each), --jobs 8, "
+           "to /dev/null\n", lines.size());
+
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+
+    parallel_options options;
+    parallel_default_options(&options);
+    options.jobs = 8;
+    double as_it_comes = time_ns(1, [&]() { run_parallel(lines, options); });
+    options.keep_order = true;
+    size_t held[2];
+    const size_t caps[2] = {PARALLEL_MEMORY_CAP, 256 * 1024};
+    double kept[2];
+    for (int i = 0; i < 2; i++) {
+        options.memory_cap = caps[i];
+        kept[i] =
+            time_ns(1, [&]() { held[i] = run_parallel(lines, options); });
+    }
+
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    report("output as it comes", as_it_comes / lines.size(), "line");
+    for (int i = 0; i < 2; i++) {
+        std::string label = "--keep-order, --memory-cap " +
+                            std::to_string(caps[i] / 1024) + "K";
+        report(label.c_str(), kept[i] / lines.size(), "line",
+               as_it_comes / lines.size());
+        printf("  %-34s %12zu bytes\n", "  most output held in memory",
+               held[i]);
+    }
+}
+
+void bench_xargs() {
+    const long files = 100000;
+    char dir[] = "/tmp/thsh_xargs_XXXXXX";
+    mkdtemp(dir);
+    std::string list_path = std::string(dir) + ".list";
+    std::ofstream list(list_path);
+    for (long i = 0; i < files; i++) list << dir << "/f" << i << "\n";
+    list.close();
+    printf("xargs: touch, then rm, %ld files\n", files);
+
+    // One process per file, as generated scripts do (a hundredth of them,
+    // scaled up)
+    double one_by_one = time_ns(1, [&]() {
+        for (long i = 0; i < files / 100; i++) {
+            std::string file = std::string(dir) + "/f" + std::to_string(i);
+            execute_line("touch " + file);
+            execute_line("rm -f " + file);
+        }
+    }) * 100;
+    report("touch file / rm -f file (estimated)", one_by_one / files, "file");
+
+    for (const char* procs : {"1", "4"}) {
+        double batched = time_ns(1, [&]() {
+            execute_line("xargs -P " + std::string(procs) + " -a " +
+                         list_path + " touch");
+            execute_line("xargs -P " + std::string(procs) + " -a " +
+                         list_path + " rm -f");
+        });
+        std::string label = "xargs -P " + std::string(procs);
+        report(label.c_str(), batched / files, "file", one_by_one / files);
+    }
+
+    unlink(list_path.c_str());
+    rmdir(dir);
+}
+
+void bench_time() {
+    const long rounds = 500;
+    printf("time: sleep 0, with its report going to /dev/null\n");
+
+    fflush(stderr);
+    int saved_stderr = dup(STDERR_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDERR_FILENO);
+    close(null_fd);
+    double plain = time_ns(rounds, [&]() { execute_line("sleep 0"); });
+    double timed = time_ns(rounds, [&]() { execute_line("time sleep 0"); });
+    double timed_pipeline =
+        time_ns(rounds, [&]() { execute_line("time sleep 0 | sleep 0"); });
+    dup2(saved_stderr, STDERR_FILENO);
+    close(saved_stderr);
+
+    report("sleep 0", plain, "command");
+    report("time sleep 0 (wait4)", timed, "command", plain);
+    report("time sleep 0 | sleep 0", timed_pipeline, "command", plain);
+}
+
+/**
+ * The usual way of running a command substitution: fork a subshell running
+ * line with stdout into a pipe, and read the pipe until it's closed. Kept
+ * here as the baseline for substitution.c
+ */
+std::string substitution_through_pipe(std::string line) {
+    int fds[2];
+    pipe2(fds, O_CLOEXEC);
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        execute_line(line);
+        fflush(stdout);
+        _exit(EXIT_SUCCESS);
+    }
+    close(fds[1]);
+    std::string output;
+    char buffer[4096];
+    ssize_t got;
+    while ((got = read(fds[0], buffer, sizeof(buffer))) > 0)
+        output.append(buffer, got);
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+    return output;
+}
+
+void bench_substitution() {
+    const long rounds = 2000;
+    printf("substitution: true $(...), against a subshell and a pipe\n");
+
+    double piped = time_ns(rounds, [&]() {
+        std::string line = "true " + substitution_through_pipe("echo x");
+        execute_line(line);
+    });
+    double builtin =
+        time_ns(rounds, [&]() { execute_line("true $(echo x)"); });
+    report("fork + pipe, echo x", piped, "command");
+    report("$(echo x) (in-process)", builtin, "command", piped);
+
+    piped = time_ns(rounds / 4, [&]() {
+        std::string line = "true " + substitution_through_pipe("seq 1");
+        execute_line(line);
+    });
+    double external =
+        time_ns(rounds / 4, [&]() { execute_line("true $(seq 1)"); });
+    report("fork + pipe, seq 1", piped, "command");
+    report("$(seq 1) (memfd)", external, "command", piped);
+
+    // 590 KB of output
+    piped = time_ns(rounds / 40, [&]() {
+        std::string line = "true " + substitution_through_pipe("seq 100000");
+        execute_line(line);
+    });
+    external =
+        time_ns(rounds / 40, [&]() { execute_line("true $(seq 100000)"); });
+    report("fork + pipe, seq 100000", piped, "command");
+    report("$(seq 100000) (memfd)", external, "command", piped);
+}
+
+void bench_redirect() {
+    const long rounds = 1000;
+    char script[] = "/tmp/thsh_redirect_XXXXXX";
+    int fd = mkstemp(script);
+    const char body[] = "seq 1 > /dev/null\n";
+    write(fd, body, sizeof(body) - 1);
+    close(fd);
+    printf("redirect: to /dev/null\n");
+
+    // What scripts had to do before: a sh to do the redirecting
+    double wrapped = time_ns(rounds / 4, [&]() {
+        execute_line("sh " + std::string(script));
+    });
+    double external = time_ns(
+        rounds, [&]() { execute_line("seq 1 > /dev/null"); });
+    double builtin =
+        time_ns(rounds, [&]() { execute_line("echo x > /dev/null"); });
+    report("sh running seq 1 > /dev/null", wrapped, "command");
+    report("seq 1 > /dev/null", external, "command", wrapped);
+    report("echo x > /dev/null (built-in)", builtin, "command", wrapped);
+    unlink(script);
+}
+
+/**
+ * Checks cmd's arguments for a $ one char at a time, as the baseline for the
+ * memchr scan of has_expansion
+ */
+bool has_dollar_bytewise(const command* cmd) {
+    for (int i = 0; i < cmd->argc; i++)
+        for (const char* p = cmd->argv[i]; *p != '\0'; p++)
+            if (*p == '$' || *p == '`') return true;
+    return false;
+}
+
+void bench_variables() {
+    const long rounds = 200000;
+    printf("variables: $NAME expansion, and the scan for it\n");
+
+    set_variable("X", 1, "/usr/local/bin");
+    set_variable("Y", 1, "./build");
+    double literal = time_ns(
+        rounds, [&]() { execute_line("true /usr/local/bin ./build"); });
+    double expanded = time_ns(rounds, [&]() { execute_line("true $X ${Y}"); });
+    report("true /usr/local/bin ./build", literal, "command");
+    report("true $X ${Y}", expanded, "command", literal);
+
+    // What every command without an expansion pays: a long line of them
+    std::string line = "true";
+    for (int i = 0; i < 32; i++)
+        line += " --some-long-option-" + std::to_string(i);
+    command* cmd = parse(&line[0]);
+    volatile bool found = false;
+    double bytewise =
+        time_ns(rounds, [&]() { found = found | has_dollar_bytewise(cmd); });
+    double scanned =
+        time_ns(rounds, [&]() { found = found | has_expansion(cmd); });
+    report("scan 33 args, a char at a time", bytewise, "command");
+    report("scan 33 args, has_expansion", scanned, "command", bytewise);
+    cleanup(cmd);
+    unset_variable("X", 1);
+    unset_variable("Y", 1);
+}
+
+/**
+ * A fresh envp with a copy of every entry of envp, as a shell building the
+ * environment for each program it starts would make. Kept here as the
+ * baseline for the envp variables.c keeps ready
+ */
+char** copy_envp(char* const* envp) {
+    int count = 0;
+    while (envp[count] != NULL) count++;
+    char** copy = new char*[count + 1];
+    for (int i = 0; i < count; i++) {
+        size_t size = strlen(envp[i]) + 1;
+        copy[i] = new char[size];
+        memcpy(copy[i], envp[i], size);
+    }
+    copy[count] = NULL;
+    return copy;
+}
+
+void free_envp(char** envp) {
+    for (char** entry = envp; *entry != NULL; entry++) delete[] *entry;
+    delete[] envp;
+}
+
+void bench_envp() {
+    const long rounds = 2000;
+    const int variables = 500;
+    printf("envp: /usr/bin/true launches with %d exported variables\n",
+           variables);
+
+    for (int i = 0; i < variables; i++) {
+        std::string name = "BENCH_VARIABLE_" + std::to_string(i);
+        std::string value = "/usr/local/lib/bench/" + std::to_string(i * i);
+        export_variable(name.c_str(), name.size(), value.c_str());
+    }
+
+    volatile size_t sink = 0;
+    double built = time_ns(rounds * 10, [&]() {
+        char** envp = copy_envp(variables_envp());
+        sink = sink + (envp[0] != NULL);
+        free_envp(envp);
+    });
+    double kept = time_ns(rounds * 10, [&]() {
+        sink = sink + (variables_envp()[0] != NULL);
+    });
+    report("envp built for the launch", built, "launch");
+    report("envp kept ready", kept, "launch", built);
+
+    std::string program = "/usr/bin/true";
+    command* cmd = parse(&program[0]);
+    built = time_ns(rounds, [&]() {
+        char** envp = copy_envp(variables_envp());
+        pid_t pid = spawn_command(cmd, -1, NULL);
+        if (pid > 0) waitpid(pid, NULL, 0);
+        free_envp(envp);
+    });
+    kept = time_ns(rounds, [&]() {
+        pid_t pid = spawn_command(cmd, -1, NULL);
+        if (pid > 0) waitpid(pid, NULL, 0);
+    });
+    report("spawn, envp built each time", built, "launch");
+    report("spawn, envp kept ready", kept, "launch", built);
+    cleanup(cmd);
+
+    for (int i = 0; i < variables; i++) {
+        std::string name = "BENCH_VARIABLE_" + std::to_string(i);
+        unset_variable(name.c_str(), name.size());
+    }
+}
+
+/**
+ * Runs ./main -c text in a child process and waits for it
+ */
+void run_shell(const char* text) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        const char* argv[] = {"./main", "-c", text, NULL};
+        execv("./main", const_cast<char**>(argv));
+        _exit(127);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+void bench_tail_exec() {
+    const long rounds = 500;
+    if (access("./main", X_OK) != 0) {
+        printf("tail-exec: needs ./main, run make first\n");
+        return;
+    }
+    printf("tail-exec: a wrapper script, ./main -c text\n");
+
+    // A built-in after the program keeps the shell around to wait for it
+    double waited = time_ns(rounds, []() { run_shell("sleep 0\ntrue"); });
+    double replaced = time_ns(rounds, []() { run_shell("true\nsleep 0"); });
+    report("sleep 0, then true (fork + wait)", waited, "script");
+    report("true, then sleep 0 (exec)", replaced, "script", waited);
+}
+
+struct benchmark {
+    const char* name;
+    void (*run)();
+};
+
+const benchmark BENCHMARKS[] = {
+    {"parse", bench_parse},
+    {"pool", bench_pool},
+    {"reader", bench_reader},
+    {"script", bench_script},
+    {"path", bench_path},
+    {"probe", bench_probe},
+    {"spawn", bench_spawn},
+    {"exec", bench_exec},
+    {"builtins", bench_builtins},
+    {"lookup", bench_lookup},
+    {"jobs", bench_jobs},
+    {"parallel", bench_parallel},
+    {"keep-order", bench_keep_order},
+    {"xargs", bench_xargs},
+    {"time", bench_time},
+    {"substitution", bench_substitution},
+    {"redirect", bench_redirect},
+    {"variables", bench_variables},
+    {"envp", bench_envp},
+    {"tail-exec", bench_tail_exec},
+};
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    const char* filter = argc > 1 ? argv[1] : "";
+    for (const benchmark& b : BENCHMARKS) {
+        if (strstr(b.name, filter) == NULL) continue;
+        b.run();
+        printf("\n");
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,728 @@
+#include "builtins.h"
+
+#include <inttypes.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
+
+#include "jobs.h"
+#include "parallel.h"
+#include "path_cache.h"
+#include "variables.h"
+#include "xargs.h"
+
+/**
+ * builtins.c - The built-in commands and their lookup table
+ *
+ * echo, pwd, true, false and printf are the commands scripts run most. As
+ * external programs each one costs a fork (or clone) and an execve, and then
+ * the program's own dynamic loading, all to write a few bytes. Here they
+ * write into the shell's stdout buffer directly. Their parsing follows GNU
+ * coreutils 9 (echo.c, pwd.c and printf.c) so the output stays byte for byte
+ * the same.
+ */
+
+// cd [dir]
+int builtin_cd(command* cmd) {
+    if (cmd->argc == 1)
+        return chdir(getenv("HOME"));  // cd with no arguments
+    else if (cmd->argc == 2)
+        return chdir(cmd->argv[1]);  // cd with 1 arg
+    else {
+        fprintf(stderr, "cd: Too many arguments\n");
+        return ERROR;
+    }
+}
+
+// exit
+int builtin_exit(command* cmd) {
+    (void)cmd;
+    exit(SUCCESS);
+}
+
+// exec [command [args...]]
+int builtin_exec(command* cmd) {
+    command* program = create_command_from_args(cmd->argc - 1, cmd->argv + 1);
+    int status = exec_command(program);
+    cleanup(program);
+    return status;
+}
+
+// hash [-r] [-d name...] [name...]: lists, clears, forgets or pre-seeds the
+// remembered full paths of programs, like the bash builtin
+int builtin_hash(command* cmd) {
+    // No arguments: list what is remembered, with hit counts
+    if (cmd->argc == 1) {
+        int size = path_cache_size();
+        if (size == 0) {
+            printf("hash: hash table empty\n");
+            return SUCCESS;
+        }
+        path_cache_entry* entries = new path_cache_entry[size];
+        path_cache_entries(entries, size);
+        printf("hits\tcommand\n");
+        for (int i = 0; i < size; i++)
+            printf("%4lu\t%s\n", entries[i].hits, entries[i].path);
+        delete[] entries;
+        return SUCCESS;
+    }
+
+    int status = SUCCESS;
+    bool forget = false;
+    for (int i = 1; i < cmd->argc; i++) {
+        const char* arg = cmd->argv[i];
+        if (strcmp(arg, "-r") == 0) {
+            path_cache_clear();
+        } else if (strcmp(arg, "-d") == 0) {
+            forget = true;
+        } else if (forget) {
+            if (!path_cache_remove(arg)) {
+                fprintf(stderr, "hash: %s: not found\n", arg);
+                status = ERROR;
+            }
+        } else if (!path_cache_add(arg)) {
+            fprintf(stderr, "hash: %s: not found\n", arg);
+            status = ERROR;
+        }
+    }
+    return status;
+}
+
+// What an escape sequence asked for
+typedef enum {
+    // Keep going
+    ESCAPE_CONTINUE,
+    // \c: produce no further output
+    ESCAPE_STOP,
+} escape_result;
+
+// Prints a message on stderr, after what is buffered for stdout, as the
+// programs do through error(3)
+static void report(const char* format, ...) {
+    fflush(stdout);
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+// Value of a hexadecimal digit
+static int hex_value(char c) {
+    if (c >= 'a') return c - 'a' + 10;
+    if (c >= 'A') return c - 'A' + 10;
+    return c - '0';
+}
+
+static inline bool is_octal(char c) {
+    return c >= '0' && c <= '7';
+}
+
+// Returns true if arg is exactly --help or --version
+static bool is_info_option(const char* arg) {
+    return strcmp(arg, "--help") == 0 || strcmp(arg, "--version") == 0;
+}
+
+// Returns true if arg is a cluster of echo options, such as -n or -ne
+static bool is_echo_options(const char* arg) {
+    return arg[0] == '-' && arg[1] != '\0' &&
+           arg[strspn(arg + 1, "neE") + 1] == '\0';
+}
+
+// Prints s, interpreting the escapes of echo -e
+static escape_result print_echo_escapes(const char* s) {
+    while (*s) {
+        char c = *s++;
+        if (c != '\\' || *s == '\0') {
+            putchar(c);
+            continue;
+        }
+
+        switch (c = *s++) {
+            case 'a': c = '\a'; break;
+            case 'b': c = '\b'; break;
+            case 'c': return ESCAPE_STOP;
+            case 'e': c = '\x1B'; break;
+            case 'f': c = '\f'; break;
+            case 'n': c = '\n'; break;
+            case 'r': c = '\r'; break;
+            case 't': c = '\t'; break;
+            case 'v': c = '\v'; break;
+            case 'x':
+                // One or two hex digits, otherwise not an escape at all
+                if (!isxdigit((unsigned char)*s)) {
+                    putchar('\\');
+                    break;
+                }
+                c = hex_value(*s++);
+                if (isxdigit((unsigned char)*s)) c = c * 16 + hex_value(*s++);
+                break;
+            case '0':
+                // \0 followed by up to three octal digits
+                c = 0;
+                if (!is_octal(*s)) break;
+                c = *s++;
+                // fallthrough
+            case '1': case '2': case '3': case '4': case '5': case '6':
+            case '7':
+                // \NNN, up to three octal digits in all
+                c -= '0';
+                if (is_octal(*s)) c = c * 8 + (*s++ - '0');
+                if (is_octal(*s)) c = c * 8 + (*s++ - '0');
+                break;
+            case '\\': break;
+            default:
+                // Not an escape: the backslash stays
+                putchar('\\');
+                break;
+        }
+        putchar(c);
+    }
+    return ESCAPE_CONTINUE;
+}
+
+// echo [-neE]... [arg]...
+int builtin_echo(command* cmd) {
+    bool newline = true;
+    bool escapes = false;
+
+    int i = 1;
+    for (; i < cmd->argc && is_echo_options(cmd->argv[i]); i++) {
+        for (const char* p = cmd->argv[i] + 1; *p; p++) {
+            if (*p == 'n') newline = false;
+            if (*p == 'e') escapes = true;
+            if (*p == 'E') escapes = false;
+        }
+    }
+
+    for (bool first = true; i < cmd->argc; i++, first = false) {
+        if (!first) putchar(' ');
+        if (!escapes)
+            fputs(cmd->argv[i], stdout);
+        else if (print_echo_escapes(cmd->argv[i]) == ESCAPE_STOP)
+            return SUCCESS;
+    }
+    if (newline) putchar('\n');
+    return SUCCESS;
+}
+
+// Returns true if $PWD is an absolute name of the current directory without
+// . or .. components, which pwd -L prints as is
+static bool pwd_env_is_valid(const char* pwd) {
+    if (pwd == NULL || pwd[0] != '/') return false;
+    for (const char* p = pwd; (p = strstr(p, "/.")) != NULL; p++) {
+        const char* rest = p[2] == '.' ? p + 3 : p + 2;
+        if (*rest == '\0' || *rest == '/') return false;
+    }
+    struct stat named, current;
+    return stat(pwd, &named) == 0 && stat(".", &current) == 0 &&
+           named.st_ino == current.st_ino && named.st_dev == current.st_dev;
+}
+
+// pwd [-LP]
+int builtin_pwd(command* cmd) {
+    bool logical = false;
+    bool operands = false;
+    bool options_done = false;
+    for (int i = 1; i < cmd->argc; i++) {
+        const char* arg = cmd->argv[i];
+        if (options_done || arg[0] != '-' || arg[1] == '\0') {
+            operands = true;
+        } else if (strcmp(arg, "--") == 0) {
+            options_done = true;
+        } else {
+            // Only -L and -P get here, see needs_program
+            for (const char* p = arg + 1; *p; p++) logical = *p == 'L';
+        }
+    }
+    if (operands) report("pwd: ignoring non-option arguments\n");
+
+    const char* pwd = getenv("PWD");
+    if (logical && pwd_env_is_valid(pwd)) {
+        puts(pwd);
+        return SUCCESS;
+    }
+
+    // getcwd allocates a buffer as big as the directory name needs
+    char* cwd = getcwd(NULL, 0);
+    if (cwd == NULL) {
+        report("pwd: %s\n", strerror(errno));
+        return ERROR;
+    }
+    puts(cwd);
+    free(cwd);
+    return SUCCESS;
+}
+
+// true
+int builtin_true(command* cmd) {
+    (void)cmd;
+    return SUCCESS;
+}
+
+// false
+int builtin_false(command* cmd) {
+    (void)cmd;
+    return ERROR;
+}
+
+// State of one printf invocation
+typedef struct {
+    // Arguments not yet used by a conversion
+    char** args;
+    int arg_count;
+    // SUCCESS, or ERROR once an argument was bad
+    int status;
+} printf_state;
+
+// Takes the next argument, or NULL if there is none left
+static const char* next_arg(printf_state* state) {
+    if (state->arg_count == 0) return NULL;
+    state->arg_count--;
+    return *state->args++;
+}
+
+// Reports a numeric argument that was not entirely valid, like coreutils'
+// verify_numeric. errno is the conversion's errno
+static void verify_numeric(printf_state* state, const char* arg,
+                           const char* end) {
+    if (errno != 0) {
+        report("printf: '%s': %s\n", arg, strerror(errno));
+        state->status = ERROR;
+    } else if (*end != '\0') {
+        report("printf: '%s': %s\n", arg,
+               end == arg ? "expected a numeric value"
+                          : "value not completely converted");
+        state->status = ERROR;
+    }
+}
+
+// A leading quote makes a numeric argument the code of the next character
+static bool is_char_constant(const char* arg) {
+    return (arg[0] == '"' || arg[0] == '\'') && arg[1] != '\0';
+}
+
+// Returns the code of the character of a character constant, warning about
+// what follows it
+static unsigned char char_constant(const char* arg) {
+    if (arg[2] != '\0')
+        report("printf: warning: %s: character(s) following character "
+               "constant have been ignored\n",
+               arg + 2);
+    return (unsigned char)arg[1];
+}
+
+// Converts the next argument for %d and %i (0 when there is none)
+static intmax_t signed_arg(printf_state* state) {
+    const char* arg = next_arg(state);
+    if (arg == NULL) return 0;
+    if (is_char_constant(arg)) return char_constant(arg);
+    char* end;
+    errno = 0;
+    intmax_t value = strtoimax(arg, &end, 0);
+    verify_numeric(state, arg, end);
+    return value;
+}
+
+// Converts the next argument for %o, %u, %x and %X
+static uintmax_t unsigned_arg(printf_state* state) {
+    const char* arg = next_arg(state);
+    if (arg == NULL) return 0;
+    if (is_char_constant(arg)) return char_constant(arg);
+    char* end;
+    errno = 0;
+    uintmax_t value = strtoumax(arg, &end, 0);
+    verify_numeric(state, arg, end);
+    return value;
+}
+
+// Converts the next argument for the floating point conversions
+static long double float_arg(printf_state* state) {
+    const char* arg = next_arg(state);
+    if (arg == NULL) return 0;
+    if (is_char_constant(arg)) return char_constant(arg);
+    char* end;
+    errno = 0;
+    long double value = strtold(arg, &end);
+    verify_numeric(state, arg, end);
+    return value;
+}
+
+// Prints the character of escape sequences such as \n, for printf's format
+// and %b
+static escape_result print_escape_char(char c) {
+    switch (c) {
+        case 'a': c = '\a'; break;
+        case 'b': c = '\b'; break;
+        case 'c': return ESCAPE_STOP;
+        case 'e': c = '\x1B'; break;
+        case 'f': c = '\f'; break;
+        case 'n': c = '\n'; break;
+        case 'r': c = '\r'; break;
+        case 't': c = '\t'; break;
+        case 'v': c = '\v'; break;
+    }
+    putchar(c);
+    return ESCAPE_CONTINUE;
+}
+
+// Prints the escape sequence at *p (just past its backslash) and moves *p
+// past it. For %b (octal_0), octal escapes may have an extra leading 0.
+// Returns ERROR for \x without hex digits, which ends printf
+static int print_printf_escape(const char** p, bool octal_0,
+                               escape_result* result) {
+    const char* s = *p;
+    *result = ESCAPE_CONTINUE;
+
+    if (*s == 'x') {
+        int value = 0, digits = 0;
+        for (s++; digits < 2 && isxdigit((unsigned char)*s); digits++, s++)
+            value = value * 16 + hex_value(*s);
+        if (digits == 0) {
+            report("printf: missing hexadecimal number in escape\n");
+            return ERROR;
+        }
+        putchar(value);
+    } else if (is_octal(*s)) {
+        int value = 0, digits = 0;
+        if (octal_0 && *s == '0') s++;
+        for (; digits < 3 && is_octal(*s); digits++, s++)
+            value = value * 8 + (*s - '0');
+        putchar(value);
+    } else if (*s != '\0' && strchr("\"\\abcefnrtv", *s) != NULL) {
+        *result = print_escape_char(*s++);
+    } else {
+        // Not an escape: the backslash stays
+        putchar('\\');
+        if (*s != '\0') putchar(*s++);
+    }
+
+    *p = s;
+    return SUCCESS;
+}
+
+// Prints arg for %b, interpreting its escapes
+static int print_escaped_arg(const char* arg, escape_result* result) {
+    *result = ESCAPE_CONTINUE;
+    for (const char* p = arg; *p != '\0';) {
+        if (*p != '\\') {
+            putchar(*p++);
+            continue;
+        }
+        p++;
+        if (print_printf_escape(&p, true, result) == ERROR) return ERROR;
+        if (*result == ESCAPE_STOP) break;
+    }
+    return SUCCESS;
+}
+
+// Takes a * field width or precision from the next argument, like coreutils
+// rejecting values that don't fit an int. Returns false if it doesn't
+static bool star_arg(printf_state* state, const char* what, int* value) {
+    const char* arg = state->arg_count > 0 ? state->args[0] : "";
+    intmax_t n = signed_arg(state);
+    if (n < INT_MIN || n > INT_MAX) {
+        report("printf: invalid %s: '%s'\n", what, arg);
+        return false;
+    }
+    *value = n;
+    return true;
+}
+
+// Flags of a conversion specification
+static const char PRINTF_FLAGS[] = "-+ #0'I";
+// Length modifiers, which printf accepts and ignores
+static const char PRINTF_LENGTHS[] = "hlLjtz";
+
+// Prints format once, using up arguments for its conversions, and returns how
+// many it used. *result is ESCAPE_STOP when printf must not go on, either
+// because of \c or because of an error (then ERROR in state->status)
+static int print_format(const char* format, printf_state* state,
+                        escape_result* result) {
+    int used_before = state->arg_count;
+    *result = ESCAPE_CONTINUE;
+
+    for (const char* p = format; *p != '\0';) {
+        if (*p == '\\') {
+            p++;
+            if (print_printf_escape(&p, false, result) == ERROR) {
+                state->status = ERROR;
+                *result = ESCAPE_STOP;
+            } else if (*result == ESCAPE_STOP) {
+                // \c ends printf successfully, even after an error
+                state->status = SUCCESS;
+            }
+            if (*result == ESCAPE_STOP) return 0;
+            continue;
+        }
+        if (*p != '%') {
+            // Copy the plain text up to the next escape or conversion at once
+            size_t len = strcspn(p, "\\%");
+            fwrite(p, 1, len, stdout);
+            p += len;
+            continue;
+        }
+
+        const char* spec = p++;
+        if (*p == '%') {
+            putchar('%');
+            p++;
+            continue;
+        }
+        if (*p == 'b') {
+            p++;
+            const char* arg = next_arg(state);
+            if (arg == NULL) continue;
+            if (print_escaped_arg(arg, result) == ERROR) {
+                state->status = ERROR;
+                *result = ESCAPE_STOP;
+            } else if (*result == ESCAPE_STOP) {
+                state->status = SUCCESS;
+            }
+            if (*result == ESCAPE_STOP) return 0;
+            continue;
+        }
+
+        // Rebuild the specification for the C library: flags, then * for
+        // both the width and the precision (a negative precision counts as
+        // none), then the length modifier for our argument types
+        char c_spec[32] = "%";
+        size_t flags = strspn(p, PRINTF_FLAGS);
+        // Repeated flags mean nothing more; keep the spec short
+        for (size_t i = 0; i < flags && strlen(c_spec) < 16; i++)
+            if (strchr(c_spec, p[i]) == NULL) strncat(c_spec, p + i, 1);
+        p += flags;
+
+        int width = 0;
+        int precision = -1;
+        if (*p == '*') {
+            p++;
+            if (!star_arg(state, "field width", &width)) {
+                state->status = ERROR;
+                *result = ESCAPE_STOP;
+                return 0;
+            }
+        } else {
+            for (; isdigit((unsigned char)*p) && width < INT_MAX / 10; p++)
+                width = width * 10 + (*p - '0');
+        }
+        if (*p == '.') {
+            p++;
+            precision = 0;
+            if (*p == '*') {
+                p++;
+                if (!star_arg(state, "precision", &precision)) {
+                    state->status = ERROR;
+                    *result = ESCAPE_STOP;
+                    return 0;
+                }
+            } else {
+                for (; isdigit((unsigned char)*p) && precision < INT_MAX / 10;
+                     p++)
+                    precision = precision * 10 + (*p - '0');
+            }
+        }
+        // Length modifiers are accepted, and have no effect
+        p += strspn(p, PRINTF_LENGTHS);
+
+        char conversion = *p;
+        if (conversion == '\0' ||
+            strchr("diouxXfFeEgGaAcs", conversion) == NULL) {
+            if (conversion != '\0') p++;
+            report("printf: %.*s: invalid conversion specification\n",
+                   (int)(p - spec), spec);
+            state->status = ERROR;
+            *result = ESCAPE_STOP;
+            return 0;
+        }
+        p++;
+
+        strcat(c_spec, "*.*");
+        size_t end = strlen(c_spec);
+        if (strchr("di", conversion) != NULL) {
+            c_spec[end] = 'j';
+            c_spec[end + 1] = conversion;
+            printf(c_spec, width, precision, signed_arg(state));
+        } else if (strchr("ouxX", conversion) != NULL) {
+            c_spec[end] = 'j';
+            c_spec[end + 1] = conversion;
+            printf(c_spec, width, precision, unsigned_arg(state));
+        } else if (conversion == 'c') {
+            c_spec[end] = conversion;
+            const char* arg = next_arg(state);
+            printf(c_spec, width, precision, arg != NULL ? arg[0] : '\0');
+        } else if (conversion == 's') {
+            c_spec[end] = conversion;
+            const char* arg = next_arg(state);
+            printf(c_spec, width, precision, arg != NULL ? arg : "");
+        } else {
+            c_spec[end] = 'L';
+            c_spec[end + 1] = conversion;
+            printf(c_spec, width, precision, float_arg(state));
+        }
+    }
+
+    return used_before - state->arg_count;
+}
+
+// printf format [arg]...
+int builtin_printf(command* cmd) {
+    // "--" in front of the format is skipped
+    int first = cmd->argc > 1 && strcmp(cmd->argv[1], "--") == 0 ? 2 : 1;
+    const char* format = cmd->argv[first];
+
+    printf_state state;
+    state.args = cmd->argv + first + 1;
+    state.arg_count = cmd->argc - first - 1;
+    state.status = SUCCESS;
+
+    // The format is used again for as long as it uses up arguments
+    int used;
+    escape_result result;
+    do {
+        used = print_format(format, &state, &result);
+        if (result == ESCAPE_STOP) return state.status;
+    } while (used > 0 && state.arg_count > 0);
+
+    if (state.arg_count > 0)
+        report("printf: warning: ignoring excess arguments, starting with "
+               "'%s'\n",
+               state.args[0]);
+    return state.status;
+}
+
+// Returns true if format has a %q conversion, which quotes its argument for
+// the shell the way ls does
+static bool has_quoting_conversion(const char* format) {
+    for (const char* p = format; (p = strchr(p, '%')) != NULL;) {
+        p++;
+        if (*p == '%') {
+            p++;
+            continue;
+        }
+        p += strspn(p, PRINTF_FLAGS);
+        p += strspn(p, "0123456789*.");
+        p += strspn(p, PRINTF_LENGTHS);
+        if (*p == 'q') return true;
+    }
+    return false;
+}
+
+// Picks out the invocations of echo, pwd, true, false and printf that are
+// left to the real programs
+static bool needs_program(const command* cmd) {
+    const char* name = cmd->argv[0];
+
+    // --help and --version, as the only argument
+    if (cmd->argc == 2 && is_info_option(cmd->argv[1])) return true;
+
+    // pwd with an option other than -L or -P
+    if (strcmp(name, "pwd") == 0) {
+        for (int i = 1; i < cmd->argc; i++) {
+            const char* arg = cmd->argv[i];
+            if (strcmp(arg, "--") == 0) break;
+            if (arg[0] == '-' && arg[1] != '\0' &&
+                arg[strspn(arg + 1, "LP") + 1] != '\0')
+                return true;
+        }
+        return false;
+    }
+
+    // printf without a format, with \u or \U escapes, or with %q
+    if (strcmp(name, "printf") == 0) {
+        int first = cmd->argc > 1 && strcmp(cmd->argv[1], "--") == 0 ? 2 : 1;
+        if (first >= cmd->argc) return true;
+        for (int i = first; i < cmd->argc; i++)
+            if (strstr(cmd->argv[i], "\\u") != NULL ||
+                strstr(cmd->argv[i], "\\U") != NULL)
+                return true;
+        return has_quoting_conversion(cmd->argv[first]);
+    }
+    return false;
+}
+
+// Every builtin, one line each
+static constexpr builtin BUILTINS[] = {
+    {"cd", builtin_cd, NULL, false},
+    {"exit", builtin_exit, NULL, false},
+    {EXEC_BUILTIN, builtin_exec, NULL, false},
+    {"hash", builtin_hash, NULL, false},
+    {"echo", builtin_echo, needs_program, true},
+    {"pwd", builtin_pwd, needs_program, true},
+    {"true", builtin_true, needs_program, true},
+    {"false", builtin_false, needs_program, true},
+    {"printf", builtin_printf, needs_program, true},
+    {"jobs", builtin_jobs, NULL, false},
+    {"wait", builtin_wait, NULL, false},
+    {"fg", builtin_fg, NULL, false},
+    {"parallel", builtin_parallel, NULL, false},
+    {"xargs", builtin_xargs, NULL, false},
+    {"export", builtin_export, NULL, false},
+    {"unset", builtin_unset, NULL, false},
+};
+
+static constexpr size_t BUILTIN_COUNT = sizeof(BUILTINS) / sizeof(BUILTINS[0]);
+
+// The hash table has 2^BUILTIN_SLOT_BITS slots, at least twice as many as
+// there are builtins, so a seed without collisions turns up after a few tries
+static constexpr int builtin_slot_bits() {
+    int bits = 1;
+    while ((size_t{1} << bits) < 2 * BUILTIN_COUNT) bits++;
+    return bits;
+}
+static constexpr int BUILTIN_SLOT_BITS = builtin_slot_bits();
+static constexpr size_t BUILTIN_SLOTS = size_t{1} << BUILTIN_SLOT_BITS;
+
+// Seeds tried before giving up on a perfect hash
+#define BUILTIN_MAX_SEEDS 4096
+
+// Slot of name: the top bits of its FNV-1a hash, starting from seed. The low
+// bits of a product only depend on the low bits of its factors, so they would
+// give the same slots for most seeds
+static constexpr size_t name_slot(const char* name, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ seed;
+    for (; *name != '\0'; name++)
+        hash = (hash ^ static_cast<unsigned char>(*name)) * 16777619u;
+    return hash >> (32 - BUILTIN_SLOT_BITS);
+}
+
+// A collision-free placement of BUILTINS
+typedef struct {
+    uint32_t seed;
+    // Index in BUILTINS + 1 of the builtin in each slot, 0 for none
+    uint8_t slots[BUILTIN_SLOTS];
+    bool perfect;
+} builtin_table;
+
+// Tries seed after seed until every name hashes to a slot of its own
+static constexpr builtin_table make_builtin_table() {
+    for (uint32_t seed = 0; seed < BUILTIN_MAX_SEEDS; seed++) {
+        builtin_table table = {};
+        table.seed = seed;
+        table.perfect = true;
+        for (size_t i = 0; i < BUILTIN_COUNT && table.perfect; i++) {
+            uint8_t& slot = table.slots[name_slot(BUILTINS[i].name, seed)];
+            if (slot != 0) table.perfect = false;
+            slot = i + 1;
+        }
+        if (table.perfect) return table;
+    }
+    return builtin_table{};
+}
+
+static constexpr builtin_table BUILTIN_TABLE = make_builtin_table();
+// Also fails for a name registered twice
+static_assert(BUILTIN_TABLE.perfect,
+              "no perfect hash for the builtin names: raise BUILTIN_MAX_SEEDS");
+
+// One hash, one slot, one comparison
+const builtin* find_builtin(const command* cmd) {
+    const char* name = cmd->argv[0];
+    uint8_t slot = BUILTIN_TABLE.slots[name_slot(name, BUILTIN_TABLE.seed)];
+    if (slot == 0) return NULL;
+
+    const builtin* found = &BUILTINS[slot - 1];
+    if (strcmp(found->name, name) != 0) return NULL;
+    if (found->leave_to_program != NULL && found->leave_to_program(cmd))
+        return NULL;
+    return found;
+}
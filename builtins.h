@@ -0,0 +1,135 @@
+#ifndef BUILTINS_H
+#define BUILTINS_H
+
+#include "shell.h"
+
+/**
+ * The shell's built-in commands, and the table they are looked up in.
+ *
+ * Every builtin is one line of BUILTINS in builtins.c: its name, the function
+ * running it and, optionally, a function picking out the invocations that are
+ * better left to the program of the same name. A perfect hash of the names is
+ * computed from that table at compile time, so find_builtin takes one hash of
+ * argv[0] and one string comparison, however many builtins there are.
+ *
+ * echo, pwd, true, false and printf write exactly what the GNU coreutils
+ * programs of the same name write to stdout (in the C locale) and return
+ * SUCCESS where those exit with 0, but go through the shell's stdout buffer
+ * instead of costing a process each. Messages on stderr are prefixed with the
+ * bare name (e.g. "printf: "). The few invocations whose output depends on
+ * things they don't reproduce (--help, --version, unknown options, printf's \u
+ * and \U escapes, which depend on the locale, and its %q shell quoting) are
+ * left to the programs.
+ */
+
+// Built-in replacing the shell with a program (see exec_command)
+#define EXEC_BUILTIN "exec"
+
+// A built-in command
+typedef struct {
+    const char* name;
+    // Runs the command, returning SUCCESS or ERROR
+    int (*run)(command* cmd);
+    // Returns true for the invocations the program of the same name should
+    // run instead, or NULL if there are none
+    bool (*leave_to_program)(const command* cmd);
+    // Only writes to stdout and stderr: it changes nothing in the shell and
+    // starts no process, so it may run in the shell itself even where a
+    // subshell is called for (as in a command substitution)
+    bool output_only;
+} builtin;
+
+/**
+ * Looks up the builtin cmd invokes, with a single probe of a perfect hash
+ * table.
+ *
+ * @param cmd
+ * @return the builtin | NULL (not a builtin, or one leaving this invocation
+ * to the program)
+ */
+const builtin* find_builtin(const command* cmd);
+
+/**
+ * cd [dir]: changes to dir, or to $HOME without an argument.
+ *
+ * @param cmd
+ * @return SUCCESS | ERROR
+ */
+int builtin_cd(command* cmd);
+
+/**
+ * exit: exits the shell with status 0.
+ *
+ * @param cmd
+ * @return does not return
+ */
+int builtin_exit(command* cmd);
+
+/**
+ * exec [command [args...]] [redirections]: replaces the shell with the
+ * program command (see exec_command), or with only redirections, applies
+ * them to the shell for good.
+ *
+ * @param cmd
+ * @return does not return | SUCCESS | ERROR (the program can't be run)
+ */
+int builtin_exec(command* cmd);
+
+/**
+ * hash [-r] [-d name...] [name...]: with no arguments, lists the remembered
+ * programs and how often each was looked up; hash -r forgets all of them,
+ * hash -d name forgets one, and hash name looks name up and remembers it
+ * ahead of time.
+ *
+ * @param cmd
+ * @return SUCCESS | ERROR (a name was not found)
+ */
+int builtin_hash(command* cmd);
+
+/**
+ * echo [-neE]... [arg]...: prints the arguments separated by spaces, then a
+ * newline unless -n is given. With -e, backslash escapes (\n, \t, \0NNN,
+ * \xHH, \c to stop, ...) are interpreted.
+ *
+ * @param cmd
+ * @return SUCCESS
+ */
+int builtin_echo(command* cmd);
+
+/**
+ * pwd [-LP]: prints the physical current directory, or with -L, $PWD if it
+ * names the current directory without . or .. components.
+ *
+ * @param cmd
+ * @return SUCCESS | ERROR (the directory can't be determined)
+ */
+int builtin_pwd(command* cmd);
+
+/**
+ * true: does nothing, successfully. Arguments are ignored.
+ *
+ * @param cmd
+ * @return SUCCESS
+ */
+int builtin_true(command* cmd);
+
+/**
+ * false: does nothing, unsuccessfully. Arguments are ignored.
+ *
+ * @param cmd
+ * @return ERROR
+ */
+int builtin_false(command* cmd);
+
+/**
+ * printf format [arg]...: prints format with its escapes interpreted and its
+ * conversions (%d, %s, %b, %5.2f, %*x, ...) filled in from the arguments,
+ * reusing format as long as arguments remain. An argument that isn't a valid
+ * number is reported and counts as 0.
+ *
+ * @param cmd
+ * @return SUCCESS | ERROR (a conversion or argument was invalid)
+ */
+int builtin_printf(command* cmd);
+
+#endif  // BUILTINS_H
@@ -0,0 +1,455 @@
+#include "jobs.h"
+
+#include <signal.h>
+#include <sys/epoll.h>
+
+#include "pipeline.h"
+#include "spawn.h"
+
+/**
+ * jobs.c - Background jobs, reaped through pidfds in an epoll set
+ *
+ * Each process of a job has a job_process record, and the epoll event of its
+ * pidfd points straight at it, so an exit is matched to its job without any
+ * search. Job IDs are handed out as in bash: one more than the highest in
+ * use, which keeps them small and the table indexed by them dense.
+ */
+
+typedef struct job job;
+
+// One process of a job
+typedef struct {
+    job* owner;
+    pid_t pid;
+    // Open until the process is reaped; -1 without pidfds
+    int pidfd;
+    bool exited;
+} job_process;
+
+struct job {
+    int id;
+    // The command as typed, without the &
+    char* text;
+    job_process* processes;
+    int count;
+    // Processes not reaped yet
+    int running;
+    // Wait status of the last process, or -1 if it never started
+    int status;
+};
+
+static struct {
+    // Indexed by job ID, NULL where there is none
+    job** by_id;
+    int capacity;
+    // Highest job ID in use, 0 if there are no jobs
+    int highest;
+    // Processes of all jobs not reaped yet
+    int running;
+    // Running processes without a pidfd
+    int unwatched;
+    int epoll_fd;
+    bool interactive;
+} jobs = {NULL, 0, 0, 0, 0, -1, false};
+
+// Returns true if arg is the & token
+static inline bool is_job_token(const char* arg) {
+    return arg[0] == JOB_TOKEN[0] && arg[1] == '\0';
+}
+
+// Checks cmd's arguments for a &
+bool has_background(const command* cmd) {
+    for (int i = 0; i < cmd->argc; i++)
+        if (is_job_token(cmd->argv[i])) return true;
+    return false;
+}
+
+void jobs_set_interactive(bool on) {
+    jobs.interactive = on;
+}
+
+int jobs_count() {
+    int count = 0;
+    for (int id = 1; id <= jobs.highest; id++)
+        if (jobs.by_id[id] != NULL) count++;
+    return count;
+}
+
+// Joins args with spaces, into a new string
+static char* join_args(int argc, char* const* args) {
+    size_t len = 0;
+    for (int i = 0; i < argc; i++) len += strlen(args[i]) + 1;
+    char* text = new char[len + 1];
+    text[0] = '\0';
+    char* end = text;
+    for (int i = 0; i < argc; i++) {
+        if (i > 0) *end++ = ' ';
+        size_t arg_len = strlen(args[i]);
+        memcpy(end, args[i], arg_len + 1);
+        end += arg_len;
+    }
+    return text;
+}
+
+// Watches process's pidfd in the epoll set, or leaves it to waitpid
+static void watch(job_process* process) {
+    if (jobs.epoll_fd < 0) jobs.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    process->pidfd = jobs.epoll_fd >= 0 ? open_pidfd(process->pid) : -1;
+    if (process->pidfd >= 0) {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = process;
+        int added =
+            epoll_ctl(jobs.epoll_fd, EPOLL_CTL_ADD, process->pidfd, &event);
+        if (added == 0) return;
+        close(process->pidfd);
+        process->pidfd = -1;
+    }
+    jobs.unwatched++;
+}
+
+// Records that process exited with status, once it has been reaped
+static void finish(job_process* process, int status) {
+    job* owner = process->owner;
+    if (process->pidfd >= 0) {
+        // Closing it is not enough while a forked child still has a copy: the
+        // epoll set would keep reporting it
+        epoll_ctl(jobs.epoll_fd, EPOLL_CTL_DEL, process->pidfd, NULL);
+        close(process->pidfd);
+        process->pidfd = -1;
+    } else {
+        jobs.unwatched--;
+    }
+    process->exited = true;
+    owner->running--;
+    jobs.running--;
+    if (process == &owner->processes[owner->count - 1]) owner->status = status;
+}
+
+// Reaps the processes whose pidfds are ready, waiting up to timeout
+// milliseconds (-1: for ever) for the first. Returns how many there were
+static int reap_ready(int timeout) {
+    struct epoll_event events[JOBS_EVENT_BATCH];
+    int ready = epoll_wait(jobs.epoll_fd, events, JOBS_EVENT_BATCH, timeout);
+    if (ready < 0) {
+        if (errno != EINTR) perror("epoll_wait failed");
+        return 0;
+    }
+    for (int i = 0; i < ready; i++) {
+        job_process* process = static_cast<job_process*>(events[i].data.ptr);
+        int status;
+        // Its pidfd is readable, so this doesn't block. Should the process be
+        // gone already, its status is lost, but the job still ends
+        if (waitpid(process->pid, &status, 0) != process->pid) status = -1;
+        finish(process, status);
+    }
+    return ready;
+}
+
+// Finds the process pid among the jobs, skipping those that have exited
+// unless with_exited is set (their pid may have been reused since)
+static job_process* find_process(pid_t pid, bool with_exited) {
+    for (int id = 1; id <= jobs.highest; id++) {
+        job* j = jobs.by_id[id];
+        if (j == NULL) continue;
+        for (int i = 0; i < j->count; i++) {
+            job_process* process = &j->processes[i];
+            if (process->pid == pid && (with_exited || !process->exited))
+                return process;
+        }
+    }
+    return NULL;
+}
+
+// Reaps, with waitpid, the processes of jobs that have exited, blocking for
+// the first one if block is set. For use while some processes have no pidfd
+static void reap_unwatched(bool block) {
+    while (jobs.unwatched > 0) {
+        int status;
+        // Every other child is waited for where it was started, so any child
+        // exiting now belongs to a job (watched or not)
+        pid_t pid = waitpid(-1, &status, block ? 0 : WNOHANG);
+        if (pid <= 0) return;
+        job_process* process = find_process(pid, false);
+        if (process != NULL) finish(process, status);
+        block = false;
+    }
+}
+
+void jobs_reap() {
+    if (jobs.running == 0) return;
+    reap_unwatched(false);
+    // A full batch means there may be more
+    while (jobs.running > jobs.unwatched &&
+           reap_ready(0) == JOBS_EVENT_BATCH) {
+    }
+}
+
+// Blocks until at least one more process of a job has exited
+static void reap_next() {
+    if (jobs.unwatched > 0)
+        reap_unwatched(true);
+    else
+        reap_ready(-1);
+}
+
+// Adds a job for the started processes pids (-1 for those not started).
+// Returns NULL if none of them started
+static job* add_job(const pid_t* pids, int count, char* text) {
+    bool started = false;
+    for (int i = 0; i < count; i++)
+        if (pids[i] > 0) started = true;
+    if (!started) return NULL;
+
+    job* j = new job;
+    j->id = jobs.highest + 1;
+    j->text = text;
+    j->processes = new job_process[count];
+    j->count = count;
+    j->running = 0;
+    j->status = -1;
+
+    // Grow the table by doubling
+    if (j->id >= jobs.capacity) {
+        int capacity = jobs.capacity == 0 ? 16 : jobs.capacity * 2;
+        job** grown = new job*[capacity];
+        for (int i = 0; i < capacity; i++)
+            grown[i] = i < jobs.capacity ? jobs.by_id[i] : NULL;
+        delete[] jobs.by_id;
+        jobs.by_id = grown;
+        jobs.capacity = capacity;
+    }
+    jobs.by_id[j->id] = j;
+    jobs.highest = j->id;
+
+    for (int i = 0; i < count; i++) {
+        job_process* process = &j->processes[i];
+        process->owner = j;
+        process->pid = pids[i];
+        process->pidfd = -1;
+        process->exited = pids[i] <= 0;
+        if (process->exited) continue;
+        j->running++;
+        jobs.running++;
+        watch(process);
+    }
+    return j;
+}
+
+// Drops a finished job from the table
+static void remove_job(job* j) {
+    jobs.by_id[j->id] = NULL;
+    while (jobs.highest > 0 && jobs.by_id[jobs.highest] == NULL)
+        jobs.highest--;
+    delete[] j->text;
+    delete[] j->processes;
+    delete j;
+}
+
+// Starts the command or pipeline cmd as a job
+static int start_job(command* cmd) {
+    // Before find_full_path replaces the program name with its path
+    char* text = join_args(cmd->argc, cmd->argv);
+
+    // Without job control, a job must not read what is typed to the shell
+    int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    // A command without | is a pipeline of one
+    int count;
+    pid_t* pids = start_pipeline(cmd, null_fd, -1, &count);
+    if (null_fd >= 0) close(null_fd);
+    if (pids == NULL) {
+        delete[] text;
+        return ERROR;
+    }
+
+    job* j = add_job(pids, count, text);
+    if (j == NULL) delete[] text;
+    if (j != NULL && jobs.interactive) {
+        // bash reports the last process of a pipeline
+        fprintf(stderr, "[%d] %d\n", j->id, pids[count - 1]);
+    }
+    delete[] pids;
+    return j != NULL ? SUCCESS : ERROR;
+}
+
+// Starts every command followed by &, then executes the rest
+int execute_background(command* cmd) {
+    // Nothing runs if there is an empty command anywhere
+    for (int i = 0, start = 0; i < cmd->argc; i++) {
+        if (!is_job_token(cmd->argv[i])) continue;
+        if (i == start) {
+            fprintf(stderr, "syntax error near unexpected token `%s'\n",
+                    JOB_TOKEN);
+            return ERROR;
+        }
+        start = i + 1;
+    }
+
+    int status = SUCCESS;
+    int start = 0;
+    for (int i = 0; i < cmd->argc; i++) {
+        if (!is_job_token(cmd->argv[i])) continue;
+        command* job_cmd =
+            create_command_from_args(i - start, cmd->argv + start);
+        status = start_job(job_cmd);
+        cleanup(job_cmd);
+        start = i + 1;
+    }
+    if (start == cmd->argc) return status;
+
+    command* rest =
+        create_command_from_args(cmd->argc - start, cmd->argv + start);
+    status = execute(rest);
+    cleanup(rest);
+    return status;
+}
+
+// SUCCESS if the last process of j exited with status 0
+static int job_result(const job* j) {
+    return j->status != -1 && WIFEXITED(j->status) &&
+                   WEXITSTATUS(j->status) == 0
+               ? SUCCESS
+               : ERROR;
+}
+
+// Waits for every process of j, then forgets j and returns its result
+static int wait_job(job* j) {
+    // Flush what is buffered, so it shows up ahead of the job's later output
+    fflush(stdout);
+    while (j->running > 0) reap_next();
+    int result = job_result(j);
+    remove_job(j);
+    return result;
+}
+
+// The current job (the latest one), or NULL
+static job* current_job() {
+    return jobs.highest > 0 ? jobs.by_id[jobs.highest] : NULL;
+}
+
+// The job before the current one, or NULL
+static job* previous_job() {
+    for (int id = jobs.highest - 1; id > 0; id--)
+        if (jobs.by_id[id] != NULL) return jobs.by_id[id];
+    return NULL;
+}
+
+// Finds the job named by spec: %N, %%, %+ or %-, or (if by_pid) the job of a
+// process ID, otherwise a job ID
+static job* find_job(const char* spec, bool by_pid) {
+    if (strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0 ||
+        strcmp(spec, "%") == 0)
+        return current_job();
+    if (strcmp(spec, "%-") == 0) return previous_job();
+
+    const char* digits = spec[0] == '%' ? spec + 1 : spec;
+    char* end;
+    long number = strtol(digits, &end, 10);
+    if (*digits == '\0' || *end != '\0' || number <= 0) return NULL;
+    if (spec[0] != '%' && by_pid) {
+        job_process* process = find_process(number, true);
+        return process != NULL ? process->owner : NULL;
+    }
+    return number <= jobs.highest ? jobs.by_id[number] : NULL;
+}
+
+// How jobs shows the state of j
+static void describe_state(const job* j, char* state, size_t size) {
+    if (j->running > 0)
+        snprintf(state, size, "Running");
+    else if (j->status != -1 && WIFSIGNALED(j->status))
+        snprintf(state, size, "%s", strsignal(WTERMSIG(j->status)));
+    else if (j->status == -1 || WEXITSTATUS(j->status) != 0)
+        snprintf(state, size, "Exit %d",
+                 j->status == -1 ? 127 : WEXITSTATUS(j->status));
+    else
+        snprintf(state, size, "Done");
+}
+
+// Prints the line of j in the format of bash's jobs
+static void print_job(const job* j) {
+    char mark = j == current_job() ? '+' : j == previous_job() ? '-' : ' ';
+    char state[64];
+    describe_state(j, state, sizeof(state));
+    printf("[%d]%c  %-24s%s%s\n", j->id, mark, state, j->text,
+           j->running > 0 ? " &" : "");
+}
+
+void jobs_notify() {
+    if (!jobs.interactive) return;
+    for (int id = 1; id <= jobs.highest; id++) {
+        job* j = jobs.by_id[id];
+        if (j == NULL || j->running > 0) continue;
+        print_job(j);
+        remove_job(j);
+    }
+}
+
+// jobs
+int builtin_jobs(command* cmd) {
+    (void)cmd;
+    jobs_reap();
+    for (int id = 1; id <= jobs.highest; id++)
+        if (jobs.by_id[id] != NULL) print_job(jobs.by_id[id]);
+    // Finished jobs are only reported once
+    for (int id = jobs.highest; id > 0; id--) {
+        job* j = jobs.by_id[id];
+        if (j != NULL && j->running == 0) remove_job(j);
+    }
+    return SUCCESS;
+}
+
+// wait [-n] [id...]
+int builtin_wait(command* cmd) {
+    if (cmd->argc == 2 && strcmp(cmd->argv[1], "-n") == 0) {
+        if (jobs_count() == 0) return ERROR;
+        while (true) {
+            // A job that finished earlier counts, the oldest first
+            for (int id = 1; id <= jobs.highest; id++) {
+                job* j = jobs.by_id[id];
+                if (j != NULL && j->running == 0) return wait_job(j);
+            }
+            reap_next();
+        }
+    }
+
+    // Every job
+    if (cmd->argc == 1) {
+        for (int id = 1; id <= jobs.highest; id++)
+            if (jobs.by_id[id] != NULL) wait_job(jobs.by_id[id]);
+        return SUCCESS;
+    }
+
+    int status = SUCCESS;
+    for (int i = 1; i < cmd->argc; i++) {
+        const char* spec = cmd->argv[i];
+        job* j = find_job(spec, true);
+        if (j != NULL) {
+            status = wait_job(j);
+        } else if (spec[0] == '%') {
+            fprintf(stderr, "wait: %s: no such job\n", spec);
+            status = ERROR;
+        } else {
+            fprintf(stderr, "wait: pid %s is not a child of this shell\n",
+                    spec);
+            status = ERROR;
+        }
+    }
+    return status;
+}
+
+// fg [id]
+int builtin_fg(command* cmd) {
+    const char* spec = cmd->argc > 1 ? cmd->argv[1] : "%%";
+    job* j = find_job(spec, false);
+    if (j == NULL) {
+        if (cmd->argc > 1)
+            fprintf(stderr, "fg: %s: no such job\n", spec);
+        else
+            fprintf(stderr, "fg: current: no such job\n");
+        return ERROR;
+    }
+    printf("%s\n", j->text);
+    return wait_job(j);
+}
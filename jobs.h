@@ -0,0 +1,117 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include "shell.h"
+
+// Argument ending a command that runs in the background
+#define JOB_TOKEN "&"
+
+// Most exit notifications taken from the epoll set by one epoll_wait
+#define JOBS_EVENT_BATCH 64
+
+/**
+ * Background jobs.
+ *
+ * A job is a command or pipeline started with a trailing &. The shell does
+ * not wait for it; instead, a pidfd of every one of its processes goes into a
+ * single epoll set. A pidfd turns readable when its process exits, so the
+ * shell learns of exits from the set alone: no SIGCHLD handler (and so no
+ * race with one), no sleeping and retrying, and no waitpid per job to find
+ * out which ones are done. One epoll_wait hands back up to JOBS_EVENT_BATCH
+ * exits, however many jobs are running. Where pidfds are missing (Linux <
+ * 5.3), jobs are reaped with waitpid instead.
+ *
+ * There is no job control: jobs stay in the shell's process group, and
+ * their stdin is /dev/null, as in bash when job control is off.
+ */
+
+/**
+ * Returns true if one of cmd's arguments is a & (see tokenize).
+ *
+ * @param cmd
+ * @return true | false
+ */
+bool has_background(const command* cmd);
+
+/**
+ * Runs cmd, e.g. "make -j4 & sleep 1 | cat & ls": every command or pipeline
+ * followed by a & is started as a job, without waiting for it, and what
+ * follows the last & (if anything) is then executed as usual.
+ *
+ * An empty command in front of a & (as in "& ls" or "a & & b") is a syntax
+ * error, reported on stderr without starting anything.
+ *
+ * @param cmd
+ * @return the status of the command after the last & | SUCCESS if there is
+ * none and the last job was started | ERROR
+ */
+int execute_background(command* cmd);
+
+/**
+ * Has the start of every job reported on stderr as "[id] pid", and finished
+ * jobs reported by jobs_notify, as in an interactive bash.
+ *
+ * @param on
+ * @return void
+ */
+void jobs_set_interactive(bool on);
+
+/**
+ * Reaps the processes of jobs that have exited, without blocking: a single
+ * epoll_wait with no timeout, and nothing at all when no job is running.
+ * They are kept in the job table until reported (jobs, wait, fg or
+ * jobs_notify).
+ *
+ * @return void
+ */
+void jobs_reap();
+
+/**
+ * If the shell is interactive (see jobs_set_interactive), prints and forgets
+ * every finished job, e.g. "[1]+  Done                    sleep 1".
+ *
+ * @return void
+ */
+void jobs_notify();
+
+/**
+ * Returns the number of jobs in the table, running or finished but not yet
+ * reported.
+ *
+ * @return int
+ */
+int jobs_count();
+
+/**
+ * jobs: lists the jobs, e.g. "[2]+  Running                 sleep 10 &",
+ * with + marking the current (latest) job and - the one before. Finished jobs
+ * are listed once, as Done (or Exit N, or the signal that killed them), and
+ * then forgotten.
+ *
+ * @param cmd
+ * @return SUCCESS
+ */
+int builtin_jobs(command* cmd);
+
+/**
+ * wait [-n] [id...]: without arguments, waits for every job and returns
+ * SUCCESS. With ids (%N for job N, %% or %+ for the current job, %- for the
+ * previous one, or a process ID), waits for each of them and returns the
+ * status of the last. With -n, waits for the next job to finish (or takes
+ * one that already has) and returns its status.
+ *
+ * @param cmd
+ * @return SUCCESS | ERROR (the job failed, or there is no such job)
+ */
+int builtin_wait(command* cmd);
+
+/**
+ * fg [id]: prints the command of the job (the current one by default) and
+ * waits for it, as if it had been started without &.
+ *
+ * @param cmd
+ * @return SUCCESS | ERROR (the job failed, or there is no such job)
+ */
+int builtin_fg(command* cmd);
+
+#endif  // JOBS_H
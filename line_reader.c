@@ -0,0 +1,114 @@
+#include "line_reader.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * line_reader.c - Buffered line input for the shell
+ *
+ * Reads input in LINE_READER_CHUNK sized read(2) calls and splits it into
+ * lines in place, so a script piped into the shell costs one system call per
+ * chunk rather than per line, and no line is ever cut short.
+ */
+
+// Prepares reader to read from fd
+void line_reader_init(line_reader* reader, int fd) {
+    reader->fd = fd;
+    reader->buffer = NULL;
+    reader->capacity = 0;
+    reader->start = 0;
+    reader->end = 0;
+    reader->eof = false;
+}
+
+// Reads more input into the buffer, making room first. Returns false once
+// nothing more can be read
+static bool fill(line_reader* reader) {
+    // Move the unreturned bytes to the front of the buffer
+    if (reader->start > 0) {
+        memmove(reader->buffer, reader->buffer + reader->start,
+                reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+
+    // Grow when a line has filled so much of the buffer that less than half a
+    // chunk is left to read into (one byte is always kept for the null
+    // terminator of a final unterminated line)
+    if (reader->capacity - reader->end < LINE_READER_CHUNK / 2 + 1) {
+        size_t capacity = reader->capacity == 0 ? LINE_READER_CHUNK + 1
+                                                : reader->capacity * 2;
+        // Using new instead of malloc to avoid valgrind issues
+        char* grown = new char[capacity];
+        if (reader->end > 0) memcpy(grown, reader->buffer, reader->end);
+        delete[] reader->buffer;
+        reader->buffer = grown;
+        reader->capacity = capacity;
+    }
+
+    ssize_t count;
+    do {
+        count = read(reader->fd, reader->buffer + reader->end,
+                     reader->capacity - reader->end - 1);
+    } while (count < 0 && errno == EINTR);
+
+    if (count < 0) perror("read failed");
+    if (count <= 0) {
+        reader->eof = true;
+        return false;
+    }
+
+    reader->end += count;
+    return true;
+}
+
+// Returns the next complete line, reading more input as needed
+char* read_line(line_reader* reader, size_t* len) {
+    return read_record(reader, '\n', len);
+}
+
+// Returns the next record ended by delimiter, reading more input as needed
+char* read_record(line_reader* reader, char delimiter, size_t* len) {
+    // Only the bytes that arrived since the last search need to be searched
+    size_t searched = reader->start;
+
+    while (true) {
+        char* line = reader->buffer + reader->start;
+        char* newline = static_cast<char*>(memchr(
+            reader->buffer + searched, delimiter, reader->end - searched));
+
+        if (newline != NULL) {
+            // Hand out the line in place, replacing its newline
+            *newline = '\0';
+            if (len != NULL) *len = newline - line;
+            reader->start = newline + 1 - reader->buffer;
+            return line;
+        }
+
+        // Everything buffered so far has been searched without a newline
+        size_t pending = reader->end - reader->start;
+
+        if (reader->eof || !fill(reader)) {
+            // End of input: hand out whatever is left as the last line
+            if (reader->start == reader->end) return NULL;
+            line = reader->buffer + reader->start;
+            reader->buffer[reader->end] = '\0';
+            if (len != NULL) *len = reader->end - reader->start;
+            reader->start = reader->end;
+            return line;
+        }
+
+        // fill moved the unreturned bytes to the front of the buffer, so only
+        // the newly read ones behind them are left to search
+        searched = pending;
+    }
+}
+
+// Frees the reader's buffer
+void line_reader_free(line_reader* reader) {
+    // Using delete[] to match new[] in fill
+    delete[] reader->buffer;
+    line_reader_init(reader, reader->fd);
+}
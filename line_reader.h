@@ -0,0 +1,68 @@
+#ifndef LINE_READER_H
+#define LINE_READER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Bytes asked for by each read(2). One read covers many lines of a script
+#define LINE_READER_CHUNK (64 * 1024)
+
+/**
+ * Buffered reader handing out complete lines of any length from a file
+ * descriptor.
+ *
+ * Bytes buffer[start] ... buffer[end - 1] have been read but not yet returned
+ * as lines. The buffer grows whenever a single line does not fit.
+ */
+typedef struct {
+    int fd;
+    char* buffer;
+    size_t capacity;
+    size_t start;
+    size_t end;
+    bool eof;
+} line_reader;
+
+/**
+ * Prepares reader to read lines from fd. Nothing is read until the first
+ * call to read_line.
+ *
+ * @param reader
+ * @param fd file descriptor to read from, e.g. STDIN_FILENO
+ * @return void
+ */
+void line_reader_init(line_reader* reader, int fd);
+
+/**
+ * Returns the next line, without its newline, as a null-terminated string
+ * that lives inside the reader's buffer. It stays valid (and may be modified)
+ * until the next call to read_line or line_reader_free.
+ *
+ * A final line that is not terminated by a newline is still returned.
+ *
+ * @param reader
+ * @param len if not NULL, set to the length of the line
+ * @return char* the line | NULL at end of input or on a read error
+ */
+char* read_line(line_reader* reader, size_t* len);
+
+/**
+ * Like read_line, but for records ended by delimiter instead of newlines,
+ * e.g. '\0' for the output of find -print0.
+ *
+ * @param reader
+ * @param delimiter
+ * @param len if not NULL, set to the length of the record
+ * @return char* the record | NULL at end of input or on a read error
+ */
+char* read_record(line_reader* reader, char delimiter, size_t* len);
+
+/**
+ * Frees the reader's buffer. Does not close its file descriptor.
+ *
+ * @param reader
+ * @return void
+ */
+void line_reader_free(line_reader* reader);
+
+#endif  // LINE_READER_H
@@ -1,30 +1,222 @@
 /**
- * Complete, there should be no need to edit this file
+ * Usage (after running make):
+ *   ./main [-i | -s] [-j N]                   read commands from stdin
+ *   ./main [-i | -s] [-j N] script [args...]  run the commands in script
+ *   ./main [-i | -s] [-j N] -c text [args...] run the commands in text
  *
- * Usage (after running make): ./main
+ * Output goes to stdout. The args are $1, $2... in the commands, and $# is
+ * their count.
  *
- * This file takes input from stdin and outputs to stdout. No CLI args
+ * With -j N (or --jobs N), the lines run N at a time instead of one after the
+ * other, each in processes of its own with stdin from /dev/null (see
+ * parallel.h), and the shell's status is a failure if any of them failed.
+ * --halt-on-error stops starting lines once one has failed, and -k (or
+ * --keep-order) prints the output of every line in one piece, in the order of
+ * the lines, holding back at most --memory-cap bytes in memory.
+ *
+ * When stdin is a terminal the shell is interactive: it prompts for every
+ * line. Otherwise (a file or a pipe, as in data/in*.txt) it runs in batch
+ * mode: no prompts, and its own output is fully buffered. -i forces
+ * interactive mode and -s forces batch mode. Scripts and -c always run in
+ * batch mode.
+ *
+ * A script file is memory mapped and tokenized in full before its first
+ * command runs (see script.h). The shell exits with the status of the last
+ * command of the script. When that is a program run on its own, the shell
+ * execs it rather than waiting for it (see execute_last), so the program's
+ * exit status is the shell's.
+ *
+ * Commands are resolved through a cache kept current by inotify (see
+ * path_cache.h): it is brought up to date before every command. Background
+ * jobs that have finished are reaped before every command too (see jobs.h),
+ * and in interactive mode reported ahead of the next prompt.
+ *
+ * Set THSH_POOL_STATS in the environment to have the command pool's hit and
+ * miss counters printed to stderr when the shell exits
  */
 
+#include "jobs.h"
+#include "line_reader.h"
+#include "parallel.h"
+#include "path_cache.h"
+#include "script.h"
 #include "shell.h"
+#include "variables.h"
+
+// Exit status when the script to run can't be opened, as in bash
+#define EXIT_SCRIPT_NOT_FOUND 127
+
+// Prints the command pool counters, registered with atexit
+static void report_pool_stats() {
+    command_pool_stats stats;
+    get_command_pool_stats(&stats);
+    fprintf(stderr,
+            "command pool: %lu hits, %lu misses, %d pooled; "
+            "path buffers: %lu hits, %lu misses\n",
+            stats.hits, stats.misses, stats.pooled, stats.path_hits,
+            stats.path_misses);
+}
+
+// Executes cmd (through execute_last if last is set), naming the line it came
+// from if it fails
+static int run_command(command* cmd, const char* line, size_t len,
+                       bool last = false) {
+    int status = last ? execute_last(cmd) : execute(cmd);
+    if (status == ERROR)
+        fprintf(stderr, "%.*s command failed\n", (int)len, line);
+    return status;
+}
+
+// Runs every line of a loaded script, returning the exit status of the last
+static int run_script(script* s) {
+    int status = SUCCESS;
+    for (int i = 0; i < s->line_count; i++) {
+        // Programs installed or removed by the previous command, and jobs
+        // that have finished
+        path_cache_poll();
+        jobs_reap();
+        command* cmd = script_command(s, i);
+        // The last line may replace the shell (see execute_last)
+        status = run_command(cmd, s->lines[i].text, s->lines[i].len,
+                             i == s->line_count - 1);
+        cleanup(cmd);
+    }
+    return status == SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Runs every line of a loaded script through run, N lines at a time
+static int run_script_parallel(script* s, parallel_run* run) {
+    for (int i = 0; i < s->line_count && !run->halted; i++) {
+        path_cache_poll();
+        command* cmd = script_command(s, i);
+        parallel_submit(run, cmd, s->lines[i].text, s->lines[i].len);
+        cleanup(cmd);
+    }
+    return parallel_finish(run) == SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
 int _main(int argc, const char* argv[]) {
-    char input[MAX_LINE_SIZE + 1];
+    // Batch mode unless stdin is a terminal or -i says otherwise
+    bool interactive = isatty(STDIN_FILENO);
+    const char* command_text = NULL;
+    const char* script_path = NULL;
+    // Lines run at a time with -j, 0 without
+    parallel_options parallel;
+    parallel_default_options(&parallel);
+    parallel.jobs = 0;
 
+    // Options come first; the first other argument is the script, and
+    // everything after the script (or after -c text) belongs to it
+    int i = 1;
+    for (; i < argc; i++) {
+        if (strcmp(argv[i], "-i") == 0) {
+            interactive = true;
+        } else if (strcmp(argv[i], "-s") == 0) {
+            interactive = false;
+        } else if (int parsed =
+                       parallel_parse_option(&parallel, argv[0], argc, argv,
+                                             &i)) {
+            if (parsed < 0) return EXIT_FAILURE;
+        } else if (strcmp(argv[i], "-c") == 0) {
+            if (i + 1 == argc) {
+                fprintf(stderr, "%s: -c: option requires an argument\n",
+                        argv[0]);
+                return EXIT_FAILURE;
+            }
+            command_text = argv[i + 1];
+            i += 2;
+            break;
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "%s: invalid option %s\n", argv[0], argv[i]);
+            return EXIT_FAILURE;
+        } else {
+            script_path = argv[i];
+            break;
+        }
+    }
+
+    // $0, $1... (see variables.h): the script and the arguments after it.
+    // For -c, $0 is the first argument after the text, and otherwise the
+    // shell
+    if (i < argc)
+        set_positional_parameters(argc - i, argv + i);
+    else
+        set_positional_parameters(1, argv);
+
+    // Commands are recycled through the pool between iterations, so after
+    // the first few lines this loop no longer allocates
+    if (getenv("THSH_POOL_STATS") != NULL) atexit(report_pool_stats);
+
+    if (command_text != NULL || script_path != NULL) {
+        script s;
+        if (command_text != NULL) {
+            load_script_text(command_text, &s);
+        } else if (load_script(script_path, &s) == ERROR) {
+            fprintf(stderr, "%s: %s: %s\n", argv[0], script_path,
+                    strerror(errno));
+            return EXIT_SCRIPT_NOT_FOUND;
+        }
+
+        setvbuf(stdout, NULL, _IOFBF, BATCH_STDOUT_BUFSIZE);
+        int status;
+        parallel_run run;
+        if (parallel.jobs == 0)
+            status = run_script(&s);
+        else if (parallel_start(&run, &parallel) == SUCCESS)
+            status = run_script_parallel(&s, &run);
+        else
+            status = EXIT_FAILURE;
+        free_script(&s);
+        return status;
+    }
+
+    // Lines from stdin go through a parallel run too with -j
+    parallel_run run;
+    if (parallel.jobs > 0 && parallel_start(&run, &parallel) == ERROR)
+        return EXIT_FAILURE;
+
+    // In batch mode nothing is written until the buffer fills, or execute
+    // flushes it before starting a child
+    if (!interactive) setvbuf(stdout, NULL, _IOFBF, BATCH_STDOUT_BUFSIZE);
+
+    // Lines of any length, read from stdin in large chunks
+    line_reader reader;
+    line_reader_init(&reader, STDIN_FILENO);
+
+    jobs_set_interactive(interactive);
     while (true) {
-        printf("%s", SHELL_PROMPT);
-        fgets(input, MAX_LINE_SIZE, stdin);
-        input[strcspn(input, "\n")] = '\0';  // Remove newline from user input
-        command* cmd = parse(input);
+        // Jobs that finished since the last line, reported ahead of the prompt
+        jobs_reap();
+        jobs_notify();
 
-        if (cmd->argc > 0) {
-            if (execute(cmd) == ERROR)
-                fprintf(stderr, "%s command failed\n", input);
+        // The prompt must be visible before we block reading the next line
+        if (interactive) {
+            printf("%s", SHELL_PROMPT);
+            fflush(stdout);
         }
 
+        // The newline is already removed from user input
+        size_t len;
+        char* input = read_line(&reader, &len);
+        if (input == NULL) break;  // End of input
+
+        // Catch up with programs installed or removed since the last line,
+        // so the command below is never resolved from a stale cache entry
+        path_cache_poll();
+        command* cmd = parse(input);
+
+        if (cmd->argc > 0 && parallel.jobs > 0)
+            parallel_submit(&run, cmd, input, len);
+        else if (cmd->argc > 0)
+            run_command(cmd, input, len);
+
         cleanup(cmd);
+        if (parallel.jobs > 0 && run.halted) break;
     }
 
+    line_reader_free(&reader);
+    if (parallel.jobs > 0 && parallel_finish(&run) == ERROR)
+        return EXIT_FAILURE;
     return EXIT_SUCCESS;
 }
 
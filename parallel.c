@@ -0,0 +1,583 @@
+#include "parallel.h"
+
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+
+#include "jobs.h"
+#include "line_reader.h"
+#include "pipeline.h"
+#include "spawn.h"
+#include "substitution.h"
+#include "timing.h"
+
+/**
+ * parallel.c - Running command lines N at a time
+ *
+ * The run is an event loop over one epoll set holding a pidfd per running
+ * process (and, with keep_order, the read end of each line's output pipe): a
+ * new line is only started once epoll_wait has handed back the exit of enough
+ * earlier ones. Each event points straight at the record it is about, so an
+ * exit is matched to its line without a search.
+ */
+
+// What an event of the epoll set is about
+typedef enum { WATCH_EXIT, WATCH_OUTPUT } watch_kind;
+
+typedef struct {
+    watch_kind kind;
+    parallel_job* job;
+} parallel_watch;
+
+// One process of a running line
+typedef struct {
+    // First, so an event's parallel_watch is also its process
+    parallel_watch watch;
+    pid_t pid;
+    int pidfd;
+} parallel_process;
+
+// A line, from its start until it is done with (and, with keep_order, its
+// output printed)
+struct parallel_job {
+    long seq;
+    char* text;
+    parallel_process* processes;
+    int count;
+    // Processes not reaped yet
+    int running;
+    // Wait status of the last process, or -1 if it never started
+    int status;
+    struct timespec start;
+
+    // With keep_order: the read end of the line's stdout (-1 once at its end)
+    parallel_watch output_watch;
+    int output_fd;
+    // What was read from it, in buffer and then in spill_fd (-1 until needed)
+    char* buffer;
+    size_t length;
+    size_t capacity;
+    int spill_fd;
+    // Set once the line has finished, so its output can be printed
+    bool done;
+    parallel_job* next;
+};
+
+void parallel_default_options(parallel_options* options) {
+    options->name = "parallel";
+    options->jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    options->halt_on_error = false;
+    options->joblog = NULL;
+    options->keep_order = false;
+    options->memory_cap = PARALLEL_MEMORY_CAP;
+}
+
+// Parses the number of jobs for -j, or returns 0 if arg isn't a valid one
+static int parse_jobs(const char* arg) {
+    char* end;
+    long jobs = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || jobs < 1 || jobs > 65536) return 0;
+    return jobs;
+}
+
+// Parses a size for --memory-cap into size, returning false if arg isn't one
+static bool parse_size(const char* arg, size_t* size) {
+    char* end;
+    errno = 0;
+    unsigned long long value = strtoull(arg, &end, 10);
+    if (!isdigit((unsigned char)*arg) || errno != 0) return false;
+
+    int shift = 0;
+    if (*end != '\0') {
+        const char* units = strchr("KMG", toupper((unsigned char)*end));
+        if (units == NULL || end[1] != '\0') return false;
+        shift = 10 * (units - "KMG" + 1);
+    }
+    if (value > (SIZE_MAX >> shift)) return false;
+    *size = value << shift;
+    return true;
+}
+
+int parallel_parse_option(parallel_options* options, const char* name,
+                          int argc, const char* const* argv, int* i) {
+    const char* arg = argv[*i];
+    const char* value = *i + 1 < argc ? argv[*i + 1] : "";
+    if (strcmp(arg, "-j") == 0 || strcmp(arg, "--jobs") == 0) {
+        options->jobs = parse_jobs(value);
+        if (options->jobs == 0) {
+            fprintf(stderr, "%s: invalid number of jobs: '%s'\n", name, value);
+            return -1;
+        }
+    } else if (strcmp(arg, "--memory-cap") == 0) {
+        if (!parse_size(value, &options->memory_cap)) {
+            fprintf(stderr, "%s: invalid memory cap: '%s'\n", name, value);
+            return -1;
+        }
+    } else if (strcmp(arg, "--halt-on-error") == 0) {
+        options->halt_on_error = true;
+        return 1;
+    } else if (strcmp(arg, "-k") == 0 || strcmp(arg, "--keep-order") == 0) {
+        options->keep_order = true;
+        return 1;
+    } else {
+        return 0;
+    }
+    (*i)++;
+    return 1;
+}
+
+int parallel_start(parallel_run* run, const parallel_options* options) {
+    run->options = *options;
+    if (run->options.jobs < 1) run->options.jobs = 1;
+    run->running = 0;
+    run->started = 0;
+    run->failed = 0;
+    run->halted = false;
+    run->first = NULL;
+    run->last = NULL;
+    run->buffered = 0;
+    run->most_buffered = 0;
+    run->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (run->epoll_fd < 0) {
+        perror("epoll_create1 failed");
+        return ERROR;
+    }
+    // Lines must not read what is meant for the shell (or for parallel)
+    run->null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    if (run->options.joblog != NULL)
+        fprintf(run->options.joblog,
+                "Seq\tStarttime\tJobRuntime\tExitval\tSignal\tCommand\n");
+    return SUCCESS;
+}
+
+// Seconds from start to now
+static double seconds_since(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Writes all of data to fd, returning false if that failed
+static bool write_all(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return false;
+        data += written;
+        length -= written;
+    }
+    return true;
+}
+
+// Copies the first length bytes of spill_fd to stdout
+static void print_spilled(int spill_fd, size_t length) {
+    off_t offset = 0;
+    // The kernel copies from the memfd's pages straight into stdout, unless
+    // stdout doesn't allow it (e.g. if opened with O_APPEND before Linux 5.x)
+    while ((size_t)offset < length) {
+        ssize_t sent = sendfile(STDOUT_FILENO, spill_fd, &offset,
+                                length - offset);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) break;
+    }
+
+    char chunk[PARALLEL_READ_SIZE];
+    while ((size_t)offset < length) {
+        size_t wanted = length - offset;
+        ssize_t got = pread(spill_fd, chunk,
+                            wanted < sizeof(chunk) ? wanted : sizeof(chunk),
+                            offset);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0 || !write_all(STDOUT_FILENO, chunk, got)) break;
+        offset += got;
+    }
+}
+
+// Frees job, giving back the memory its output held
+static void free_job(parallel_run* run, parallel_job* job) {
+    run->buffered -= job->capacity;
+    if (job->spill_fd >= 0) close(job->spill_fd);
+    delete[] job->buffer;
+    delete[] job->text;
+    delete[] job->processes;
+    delete job;
+}
+
+// Prints (and frees) the output of the oldest lines for as long as they are
+// done, stopping at the first one still running
+static void print_done(parallel_run* run) {
+    if (run->first == NULL || !run->first->done) return;
+    // What the shell itself printed comes first
+    fflush(stdout);
+    while (run->first != NULL && run->first->done) {
+        parallel_job* job = run->first;
+        run->first = job->next;
+        if (run->first == NULL) run->last = NULL;
+
+        if (job->spill_fd < 0) {
+            write_all(STDOUT_FILENO, job->buffer, job->length);
+        } else {
+            print_spilled(job->spill_fd, job->length);
+        }
+        free_job(run, job);
+    }
+}
+
+// Records the end of job, whose processes have all been reaped (and whose
+// output has all been read), and prints or frees it
+static void complete(parallel_run* run, parallel_job* job) {
+    int status = job->status;
+    bool failed =
+        status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    if (failed) {
+        run->failed++;
+        if (run->options.halt_on_error) run->halted = true;
+    }
+
+    if (run->options.joblog != NULL) {
+        int exit_value = status == -1         ? 127
+                         : WIFEXITED(status) ? WEXITSTATUS(status)
+                                             : -1;
+        int signal = status != -1 && WIFSIGNALED(status) ? WTERMSIG(status)
+                                                         : 0;
+        fprintf(run->options.joblog, "%ld\t%ld.%03ld\t%.3f\t%d\t%d\t%s\n",
+                job->seq, (long)job->start.tv_sec,
+                job->start.tv_nsec / 1000000, seconds_since(&job->start),
+                exit_value, signal, job->text);
+    }
+
+    if (run->options.keep_order) {
+        job->done = true;
+        print_done(run);
+    } else {
+        free_job(run, job);
+    }
+}
+
+// Completes job if nothing of it is left running
+static void check_done(parallel_run* run, parallel_job* job) {
+    if (job->running > 0 || job->output_fd >= 0) return;
+    run->running--;
+    complete(run, job);
+}
+
+// Records that process exited with status
+static void reaped(parallel_run* run, parallel_process* process, int status) {
+    parallel_job* job = process->watch.job;
+    if (process == &job->processes[job->count - 1]) job->status = status;
+    job->running--;
+    check_done(run, job);
+}
+
+// Opens a file to keep output in: a memfd, or an unnamed file in /tmp where
+// there are no memfds (Linux < 3.17)
+static int open_spill_file() {
+    int fd = memfd_create("parallel-output", MFD_CLOEXEC);
+    if (fd < 0) fd = open("/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    return fd;
+}
+
+// Adds data to what job has printed: to its buffer, grown as needed, as long
+// as it stays within the spill threshold and the run's memory cap, and to its
+// spill file from then on
+static void keep_output(parallel_run* run, parallel_job* job, const char* data,
+                        size_t length) {
+    if (job->spill_fd < 0 && job->length + length > job->capacity) {
+        size_t capacity = job->capacity > 0 ? job->capacity : 4096;
+        while (capacity < job->length + length) capacity *= 2;
+        size_t growth = capacity - job->capacity;
+        if (capacity <= PARALLEL_SPILL_THRESHOLD &&
+            run->buffered + growth <= run->options.memory_cap) {
+            char* buffer = new char[capacity];
+            memcpy(buffer, job->buffer, job->length);
+            delete[] job->buffer;
+            job->buffer = buffer;
+            job->capacity = capacity;
+            run->buffered += growth;
+            if (run->buffered > run->most_buffered)
+                run->most_buffered = run->buffered;
+        } else {
+            // Move what is in memory so far to a spill file, and give the
+            // memory back
+            job->spill_fd = open_spill_file();
+            if (job->spill_fd < 0) {
+                fprintf(stderr, "%s: no file for output: %s\n",
+                        run->options.name, strerror(errno));
+                return;
+            }
+            write_all(job->spill_fd, job->buffer, job->length);
+            delete[] job->buffer;
+            job->buffer = NULL;
+            run->buffered -= job->capacity;
+            job->capacity = 0;
+        }
+    }
+
+    if (job->spill_fd >= 0) {
+        write_all(job->spill_fd, data, length);
+    } else {
+        memcpy(job->buffer + job->length, data, length);
+    }
+    job->length += length;
+}
+
+// Reads what is waiting in job's output pipe, taking it out of the set at the
+// end of the output
+static void read_output(parallel_run* run, parallel_job* job) {
+    char chunk[PARALLEL_READ_SIZE];
+    ssize_t got = read(job->output_fd, chunk, sizeof(chunk));
+    if (got < 0 && errno == EINTR) return;
+    if (got > 0) {
+        keep_output(run, job, chunk, got);
+        return;
+    }
+    epoll_ctl(run->epoll_fd, EPOLL_CTL_DEL, job->output_fd, NULL);
+    close(job->output_fd);
+    job->output_fd = -1;
+    check_done(run, job);
+}
+
+// Handles the exits and output epoll_wait reports, waiting for the first
+static void handle_events(parallel_run* run) {
+    struct epoll_event events[PARALLEL_EVENT_BATCH];
+    int ready = epoll_wait(run->epoll_fd, events, PARALLEL_EVENT_BATCH, -1);
+    if (ready < 0 && errno != EINTR) perror("epoll_wait failed");
+    for (int i = 0; i < ready; i++) {
+        parallel_watch* watch =
+            static_cast<parallel_watch*>(events[i].data.ptr);
+        if (watch->kind == WATCH_OUTPUT) {
+            read_output(run, watch->job);
+            continue;
+        }
+
+        parallel_process* process = reinterpret_cast<parallel_process*>(watch);
+        int status;
+        // Its pidfd is readable, so this doesn't block
+        if (waitpid(process->pid, &status, 0) != process->pid) status = -1;
+        // A forked child may share the pidfd, so closing it isn't enough to
+        // take it out of the set
+        epoll_ctl(run->epoll_fd, EPOLL_CTL_DEL, process->pidfd, NULL);
+        close(process->pidfd);
+        reaped(run, process, status);
+    }
+}
+
+// Adds fd to the run's epoll set, with watch as its event's data
+static bool watch_fd(parallel_run* run, int fd, parallel_watch* watch) {
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = watch;
+    return epoll_ctl(run->epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+// Makes a new job record for the line text
+static parallel_job* create_job(parallel_run* run, const char* text,
+                                size_t len) {
+    parallel_job* job = new parallel_job;
+    job->seq = ++run->started;
+    job->text = new char[len + 1];
+    memcpy(job->text, text, len);
+    job->text[len] = '\0';
+    job->processes = NULL;
+    job->count = 0;
+    job->running = 0;
+    job->status = -1;
+    clock_gettime(CLOCK_REALTIME, &job->start);
+
+    job->output_watch.kind = WATCH_OUTPUT;
+    job->output_watch.job = job;
+    job->output_fd = -1;
+    job->buffer = NULL;
+    job->length = 0;
+    job->capacity = 0;
+    job->spill_fd = -1;
+    job->done = false;
+    job->next = NULL;
+    return job;
+}
+
+// Runs cmd through execute in a forked copy of the shell, with stdin from in
+// and stdout going to out (unless -1)
+static pid_t start_subshell(command* cmd, int in, int out) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) perror("fork failed");
+    if (pid != 0) return pid;
+
+    if (in >= 0) dup2(in, STDIN_FILENO);
+    if (out >= 0) dup2(out, STDOUT_FILENO);
+    int status = execute(cmd);
+    fflush(stdout);
+    // _exit, so the shell's atexit handlers only run in the shell
+    _exit(status == SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+// Starts the next line, taking its arguments as they are if literal is set
+static int submit(parallel_run* run, command* cmd, const char* text,
+                  size_t len, bool literal) {
+    while (run->running >= run->options.jobs && !run->halted)
+        handle_events(run);
+    if (run->halted) return ERROR;
+
+    parallel_job* job = create_job(run, text, len);
+    // Counted as running itself until all of it has started, so it can't
+    // complete under our feet
+    job->running = 1;
+    run->running++;
+    // Its output waits its turn in the queue
+    int out = -1;
+    if (run->options.keep_order) {
+        int pipe_fds[2];
+        if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
+            perror("pipe failed");
+        } else if (!watch_fd(run, pipe_fds[0], &job->output_watch)) {
+            perror("epoll_ctl failed");
+            close(pipe_fds[0]);
+            close(pipe_fds[1]);
+        } else {
+            job->output_fd = pipe_fds[0];
+            out = pipe_fds[1];
+        }
+        if (run->last != NULL) run->last->next = job;
+        else run->first = job;
+        run->last = job;
+    }
+
+    // time, & and expansions are the shell's to carry out, in a copy of it
+    // of the line's own, so they run as they would in execute (and several
+    // lines' $(...) at once). Anything else is started as it is, a line
+    // without | being a pipeline of one
+    pid_t* pids;
+    if (literal) {
+        int stdio[3] = {run->null_fd, out, -1};
+        job->count = 1;
+        pids = new pid_t[1];
+        pids[0] = start_literal(cmd, stdio);
+    } else if (is_timed(cmd) || has_background(cmd) || has_expansion(cmd)) {
+        job->count = 1;
+        pids = new pid_t[1];
+        pids[0] = start_subshell(cmd, run->null_fd, out);
+    } else {
+        pids = start_pipeline(cmd, run->null_fd, out, &job->count);
+        if (pids == NULL) job->count = 0;
+    }
+    // The processes have their own copies: the pipe ends with the last one
+    if (out >= 0) close(out);
+    job->processes = new parallel_process[job->count > 0 ? job->count : 1];
+
+    for (int i = 0; i < job->count; i++) {
+        parallel_process* process = &job->processes[i];
+        process->watch.kind = WATCH_EXIT;
+        process->watch.job = job;
+        process->pid = pids[i];
+        process->pidfd = pids[i] > 0 ? open_pidfd(pids[i]) : -1;
+        if (pids[i] <= 0) continue;
+
+        if (process->pidfd >= 0) {
+            if (watch_fd(run, process->pidfd, &process->watch)) {
+                job->running++;
+                continue;
+            }
+            close(process->pidfd);
+        }
+
+        // No pidfd to watch (Linux < 5.3): this one runs to its end now,
+        // after its output (which it might block on) has been read
+        while (job->output_fd >= 0) read_output(run, job);
+        int status;
+        if (waitpid(pids[i], &status, 0) == pids[i] && i == job->count - 1)
+            job->status = status;
+    }
+    delete[] pids;
+
+    job->running--;
+    check_done(run, job);
+    return SUCCESS;
+}
+
+int parallel_submit(parallel_run* run, command* cmd, const char* text,
+                    size_t len) {
+    return submit(run, cmd, text, len, false);
+}
+
+int parallel_submit_literal(parallel_run* run, command* cmd, const char* text,
+                            size_t len) {
+    return submit(run, cmd, text, len, true);
+}
+
+int parallel_finish(parallel_run* run) {
+    while (run->running > 0) handle_events(run);
+    close(run->epoll_fd);
+    if (run->null_fd >= 0) close(run->null_fd);
+    if (run->options.joblog != NULL) fflush(run->options.joblog);
+
+    if (run->failed > 0)
+        fprintf(stderr, "%s: %ld of %ld jobs failed\n", run->options.name,
+                run->failed, run->started);
+    return run->failed == 0 ? SUCCESS : ERROR;
+}
+
+// parallel [options] [--joblog file] [file]
+int builtin_parallel(command* cmd) {
+    parallel_options options;
+    parallel_default_options(&options);
+    const char* joblog_path = NULL;
+    const char* path = NULL;
+
+    for (int i = 1; i < cmd->argc; i++) {
+        const char* arg = cmd->argv[i];
+        int parsed =
+            parallel_parse_option(&options, "parallel", cmd->argc, cmd->argv,
+                                  &i);
+        if (parsed < 0) return ERROR;
+        if (parsed > 0) continue;
+
+        if (strcmp(arg, "--joblog") == 0 && i + 1 < cmd->argc) {
+            joblog_path = cmd->argv[++i];
+        } else if (arg[0] == '-' && arg[1] != '\0') {
+            fprintf(stderr, "parallel: invalid option %s\n", arg);
+            return ERROR;
+        } else {
+            path = arg;
+        }
+    }
+
+    int fd = STDIN_FILENO;
+    if (path != NULL && strcmp(path, "-") != 0) {
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "parallel: %s: %s\n", path, strerror(errno));
+            return ERROR;
+        }
+    }
+    if (joblog_path != NULL) {
+        options.joblog = fopen(joblog_path, "we");
+        if (options.joblog == NULL) {
+            fprintf(stderr, "parallel: %s: %s\n", joblog_path,
+                    strerror(errno));
+            if (fd != STDIN_FILENO) close(fd);
+            return ERROR;
+        }
+    }
+
+    parallel_run run;
+    int status = parallel_start(&run, &options);
+    if (status == SUCCESS) {
+        line_reader reader;
+        line_reader_init(&reader, fd);
+        size_t len;
+        char* line;
+        while (!run.halted && (line = read_line(&reader, &len)) != NULL) {
+            command* line_cmd = parse(line);
+            if (line_cmd->argc > 0) parallel_submit(&run, line_cmd, line, len);
+            cleanup(line_cmd);
+        }
+        line_reader_free(&reader);
+        status = parallel_finish(&run);
+    }
+
+    if (options.joblog != NULL) fclose(options.joblog);
+    if (fd != STDIN_FILENO) close(fd);
+    return status;
+}
@@ -0,0 +1,177 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stddef.h>
+#include <time.h>
+
+#include "shell.h"
+
+// Most exits taken from the epoll set by one epoll_wait
+#define PARALLEL_EVENT_BATCH 64
+
+// With keep_order, the most output a line keeps in memory; beyond it, the
+// line's output goes to a memfd
+#define PARALLEL_SPILL_THRESHOLD (64 * 1024)
+
+// Default memory_cap: output held in memory by all lines together
+#define PARALLEL_MEMORY_CAP (16 * 1024 * 1024)
+
+// Bytes read from a line's output at a time
+#define PARALLEL_READ_SIZE (64 * 1024)
+
+/**
+ * How a parallel run goes.
+ *
+ * jobs: how many command lines run at once (at least 1).
+ * halt_on_error: once a line fails, start no more of them; those already
+ * running are still waited for.
+ * joblog: unless NULL, gets a line for every finished job (see parallel_start).
+ * keep_order: hold back the output of every line until those submitted before
+ * it have printed theirs, so lines print in order, one after the other.
+ * memory_cap: with keep_order, the most output all lines together hold in
+ * memory; the rest waits in memfds.
+ * name: who runs the lines, for messages on stderr.
+ */
+typedef struct {
+    const char* name;
+    int jobs;
+    bool halt_on_error;
+    FILE* joblog;
+    bool keep_order;
+    size_t memory_cap;
+} parallel_options;
+
+typedef struct parallel_job parallel_job;
+
+/**
+ * A run of command lines, at most options.jobs of them at a time.
+ *
+ * Every running line has a pidfd for each of its processes in epoll_fd, so
+ * the run learns of exits through epoll_wait alone, a batch at a time; it
+ * never blocks in wait() for any one child.
+ */
+typedef struct {
+    parallel_options options;
+    int epoll_fd;
+    // stdin of every line
+    int null_fd;
+    // Lines running right now
+    int running;
+    // Lines started, and how many of those failed so far
+    long started;
+    long failed;
+    // Set once halt_on_error stopped the run
+    bool halted;
+    // With keep_order, the lines whose output hasn't been printed yet, oldest
+    // first
+    parallel_job* first;
+    parallel_job* last;
+    // Output held in memory right now, and the most it ever was
+    size_t buffered;
+    size_t most_buffered;
+} parallel_run;
+
+/**
+ * Sets options to the defaults: as many jobs as there are CPUs, no joblog,
+ * output as it comes, a memory_cap of PARALLEL_MEMORY_CAP and "parallel" as
+ * the name.
+ *
+ * @param options
+ * @return void
+ */
+void parallel_default_options(parallel_options* options);
+
+/**
+ * Parses argv[*i] if it is one of the options of parallel: -j N or --jobs N,
+ * --halt-on-error, -k or --keep-order, and --memory-cap SIZE (in bytes, or
+ * with a K, M or G suffix). *i is moved to the option's value, if it has one.
+ *
+ * @param options
+ * @param name who is parsing, for error messages
+ * @param argc
+ * @param argv
+ * @param i
+ * @return 1 (parsed) | 0 (not an option of parallel) | -1 (its value is
+ * missing or invalid, reported on stderr)
+ */
+int parallel_parse_option(parallel_options* options, const char* name,
+                          int argc, const char* const* argv, int* i);
+
+/**
+ * Starts a run. If options->joblog is set, a header line is written to it,
+ * and then for every finished line (in the order they finish):
+ * "Seq\tStarttime\tJobRuntime\tExitval\tSignal\tCommand", as in GNU
+ * parallel's --joblog. Seq counts lines from 1 in the order they were
+ * submitted.
+ *
+ * @param run
+ * @param options
+ * @return SUCCESS | ERROR (no epoll set could be made)
+ */
+int parallel_start(parallel_run* run, const parallel_options* options);
+
+/**
+ * Starts cmd (a command or a pipeline, with stdin from /dev/null) as the next
+ * line of run, first waiting for a running line to finish if there are
+ * options.jobs of them already. Its exit is picked up later, by another
+ * parallel_submit or by parallel_finish.
+ *
+ * A line is run as execute would run it. One with time, & or an expansion
+ * (see substitution.h) goes through execute in a forked copy of the shell,
+ * which is the line's one process; any other is started straight away, one
+ * process per stage.
+ *
+ * With keep_order, the line's stdout is a pipe read by the run. What comes
+ * through is kept in memory up to PARALLEL_SPILL_THRESHOLD for the line and
+ * memory_cap for the whole run, and in a memfd beyond that. Once the line and
+ * every line before it have finished, it is written to the shell's stdout.
+ *
+ * cmd can be released with cleanup as soon as this returns.
+ *
+ * @param run
+ * @param cmd
+ * @param text the line cmd was parsed from, for the joblog
+ * @param len length of text
+ * @return SUCCESS | ERROR (the run was halted, so cmd was not started)
+ */
+int parallel_submit(parallel_run* run, command* cmd, const char* text,
+                    size_t len);
+
+/**
+ * Starts cmd as the next line of run, as parallel_submit does, but with its
+ * arguments taken as they are (see start_literal): none of them is a |, &,
+ * time, redirection or expansion, as for the items xargs reads.
+ *
+ * @param run
+ * @param cmd
+ * @param text for the joblog
+ * @param len length of text
+ * @return SUCCESS | ERROR (the run was halted, so cmd was not started)
+ */
+int parallel_submit_literal(parallel_run* run, command* cmd, const char* text,
+                            size_t len);
+
+/**
+ * Waits for every line of run still running (printing its output, with
+ * keep_order) and ends the run. If any line failed, "name: N of M jobs
+ * failed" is printed on stderr.
+ *
+ * @param run
+ * @return SUCCESS (every line exited with status 0) | ERROR
+ */
+int parallel_finish(parallel_run* run);
+
+/**
+ * parallel [options] [--joblog file] [file]: runs the command lines of file
+ * (or stdin), N at a time (see parallel_parse_option for the options). Empty
+ * lines are skipped.
+ *
+ * Each line runs in processes of its own, so lines that change the shell
+ * (cd, exit) have no effect beyond themselves.
+ *
+ * @param cmd
+ * @return SUCCESS | ERROR (a line failed, or the arguments were invalid)
+ */
+int builtin_parallel(command* cmd);
+
+#endif  // PARALLEL_H
@@ -0,0 +1,652 @@
+#include "path_cache.h"
+
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <time.h>
+
+#include "shell.h"
+
+/**
+ * path_cache.c - Hashed lookup of programs in $PATH
+ *
+ * Resolving a program the slow way builds and stats a candidate path in every
+ * $PATH directory until one exists. Two tables avoid that:
+ *
+ * - The cache remembers each name's result in an open-addressing hash table
+ *   (linear probing, power-of-two capacity), so a command that has run before
+ *   costs one hash lookup.
+ * - The directory index lists, for every file in every $PATH directory, the
+ *   first directory it is in. It is built by reading each directory once with
+ *   getdents64, so resolving a new name costs one hash lookup plus an fstatat
+ *   and a faccessat to confirm the file is an executable regular file, and a
+ *   name that is nowhere in $PATH costs no system calls at all.
+ *
+ * Each directory is held open as an O_PATH descriptor, and files are probed
+ * relative to it: the kernel only looks up the file name itself, instead of
+ * walking every component of "dir/name" again for every probe. A cached
+ * program is kept open the same way, so it can be launched with execveat.
+ *
+ * Both are kept up to date by an inotify watch on every $PATH directory.
+ * path_cache_poll drains its events without blocking, fixing up the index
+ * and forgetting just the cached names that were created, removed or renamed,
+ * so a cache hit needs no system call to know it is still right. Should
+ * inotify be unavailable, a cache hit checks its file instead, and directory
+ * mtimes are compared at most once every PATH_INDEX_RECHECK_MS, rebuilding
+ * the index when one has changed.
+ */
+
+// Initial number of slots, must be a power of two
+#define PATH_CACHE_INITIAL_CAPACITY 64
+
+// Initial number of directory index slots, must be a power of two
+#define PATH_INDEX_INITIAL_CAPACITY 1024
+
+// Most cached programs kept open as O_PATH descriptors, so a shell that has
+// run many different programs doesn't eat up its descriptor limit
+#define PATH_CACHE_MAX_BINARY_FDS 128
+
+// How often the directory index checks whether $PATH directories changed
+#define PATH_INDEX_RECHECK_MS 1000
+
+// Buffer size for getdents64
+#define PATH_INDEX_DENTS_BUFSIZE (32 * 1024)
+
+// Directory changes that can add, remove or replace a program
+#define PATH_INDEX_WATCH_EVENTS                                          \
+    (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB |   \
+     IN_DELETE_SELF | IN_MOVE_SELF)
+
+// dir of an empty index slot
+#define INDEX_EMPTY -1
+// dir of an index slot whose name was removed from every directory
+#define INDEX_GONE -2
+
+typedef struct {
+    // NULL for an empty slot. name and path are owned by the slot
+    char* name;
+    char* path;
+    // O_PATH descriptor of the program file, or -1
+    int fd;
+    unsigned long hits;
+    unsigned int hash;
+} slot;
+
+static struct {
+    slot* slots;
+    int capacity;
+    int count;
+    // Slots with a descriptor
+    int fd_count;
+    // Copy of $PATH the remembered paths were resolved against
+    char* path_env;
+} cache;
+
+// FNV-1a hash of a null-terminated string
+static unsigned int hash_name(const char* name) {
+    unsigned int hash = 2166136261u;
+    for (const unsigned char* p = (const unsigned char*)name; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Copies a string into a new[] buffer
+static char* copy_string(const char* s) {
+    size_t len = strlen(s) + 1;
+    // Using new instead of malloc to avoid valgrind issues
+    char* copy = new char[len];
+    memcpy(copy, s, len);
+    return copy;
+}
+
+// A directory of $PATH, as listed in the directory index
+typedef struct {
+    // As written in $PATH
+    char* path;
+    // O_PATH descriptor of the directory, or -1 if it could not be opened
+    int fd;
+    // inotify watch descriptor, or -1 if the directory is not watched
+    int wd;
+    struct timespec mtime;
+} index_dir;
+
+// A file in the directory index: its name (at offset name in dir_index.names)
+// and the first $PATH directory containing it. dir is INDEX_EMPTY for an
+// empty slot and INDEX_GONE for a name no directory has any more
+typedef struct {
+    size_t name;
+    unsigned int hash;
+    int dir;
+} index_slot;
+
+static struct {
+    index_dir* dirs;
+    int dir_count;
+    index_slot* slots;
+    int capacity;
+    int count;
+    // Every file name, null-terminated and back to back
+    char* names;
+    size_t names_size;
+    size_t names_capacity;
+    // When the directory mtimes were last compared
+    struct timespec checked;
+    // Set when the index must be rebuilt before its next use
+    bool stale;
+    // inotify descriptor, or -1
+    int inotify_fd;
+    // True when every existing directory is watched, so nothing can change
+    // unnoticed by path_cache_poll
+    bool watching;
+} dir_index = {NULL, 0, NULL, 0, 0, NULL, 0, 0, {0, 0}, false, -1, false};
+
+// Whether build_index watches the directories (see path_cache_use_inotify)
+static bool use_inotify = true;
+
+// Returns the slot holding name, or the empty slot where it would go
+static slot* find_slot(const char* name, unsigned int hash) {
+    unsigned int mask = cache.capacity - 1;
+    for (unsigned int i = hash & mask;; i = (i + 1) & mask) {
+        slot* s = &cache.slots[i];
+        if (s->name == NULL ||
+            (s->hash == hash && strcmp(s->name, name) == 0))
+            return s;
+    }
+}
+
+// Doubles the number of slots (or allocates the first ones), rehashing every
+// entry into its new place
+static void grow() {
+    slot* old = cache.slots;
+    int old_capacity = cache.capacity;
+
+    cache.capacity = old_capacity == 0 ? PATH_CACHE_INITIAL_CAPACITY
+                                       : old_capacity * 2;
+    cache.slots = new slot[cache.capacity];
+    memset(cache.slots, 0, cache.capacity * sizeof(slot));
+
+    for (int i = 0; i < old_capacity; i++)
+        if (old[i].name != NULL) *find_slot(old[i].name, old[i].hash) = old[i];
+    delete[] old;
+}
+
+// Frees what a slot owns and marks it empty
+static void free_slot(slot* s) {
+    delete[] s->name;
+    delete[] s->path;
+    if (s->fd >= 0) {
+        close(s->fd);
+        cache.fd_count--;
+    }
+    s->name = NULL;
+    s->path = NULL;
+    s->fd = -1;
+}
+
+// Closes the index's directories and forgets them
+static void free_index_dirs() {
+    for (int i = 0; i < dir_index.dir_count; i++) {
+        if (dir_index.dirs[i].fd >= 0) close(dir_index.dirs[i].fd);
+        delete[] dir_index.dirs[i].path;
+    }
+    delete[] dir_index.dirs;
+    dir_index.dirs = NULL;
+    dir_index.dir_count = 0;
+
+    // Closing the inotify descriptor drops all its watches (and any events
+    // still queued, which a rebuilt index does not need)
+    if (dir_index.inotify_fd >= 0) close(dir_index.inotify_fd);
+    dir_index.inotify_fd = -1;
+    dir_index.watching = false;
+}
+
+// Returns the index slot holding name, or the empty slot where it would go
+static index_slot* find_index_slot(const char* name, unsigned int hash) {
+    unsigned int mask = dir_index.capacity - 1;
+    for (unsigned int i = hash & mask;; i = (i + 1) & mask) {
+        index_slot* s = &dir_index.slots[i];
+        if (s->dir == INDEX_EMPTY ||
+            (s->hash == hash && strcmp(dir_index.names + s->name, name) == 0))
+            return s;
+    }
+}
+
+// Doubles the number of index slots (or allocates the first ones)
+static void grow_index() {
+    index_slot* old = dir_index.slots;
+    int old_capacity = dir_index.capacity;
+
+    dir_index.capacity = old_capacity == 0 ? PATH_INDEX_INITIAL_CAPACITY
+                                           : old_capacity * 2;
+    dir_index.slots = new index_slot[dir_index.capacity];
+    for (int i = 0; i < dir_index.capacity; i++)
+        dir_index.slots[i].dir = INDEX_EMPTY;
+
+    for (int i = 0; i < old_capacity; i++) {
+        if (old[i].dir == INDEX_EMPTY) continue;
+        *find_index_slot(dir_index.names + old[i].name, old[i].hash) = old[i];
+    }
+    delete[] old;
+}
+
+// Records that name is first found in directory dir (or, for INDEX_GONE,
+// nowhere). Unless replace is set, a name already in the index keeps its
+// directory: while reading directories in $PATH order, the first one wins
+static void index_name(const char* name, size_t len, int dir, bool replace) {
+    // Keep the table at most half full, so probe runs stay short
+    if (2 * (dir_index.count + 1) > dir_index.capacity) grow_index();
+
+    unsigned int hash = hash_name(name);
+    index_slot* s = find_index_slot(name, hash);
+    if (s->dir != INDEX_EMPTY) {
+        if (replace) s->dir = dir;
+        return;
+    }
+    if (dir == INDEX_GONE) return;  // Never indexed, so nothing to forget
+
+    // Append the name to the names buffer
+    if (dir_index.names_size + len + 1 > dir_index.names_capacity) {
+        size_t capacity = dir_index.names_capacity == 0
+                              ? 64 * 1024
+                              : dir_index.names_capacity * 2;
+        while (capacity < dir_index.names_size + len + 1) capacity *= 2;
+        char* grown = new char[capacity];
+        memcpy(grown, dir_index.names, dir_index.names_size);
+        delete[] dir_index.names;
+        dir_index.names = grown;
+        dir_index.names_capacity = capacity;
+    }
+    memcpy(dir_index.names + dir_index.names_size, name, len + 1);
+
+    s->name = dir_index.names_size;
+    s->hash = hash;
+    s->dir = dir;
+    dir_index.names_size += len + 1;
+    dir_index.count++;
+}
+
+// Reads every entry of directory dir into the index with getdents64
+static void index_directory(int dir) {
+    char buffer[PATH_INDEX_DENTS_BUFSIZE];
+    // An O_PATH descriptor can't be read, so open the directory for that
+    int fd = openat(dir_index.dirs[dir].fd, ".",
+                    O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return;
+
+    ssize_t count;
+    while ((count = getdents64(fd, buffer, sizeof(buffer))) > 0) {
+        for (ssize_t offset = 0; offset < count;) {
+            struct dirent64* entry =
+                reinterpret_cast<struct dirent64*>(buffer + offset);
+            offset += entry->d_reclen;
+
+            // Subdirectories (including . and ..) can't be run. Symbolic
+            // links and unknown types might be programs, fstatat tells later
+            if (entry->d_type == DT_DIR) continue;
+            if (entry->d_name[0] == '.' &&
+                (entry->d_name[1] == '\0' ||
+                 (entry->d_name[1] == '.' && entry->d_name[2] == '\0')))
+                continue;
+            index_name(entry->d_name, strlen(entry->d_name), dir, false);
+        }
+    }
+    close(fd);
+}
+
+// Opens the directory at path for the index, recording its mtime
+static void open_index_dir(index_dir* dir) {
+    dir->fd = open(dir->path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    struct stat st;
+    if (dir->fd >= 0 && fstat(dir->fd, &st) == 0)
+        dir->mtime = st.st_mtim;
+    else
+        memset(&dir->mtime, 0, sizeof(dir->mtime));
+}
+
+// Rebuilds the index from scratch for the directories of path_env
+static void build_index(const char* path_env) {
+    free_index_dirs();
+    for (int i = 0; i < dir_index.capacity; i++)
+        dir_index.slots[i].dir = INDEX_EMPTY;
+    dir_index.count = 0;
+    dir_index.names_size = 0;
+
+    // Watch directories from before they are read, so nothing is missed
+    dir_index.inotify_fd =
+        use_inotify ? inotify_init1(IN_NONBLOCK | IN_CLOEXEC) : -1;
+    dir_index.watching = dir_index.inotify_fd >= 0;
+
+    // One entry per non-empty $PATH component, in order
+    int max_dirs = 1;
+    for (const char* p = path_env; *p; p++)
+        if (*p == ':') max_dirs++;
+    dir_index.dirs = new index_dir[max_dirs];
+
+    const char* p = path_env;
+    while (*p) {
+        size_t len = strcspn(p, ":");
+        if (len > 0) {
+            index_dir* dir = &dir_index.dirs[dir_index.dir_count++];
+            dir->path = new char[len + 1];
+            memcpy(dir->path, p, len);
+            dir->path[len] = '\0';
+            open_index_dir(dir);
+            dir->wd = -1;
+            if (dir->fd >= 0) {
+                if (dir_index.inotify_fd >= 0)
+                    dir->wd = inotify_add_watch(dir_index.inotify_fd, dir->path,
+                                                PATH_INDEX_WATCH_EVENTS |
+                                                    IN_ONLYDIR);
+                if (dir->wd < 0) dir_index.watching = false;
+                index_directory(dir_index.dir_count - 1);
+            }
+        }
+        p += len;
+        if (*p == ':') p++;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &dir_index.checked);
+    dir_index.stale = false;
+}
+
+// Marks the index stale if a directory changed since it was read. Only
+// actually looks every PATH_INDEX_RECHECK_MS; in between this is free
+static void recheck_index() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    long elapsed_ms = (now.tv_sec - dir_index.checked.tv_sec) * 1000 +
+                      (now.tv_nsec - dir_index.checked.tv_nsec) / 1000000;
+    if (elapsed_ms < PATH_INDEX_RECHECK_MS) return;
+    dir_index.checked = now;
+
+    for (int i = 0; i < dir_index.dir_count && !dir_index.stale; i++) {
+        index_dir* dir = &dir_index.dirs[i];
+        struct stat st;
+        // A directory that could not be opened may exist by now
+        if (dir->fd < 0) {
+            dir_index.stale = stat(dir->path, &st) == 0;
+            continue;
+        }
+        // path_cache_poll hears about changes to a watched directory
+        if (dir->wd >= 0) continue;
+        dir_index.stale = fstat(dir->fd, &st) != 0 ||
+                          st.st_mtim.tv_sec != dir->mtime.tv_sec ||
+                          st.st_mtim.tv_nsec != dir->mtime.tv_nsec;
+    }
+}
+
+// Builds "dir/name" in a new[] buffer
+static char* join_path(const char* dir, const char* name) {
+    size_t dir_len = strlen(dir);
+    size_t name_len = strlen(name);
+    char* path = new char[dir_len + name_len + 2];
+    memcpy(path, dir, dir_len);
+    path[dir_len] = '/';
+    memcpy(path + dir_len + 1, name, name_len + 1);
+    return path;
+}
+
+// Returns true if name in directory dir is a regular file (following
+// symbolic links) that we may execute, as execv would decide it. Otherwise
+// errno is ENOENT if there is no such file at all
+static bool is_executable_in(int dir, const char* name) {
+    int fd = dir_index.dirs[dir].fd;
+    struct stat st;
+    if (fd < 0) {
+        errno = ENOENT;
+        return false;
+    }
+    if (fstatat(fd, name, &st, 0) != 0) return false;
+    if (!S_ISREG(st.st_mode)) {
+        errno = EACCES;
+        return false;
+    }
+    // With the effective IDs, like execv; a file without any x bit is turned
+    // down without asking the kernel
+    if ((st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)) == 0) {
+        errno = EACCES;
+        return false;
+    }
+    return faccessat(fd, name, X_OK, AT_EACCESS) == 0;
+}
+
+// Returns the full path of name in directory dir in a new[] buffer, and
+// opens it as an O_PATH descriptor in *fd (-1 when too many are open)
+static char* found_in(int dir, const char* name, int* fd) {
+    *fd = -1;
+    if (cache.fd_count < PATH_CACHE_MAX_BINARY_FDS) {
+        *fd = openat(dir_index.dirs[dir].fd, name, O_PATH | O_CLOEXEC);
+        if (*fd >= 0) cache.fd_count++;
+    }
+    return join_path(dir_index.dirs[dir].path, name);
+}
+
+// Finds name using the directory index, returning its full path in a new[]
+// buffer (and a descriptor in *fd, see found_in), or NULL if it is in none of
+// the directories of path_env
+static char* search_path(const char* name, const char* path_env, int* fd) {
+    if (dir_index.stale) build_index(path_env);
+    // Without inotify, changes to the directories are found by polling. A
+    // $PATH directory that doesn't exist (yet) is polled either way
+    recheck_index();
+    if (dir_index.stale) build_index(path_env);
+
+    // Not anywhere in $PATH: answered without a single system call
+    if (dir_index.count == 0 || strchr(name, '/') != NULL) return NULL;
+    index_slot* s = find_index_slot(name, hash_name(name));
+    if (s->dir < 0) return NULL;
+
+    // Confirm the file is still there and can be run
+    if (is_executable_in(s->dir, name)) return found_in(s->dir, name, fd);
+
+    // It disappeared: the index is out of date, so rebuild it and look again
+    if (errno == ENOENT) {
+        build_index(path_env);
+        s = find_index_slot(name, hash_name(name));
+        if (s->dir < 0) return NULL;
+        if (is_executable_in(s->dir, name)) return found_in(s->dir, name, fd);
+    }
+
+    // It is there but can't be run (e.g. a link to a directory, or a file
+    // without execute permission), so a later directory may still have it
+    for (int dir = s->dir + 1; dir < dir_index.dir_count; dir++)
+        if (is_executable_in(dir, name)) return found_in(dir, name, fd);
+    return NULL;
+}
+
+// Empties the cache
+static void forget_all() {
+    for (int i = 0; i < cache.capacity; i++)
+        if (cache.slots[i].name != NULL) free_slot(&cache.slots[i]);
+    cache.count = 0;
+}
+
+// Forgets everything the cache has resolved, and has the directory index
+// catch up with its directories before the next lookup
+void path_cache_clear() {
+    forget_all();
+    dir_index.checked.tv_sec -= PATH_INDEX_RECHECK_MS / 1000 + 1;
+    path_cache_poll();
+}
+
+// Points the index entry for name at the first directory that now has it,
+// and forgets where the cache had it
+static void update_name(const char* name) {
+    path_cache_remove(name);
+
+    // Like index_directory, anything but a directory counts; search_path
+    // sorts out entries that aren't regular files
+    int found = INDEX_GONE;
+    for (int i = 0; i < dir_index.dir_count && found == INDEX_GONE; i++) {
+        struct stat st;
+        if (dir_index.dirs[i].fd >= 0 &&
+            fstatat(dir_index.dirs[i].fd, name, &st, AT_SYMLINK_NOFOLLOW) ==
+                0 &&
+            !S_ISDIR(st.st_mode))
+            found = i;
+    }
+    index_name(name, strlen(name), found, true);
+}
+
+// Applies every queued inotify event, without blocking
+void path_cache_poll() {
+    // Aligned for the struct inotify_event records read into it
+    char buffer[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (dir_index.inotify_fd >= 0) {
+        ssize_t count = read(dir_index.inotify_fd, buffer, sizeof(buffer));
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) break;  // EAGAIN: nothing (more) happened
+
+        for (char* p = buffer; p < buffer + count;) {
+            const struct inotify_event* event =
+                reinterpret_cast<const struct inotify_event*>(p);
+            p += sizeof(struct inotify_event) + event->len;
+
+            // Events were lost, or a whole directory went away: start over
+            if (event->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF |
+                               IN_IGNORED)) {
+                forget_all();
+                dir_index.stale = true;
+            } else if (event->len > 0 && !dir_index.stale) {
+                update_name(event->name);
+            }
+        }
+    }
+}
+
+// Empties the cache if $PATH changed since its entries were resolved.
+// Returns the current $PATH, or NULL if it isn't set
+static const char* check_path_env() {
+    const char* path_env = getenv("PATH");
+
+    if (path_env == NULL || cache.path_env == NULL ||
+        strcmp(path_env, cache.path_env) != 0) {
+        path_cache_clear();
+        dir_index.stale = true;
+        delete[] cache.path_env;
+        cache.path_env = path_env != NULL ? copy_string(path_env) : NULL;
+    }
+
+    return path_env;
+}
+
+// Removes the entry in s, shifting later entries of its probe run back so
+// lookups never stop early at the hole
+static void remove_slot(slot* s) {
+    free_slot(s);
+    cache.count--;
+
+    unsigned int mask = cache.capacity - 1;
+    unsigned int hole = s - cache.slots;
+    for (unsigned int i = (hole + 1) & mask; cache.slots[i].name != NULL;
+         i = (i + 1) & mask) {
+        // An entry may move into the hole only if the hole lies between its
+        // home slot and where it is now (cyclically)
+        unsigned int home = cache.slots[i].hash & mask;
+        bool movable = hole <= i ? (home <= hole || home > i)
+                                 : (home <= hole && home > i);
+        if (movable) {
+            cache.slots[hole] = cache.slots[i];
+            cache.slots[i].name = NULL;
+            cache.slots[i].path = NULL;
+            hole = i;
+        }
+    }
+}
+
+// Looks name up, resolving and remembering it on a miss. Returns its slot, or
+// NULL if name is not in $PATH
+static slot* resolve(const char* name) {
+    const char* path_env = check_path_env();
+    if (path_env == NULL) return NULL;
+
+    // Keep the table at most half full, so probe runs stay short
+    if (2 * (cache.count + 1) > cache.capacity) grow();
+
+    unsigned int hash = hash_name(name);
+    slot* s = find_slot(name, hash);
+
+    if (s->name != NULL) {
+        // Any change to its file would have removed it in path_cache_poll
+        if (dir_index.watching) return s;
+
+        // The file may have been deleted or replaced since: if so, resolve it
+        // afresh
+        struct stat buffer;
+        struct stat opened;
+        if (stat(s->path, &buffer) == 0 && S_ISREG(buffer.st_mode) &&
+            faccessat(AT_FDCWD, s->path, X_OK, AT_EACCESS) == 0 &&
+            (s->fd < 0 || (fstat(s->fd, &opened) == 0 &&
+                           opened.st_ino == buffer.st_ino &&
+                           opened.st_dev == buffer.st_dev)))
+            return s;
+        remove_slot(s);
+        s = find_slot(name, hash);
+    }
+
+    int fd;
+    char* path = search_path(name, path_env, &fd);
+    if (path == NULL) return NULL;
+
+    s->name = copy_string(name);
+    s->path = path;
+    s->fd = fd;
+    s->hits = 0;
+    s->hash = hash;
+    cache.count++;
+    return s;
+}
+
+// Watches (or not) the directories of the next index built
+void path_cache_use_inotify(bool use) {
+    use_inotify = use;
+}
+
+// Returns the full path of name, from the cache when possible
+const char* path_cache_lookup(const char* name) {
+    return path_cache_lookup_binary(name, NULL);
+}
+
+// Same, also handing out the program's descriptor
+const char* path_cache_lookup_binary(const char* name, int* fd) {
+    slot* s = resolve(name);
+    if (s == NULL) return NULL;
+    s->hits++;
+    if (fd != NULL) *fd = s->fd;
+    return s->path;
+}
+
+// Resolves and remembers name without counting a hit
+bool path_cache_add(const char* name) {
+    return resolve(name) != NULL;
+}
+
+// Forgets name
+bool path_cache_remove(const char* name) {
+    if (cache.count == 0) return false;
+    slot* s = find_slot(name, hash_name(name));
+    if (s->name == NULL) return false;
+    remove_slot(s);
+    return true;
+}
+
+// Number of remembered names
+int path_cache_size() {
+    return cache.count;
+}
+
+// Copies out up to max remembered entries
+int path_cache_entries(path_cache_entry* entries, int max) {
+    int n = 0;
+    for (int i = 0; i < cache.capacity && n < max; i++) {
+        if (cache.slots[i].name == NULL) continue;
+        entries[n].name = cache.slots[i].name;
+        entries[n].path = cache.slots[i].path;
+        entries[n].hits = cache.slots[i].hits;
+        n++;
+    }
+    return n;
+}
@@ -0,0 +1,119 @@
+#ifndef PATH_CACHE_H
+#define PATH_CACHE_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/**
+ * A remembered command: the full path name resolved to, and how many times
+ * the cache has answered a lookup for it.
+ */
+typedef struct {
+    const char* name;
+    const char* path;
+    unsigned long hits;
+} path_cache_entry;
+
+/**
+ * Returns the full path of the program name, like bash's hashed command
+ * lookup: a name seen before is answered from the cache, and only a new name
+ * is searched for in the directories of $PATH (then remembered).
+ *
+ * The cache is emptied whenever $PATH differs from the value its entries were
+ * resolved against. Every $PATH directory is watched with inotify, and
+ * path_cache_poll drops just the entries whose files were created, removed or
+ * renamed; a cache hit makes no system call. Without inotify, a hit checks
+ * that its file still exists instead.
+ *
+ * New names are searched for in an index of the files in every $PATH
+ * directory rather than on disk. The index is read with getdents64 on first
+ * use and kept up to date by path_cache_poll (or, without inotify, reread when
+ * a directory's mtime changes, which is checked at most once a second and on
+ * the next lookup after path_cache_clear). Names with a slash are never
+ * searched for.
+ *
+ * @param name program name, e.g. "ls"
+ * @return const char* full path, valid until the cache next changes | NULL if
+ * name is not in $PATH
+ */
+const char* path_cache_lookup(const char* name);
+
+/**
+ * Like path_cache_lookup, and also returns the program file opened as an
+ * O_PATH descriptor, for launching it with execveat without the kernel
+ * walking its path again. The descriptor belongs to the cache and is closed
+ * when the entry is forgotten; it is -1 if the cache already holds its
+ * maximum number of descriptors.
+ *
+ * @param name program name, e.g. "ls"
+ * @param fd set to the descriptor (or -1) when name is found; may be NULL
+ * @return const char* full path, valid until the cache next changes | NULL if
+ * name is not in $PATH
+ */
+const char* path_cache_lookup_binary(const char* name, int* fd);
+
+/**
+ * Searches $PATH for name and remembers the result, without counting a hit
+ * (what `hash name` does).
+ *
+ * @param name
+ * @return true (found and remembered) | false (not in $PATH)
+ */
+bool path_cache_add(const char* name);
+
+/**
+ * Forgets name (what `hash -d name` does).
+ *
+ * @param name
+ * @return true (name was remembered) | false
+ */
+bool path_cache_remove(const char* name);
+
+/**
+ * Forgets every remembered name (what `hash -r` does), and has the directory
+ * index catch up with changes to its directories.
+ *
+ * @return void
+ */
+void path_cache_clear();
+
+/**
+ * Drains the inotify events queued for the $PATH directories without
+ * blocking, forgetting the names they affect. Call it before each command, so
+ * lookups never answer from a stale entry.
+ *
+ * @return void
+ */
+void path_cache_poll();
+
+/**
+ * Sets whether the directory index, when it is next built, watches the $PATH
+ * directories with inotify (the default) or polls their mtimes. An inotify
+ * descriptor already open is left as it is.
+ *
+ * Tearing the watches down can take the kernel milliseconds, paid at execve
+ * or exit, so this is turned off for a lookup that the shell will only exec.
+ *
+ * @param use
+ * @return void
+ */
+void path_cache_use_inotify(bool use);
+
+/**
+ * Number of remembered names.
+ *
+ * @return int
+ */
+int path_cache_size();
+
+/**
+ * Copies up to max remembered entries into entries, in no particular order.
+ * The strings stay valid until the cache next changes.
+ *
+ * @param entries
+ * @param max
+ * @return int number of entries copied
+ */
+int path_cache_entries(path_cache_entry* entries, int max);
+
+#endif  // PATH_CACHE_H
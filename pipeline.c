@@ -0,0 +1,180 @@
+#include "pipeline.h"
+
+#include <poll.h>
+#include <sys/resource.h>
+
+#include "spawn.h"
+
+/**
+ * pipeline.c - Running commands joined by |
+ *
+ * Every stage becomes a command of its own and is started before the shell
+ * waits for any of them, so all of them stream at once. The shell closes its
+ * copies of the pipe ends as soon as the stages using them are started, so a
+ * stage sees end of file (or SIGPIPE) exactly when its neighbor is gone.
+ */
+
+// Returns true if arg is the | token
+static inline bool is_pipe_token(const char* arg) {
+    return arg[0] == PIPE_TOKEN[0] && arg[1] == '\0';
+}
+
+// Checks cmd's arguments for a |
+bool is_pipeline(const command* cmd) {
+    for (int i = 0; i < cmd->argc; i++)
+        if (is_pipe_token(cmd->argv[i])) return true;
+    return false;
+}
+
+// Splits cmd at its | arguments into count new commands, or returns false
+// (leaving stages empty) if a stage has no arguments
+static bool split_stages(const command* cmd, command** stages, int count) {
+    int stage = 0;
+    int start = 0;
+    for (int i = 0; i <= cmd->argc; i++) {
+        if (i < cmd->argc && !is_pipe_token(cmd->argv[i])) continue;
+        if (i == start) break;
+        stages[stage++] =
+            create_command_from_args(i - start, cmd->argv + start);
+        start = i + 1;
+    }
+    if (stage == count) return true;
+
+    for (int i = 0; i < stage; i++) cleanup(stages[i]);
+    return false;
+}
+
+// Records in usage (unless NULL) how the stage that just exited ran
+static void record_stage(stage_usage* usage, const struct timespec* start,
+                         int status, const struct rusage* rusage) {
+    if (usage == NULL) return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    usage->status = status;
+    usage->real =
+        (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+    usage->usage = *rusage;
+}
+
+// Waits for the started stages (pids[i] > 0) in the order they exit, and
+// returns the wait status of the last stage, or -1 if it never started
+int wait_pipeline(const pid_t* pids, int count, const struct timespec* start,
+                  stage_usage* usage) {
+    int last_status = -1;
+    struct pollfd* polled = new struct pollfd[count];
+    // Stage each polled pidfd belongs to
+    int* stage_of = new int[count];
+    int waiting = 0;
+    struct rusage rusage;
+    if (usage != NULL) memset(usage, 0, count * sizeof(stage_usage));
+
+    for (int i = 0; i < count; i++) {
+        if (usage != NULL) usage[i].status = -1;
+        if (pids[i] <= 0) continue;
+        int pidfd = open_pidfd(pids[i]);
+        // No pidfds here (Linux < 5.3): wait for this one in order
+        if (pidfd < 0) {
+            int status;
+            if (wait4(pids[i], &status, 0, &rusage) != pids[i]) continue;
+            if (i == count - 1) last_status = status;
+            record_stage(usage ? &usage[i] : NULL, start, status, &rusage);
+            continue;
+        }
+        polled[waiting].fd = pidfd;
+        polled[waiting].events = POLLIN;
+        stage_of[waiting] = i;
+        waiting++;
+    }
+
+    // A pidfd turns readable when its process exits, which is when we reap it
+    int remaining = waiting;
+    while (remaining > 0) {
+        if (poll(polled, waiting, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll failed");
+            break;
+        }
+        for (int i = 0; i < waiting; i++) {
+            if (polled[i].fd < 0 || polled[i].revents == 0) continue;
+            int stage = stage_of[i];
+            int status;
+            if (wait4(pids[stage], &status, 0, &rusage) == pids[stage]) {
+                if (stage == count - 1) last_status = status;
+                record_stage(usage ? &usage[stage] : NULL, start, status,
+                             &rusage);
+            }
+            close(polled[i].fd);
+            // poll skips negative descriptors
+            polled[i].fd = -1;
+            remaining--;
+        }
+    }
+
+    for (int i = 0; i < waiting; i++)
+        if (polled[i].fd >= 0) close(polled[i].fd);
+    delete[] polled;
+    delete[] stage_of;
+    return last_status;
+}
+
+// Starts every stage of cmd, the first one reading from in
+pid_t* start_pipeline(command* cmd, int in, int out, int* count) {
+    *count = 1;
+    for (int i = 0; i < cmd->argc; i++)
+        if (is_pipe_token(cmd->argv[i])) (*count)++;
+
+    command** stages = new command*[*count];
+    if (!split_stages(cmd, stages, *count)) {
+        fprintf(stderr, "syntax error near unexpected token `%s'\n",
+                PIPE_TOKEN);
+        delete[] stages;
+        return NULL;
+    }
+
+    pid_t* pids = new pid_t[*count];
+    // Read end of the pipe from the previous stage (in and out belong to the
+    // caller)
+    int previous = -1;
+    for (int i = 0; i < *count; i++) {
+        int pipe_fds[2] = {-1, -1};
+        if (i < *count - 1) {
+            if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
+                perror("pipe failed");
+                // Start no more stages
+                for (int j = i; j < *count; j++) pids[j] = -1;
+                break;
+            }
+            // Best effort: a smaller buffer only costs more context switches
+            fcntl(pipe_fds[1], F_SETPIPE_SZ, PIPELINE_PIPE_SIZE);
+        }
+
+        int stdio[3] = {i == 0 ? in : previous,
+                        i == *count - 1 ? out : pipe_fds[1], -1};
+        pids[i] = start_command(stages[i], stdio);
+
+        // The children have their own copies now
+        if (previous >= 0) close(previous);
+        if (pipe_fds[1] >= 0) close(pipe_fds[1]);
+        previous = pipe_fds[0];
+    }
+    if (previous >= 0) close(previous);
+
+    for (int i = 0; i < *count; i++) cleanup(stages[i]);
+    delete[] stages;
+    return pids;
+}
+
+// Starts every stage of cmd, then waits for all of them
+int execute_pipeline(command* cmd) {
+    int count;
+    pid_t* pids = start_pipeline(cmd, -1, -1, &count);
+    if (pids == NULL) return ERROR;
+
+    int status = wait_pipeline(pids, count, NULL, NULL);
+    delete[] pids;
+
+    // As in bash, the pipeline succeeds if its last stage does
+    return status != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0
+               ? SUCCESS
+               : ERROR;
+}
@@ -0,0 +1,88 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <sys/resource.h>
+#include <time.h>
+
+#include "shell.h"
+
+// Argument separating the stages of a pipeline
+#define PIPE_TOKEN "|"
+
+// Capacity asked for (with F_SETPIPE_SZ) for every pipe between two stages,
+// so a stage producing bulk data can run further ahead of the next one.
+// /proc/sys/fs/pipe-max-size caps it for unprivileged users (1 MiB by default)
+#define PIPELINE_PIPE_SIZE (1024 * 1024)
+
+/**
+ * Returns true if cmd is a pipeline, i.e. one of its arguments is a |
+ * (see tokenize).
+ *
+ * @param cmd
+ * @return true | false
+ */
+bool is_pipeline(const command* cmd);
+
+/**
+ * Starts every stage of the pipeline cmd, as execute_pipeline does, without
+ * waiting for any of them. The first stage reads from in, or from the
+ * shell's stdin if in is -1, and the last one writes to out, or to the
+ * shell's stdout if out is -1. A cmd without | is started as a pipeline of
+ * one stage.
+ *
+ * @param cmd
+ * @param in
+ * @param out
+ * @param count set to the number of stages
+ * @return the pids of the stages (-1 for a stage that couldn't be started),
+ * to be freed with delete[] | NULL (a stage is empty, nothing was started)
+ */
+pid_t* start_pipeline(command* cmd, int in, int out, int* count);
+
+/**
+ * How one stage of a pipeline ran.
+ *
+ * status: its wait status, or -1 if it never started (or wasn't reaped).
+ * real: seconds from the start of the pipeline to the stage's exit.
+ * usage: its resource usage, as wait4 reported it.
+ */
+typedef struct {
+    int status;
+    double real;
+    struct rusage usage;
+} stage_usage;
+
+/**
+ * Waits for the stages of a pipeline started by start_pipeline (those with
+ * pids[i] > 0), reaping each with wait4 as soon as it exits, whatever the
+ * order (through pidfd_open and poll, or in order where that is missing).
+ *
+ * @param pids
+ * @param count
+ * @param start when the pipeline started (CLOCK_MONOTONIC), for usage
+ * @param usage unless NULL, count entries to fill in, one per stage
+ * @return the wait status of the last stage | -1 if it never started
+ */
+int wait_pipeline(const pid_t* pids, int count, const struct timespec* start,
+                  stage_usage* usage);
+
+/**
+ * Runs the pipeline cmd, e.g. "ls -l | sort | head": every stage is started
+ * right away (see start_command), with stdout of each connected to stdin of
+ * the next through a pipe2(O_CLOEXEC) pipe enlarged to PIPELINE_PIPE_SIZE. The
+ * data flows between the stages without passing through the shell.
+ *
+ * The shell then waits for all of the stages, reaping each as soon as it
+ * exits (through pidfd_open and poll, or in order where that is missing).
+ * A stage that can't be found or started is skipped, its neighbors seeing end
+ * of file or a broken pipe.
+ *
+ * An empty stage (leading, trailing or doubled |) is a syntax error, reported
+ * on stderr without starting anything.
+ *
+ * @param cmd
+ * @return SUCCESS (the last stage exited with status 0) | ERROR
+ */
+int execute_pipeline(command* cmd);
+
+#endif  // PIPELINE_H
@@ -0,0 +1,258 @@
+#include "redirect.h"
+
+#include "substitution.h"
+
+/**
+ * redirect.c - <, > and the like
+ *
+ * The shell opens every file itself, so the cost in the child is one dup3 per
+ * redirected stream. Each stream is only ever given its final descriptor:
+ * "> a > b" still creates a, as in bash, but the child never sees it.
+ */
+
+// Lowest descriptor the shell's own streams are moved to while a built-in
+// runs with them redirected, out of the way of those a command would use
+#define REDIRECT_SAVED_FD_MIN 10
+
+// Saved in place of a stream the shell didn't have open
+#define REDIRECT_WAS_CLOSED -2
+
+// Files are created as by bash, which leaves the rest to the umask
+#define REDIRECT_FILE_MODE 0666
+
+// Finds the end of an operator, with or without an fd number in front
+const char* redirection_end(const char* p) {
+    // &> and &>>, for stdout and stderr both
+    if (*p == '&') return p[1] != '>' ? NULL : p[2] == '>' ? p + 3 : p + 2;
+
+    if (isdigit(*p)) p++;
+    if (*p != '<' && *p != '>') return NULL;
+    if (p[0] == '>' && p[1] == '>') return p + 2;
+    p++;
+    // A copy of another stream, as in 2>&1
+    if (*p == '&' && isdigit(p[1])) p += 2;
+    return p;
+}
+
+// Returns true if arg is a whole redirection operator
+static inline bool is_redirection_token(const char* arg) {
+    const char* end = redirection_end(arg);
+    return end != NULL && *end == '\0';
+}
+
+// Checks cmd's arguments for an operator
+bool has_redirection(const command* cmd) {
+    for (int i = 0; i < cmd->argc; i++)
+        if (is_redirection_token(cmd->argv[i])) return true;
+    return false;
+}
+
+// Adds the redirection of operator op (a redirection token) to redirs, and
+// its file, the argument after it. Returns the number of arguments it took
+// after op (0 or 1), or -1 if it isn't valid
+static int add_redirection(redirections* redirs, const char* op,
+                            const char* file) {
+    const char* p = op;
+    bool both = *p == '&';
+    if (both) p++;
+    int fd = isdigit(*p) ? *p++ - '0' : *p == '<' ? 0 : 1;
+    char direction = *p++;
+    bool append = *p == '>';
+    if (append) p++;
+    int source = *p == '&' ? p[1] - '0' : -1;
+    if (fd > 2 || source > 2) {
+        fprintf(stderr, "%s: only 0, 1 and 2 can be redirected\n", op);
+        return -1;
+    }
+
+    redirection* added = &redirs->items[redirs->count++];
+    added->fd = fd;
+    added->source = source;
+    added->path = NULL;
+    added->flags = -1;
+    if (source >= 0) return 0;
+
+    if (file == NULL || is_redirection_token(file)) {
+        fprintf(stderr, "syntax error near unexpected token `%s'\n",
+                file != NULL ? file : "newline");
+        return -1;
+    }
+    added->path = file;
+    added->flags = direction == '<' ? O_RDONLY
+                   : append         ? O_WRONLY | O_CREAT | O_APPEND
+                                    : O_WRONLY | O_CREAT | O_TRUNC;
+    if (both) {
+        // &> file is > file 2>&1
+        redirection* copy = &redirs->items[redirs->count++];
+        copy->fd = 2;
+        copy->source = 1;
+        copy->path = NULL;
+        copy->flags = -1;
+    }
+    return 1;
+}
+
+// Splits cmd into its redirections and the rest of its arguments
+command* take_redirections(const command* cmd, redirections* redirs) {
+    // An operator takes at most two redirections (&>) and two arguments
+    redirs->items = new redirection[cmd->argc];
+    redirs->count = 0;
+    for (int i = 0; i < 3; i++) {
+        redirs->stdio[i] = -1;
+        redirs->owned[i] = false;
+    }
+
+    char** args = new char*[cmd->argc];
+    int argc = 0;
+    bool valid = true;
+    for (int i = 0; i < cmd->argc && valid; i++) {
+        const char* arg = cmd->argv[i];
+        if (!is_redirection_token(arg)) {
+            args[argc++] = cmd->argv[i];
+            continue;
+        }
+        const char* file = i + 1 < cmd->argc ? cmd->argv[i + 1] : NULL;
+        int taken = add_redirection(redirs, arg, file);
+        valid = taken >= 0;
+        i += taken;
+    }
+
+    command* bare = valid ? create_command_from_args(argc, args) : NULL;
+    delete[] args;
+    if (!valid) close_redirections(redirs);
+    return bare;
+}
+
+// Points stream n of redirs at fd, which it owns if owned. Returns false if
+// a stream couldn't be kept
+static bool set_stream(redirections* redirs, int n, int fd, bool owned) {
+    int old = redirs->stdio[n];
+    if (fd == old) return true;
+
+    // Streams made copies of the shell's own stream n (as by "2>&1 > log")
+    // are pointed at it before n is, in the child and in redirect_shell,
+    // unless they come first: they get a copy of their own to keep
+    int kept = -1;
+    for (int i = n + 1; i < 3; i++) {
+        if (redirs->stdio[i] != n) continue;
+        if (kept < 0) {
+            kept = fcntl(n, F_DUPFD_CLOEXEC, 3);
+            if (kept < 0) {
+                perror("fcntl failed");
+                return false;
+            }
+            redirs->owned[i] = true;
+        }
+        redirs->stdio[i] = kept;
+    }
+
+    // A file opened for n alone is closed, one shared is handed on
+    if (redirs->owned[n]) {
+        int heir = -1;
+        for (int i = 0; i < 3; i++)
+            if (i != n && redirs->stdio[i] == old) heir = i;
+        if (heir >= 0)
+            redirs->owned[heir] = true;
+        else
+            close(old);
+    }
+    redirs->stdio[n] = fd;
+    redirs->owned[n] = owned;
+    return true;
+}
+
+// Opens the files and applies the redirections in order, from stdio
+bool open_redirections(redirections* redirs, const int* stdio) {
+    for (int i = 0; i < 3; i++) {
+        redirs->stdio[i] = stdio != NULL ? stdio[i] : -1;
+        redirs->owned[i] = false;
+    }
+
+    for (int i = 0; i < redirs->count; i++) {
+        const redirection* applied = &redirs->items[i];
+        int fd;
+        if (applied->flags < 0) {
+            int source = applied->source;
+            fd = redirs->stdio[source] >= 0 ? redirs->stdio[source] : source;
+        } else {
+            // The file's name may come from $(...) or $NAME, in one piece
+            char* expanded = NULL;
+            if (word_has_expansion(applied->path)) {
+                expanded = expand_word(applied->path);
+                if (expanded == NULL) {
+                    close_redirections(redirs);
+                    return false;
+                }
+            }
+            const char* path = expanded != NULL ? expanded : applied->path;
+            fd = open(path, applied->flags | O_CLOEXEC, REDIRECT_FILE_MODE);
+            if (fd < 0) fprintf(stderr, "%s: %s\n", path, strerror(errno));
+            delete[] expanded;
+            if (fd < 0) {
+                close_redirections(redirs);
+                return false;
+            }
+        }
+        if (!set_stream(redirs, applied->fd, fd, applied->flags >= 0)) {
+            if (applied->flags >= 0) close(fd);
+            close_redirections(redirs);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Closes what open_redirections opened, and frees the items
+void close_redirections(redirections* redirs) {
+    for (int i = 0; i < 3; i++) {
+        if (redirs->owned[i]) close(redirs->stdio[i]);
+        redirs->owned[i] = false;
+        redirs->stdio[i] = -1;
+    }
+    delete[] redirs->items;
+    redirs->items = NULL;
+    redirs->count = 0;
+}
+
+// Moves the shell's streams aside and puts redirs' in their place
+bool redirect_shell(const redirections* redirs, int* saved) {
+    // What the shell wrote so far goes where stdout was
+    fflush(stdout);
+    for (int i = 0; i < 3; i++) saved[i] = -1;
+
+    for (int i = 0; i < 3; i++) {
+        int fd = redirs->stdio[i];
+        if (fd < 0 || fd == i) continue;
+        saved[i] = fcntl(i, F_DUPFD_CLOEXEC, REDIRECT_SAVED_FD_MIN);
+        if (saved[i] < 0 && errno == EBADF) saved[i] = REDIRECT_WAS_CLOSED;
+        if (saved[i] == -1 || dup3(fd, i, 0) < 0) {
+            perror("dup3 failed");
+            restore_shell(saved);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Puts the shell's streams back
+void restore_shell(int* saved) {
+    fflush(stdout);
+    for (int i = 0; i < 3; i++) {
+        if (saved[i] == -1) continue;
+        if (saved[i] == REDIRECT_WAS_CLOSED) {
+            close(i);
+        } else {
+            dup3(saved[i], i, 0);
+            close(saved[i]);
+        }
+        saved[i] = -1;
+    }
+}
+
+// Lets go of the shell's old streams
+void keep_redirected(int* saved) {
+    for (int i = 0; i < 3; i++) {
+        if (saved[i] >= 0) close(saved[i]);
+        saved[i] = -1;
+    }
+}
@@ -0,0 +1,131 @@
+#ifndef REDIRECT_H
+#define REDIRECT_H
+
+#include "shell.h"
+
+/**
+ * I/O redirections: < file, > file, >> file, 2> file, 2>> file, 2>&1, >&2,
+ * &> file and &>> file, in any number and order, anywhere in a command (as
+ * in "sort < in.txt > out.txt" or "make &> build.log"). An fd number goes
+ * right before the operator and is 0, 1 or 2. As in bash, they apply from
+ * left to right, so "> log 2>&1" sends both streams to log while
+ * "2>&1 > log" sends stderr where stdout went before.
+ *
+ * Files are opened by the shell with O_CLOEXEC, before the command starts:
+ * the child only has to dup3 each of them onto its stream, and where the
+ * same file is named for two streams (as with &>), it is opened once. A
+ * built-in runs in the shell all the same, with the shell's own streams
+ * moved aside while it runs and put back afterwards.
+ */
+
+/**
+ * One redirection of a command, e.g. "2>&1" or ">> log".
+ *
+ * fd: the stream redirected, 0, 1 or 2.
+ * flags: flags for open(2) of path, or -1 if fd becomes a copy of source.
+ */
+typedef struct {
+    int fd;
+    int flags;
+    const char* path;
+    int source;
+} redirection;
+
+/**
+ * The redirections of a command, in order, and what they come to once
+ * applied by open_redirections.
+ *
+ * stdio: descriptors for stdin, stdout and stderr, as for start_command (-1
+ * leaves a stream alone).
+ * owned: whether stdio[i] was opened by open_redirections, to be closed by
+ * close_redirections.
+ */
+typedef struct {
+    redirection* items;
+    int count;
+    int stdio[3];
+    bool owned[3];
+} redirections;
+
+/**
+ * Returns the end of the redirection operator starting at p ("<", "2>>",
+ * "2>&1", "&>" ...), for tokenize, which makes every operator a token of its
+ * own.
+ *
+ * @param p
+ * @return the char after the operator | NULL if p doesn't start one
+ */
+const char* redirection_end(const char* p);
+
+/**
+ * Returns true if one of cmd's arguments is a redirection operator.
+ *
+ * @param cmd
+ * @return true | false
+ */
+bool has_redirection(const command* cmd);
+
+/**
+ * Collects cmd's redirections into redirs and returns the command they
+ * leave, e.g. "sort -n" for "sort < in -n". redirs refers to cmd's
+ * arguments, so cmd must outlive it.
+ *
+ * An operator without a file after it, or an fd number above 2, is a
+ * syntax error, reported on stderr.
+ *
+ * @param cmd
+ * @param redirs filled in, to be freed with close_redirections
+ * @return the command without its redirections, to be freed with cleanup |
+ * NULL (syntax error, redirs is left empty)
+ */
+command* take_redirections(const command* cmd, redirections* redirs);
+
+/**
+ * Opens the files of redirs (O_CLOEXEC) and works out redirs->stdio: what
+ * stdio (as for start_command, or NULL) comes to once every redirection is
+ * applied in order. A file that can't be opened is reported on stderr.
+ *
+ * @param redirs
+ * @param stdio
+ * @return true | false (a file couldn't be opened, none are left open)
+ */
+bool open_redirections(redirections* redirs, const int* stdio);
+
+/**
+ * Closes the files open_redirections opened and frees redirs->items.
+ *
+ * @param redirs
+ * @return void
+ */
+void close_redirections(redirections* redirs);
+
+/**
+ * Points the shell's own stdin, stdout and stderr at redirs->stdio (after
+ * flushing stdout), so a built-in can run with its streams redirected. The
+ * streams moved aside are kept in saved, 3 descriptors, for
+ * restore_shell.
+ *
+ * @param redirs
+ * @param saved
+ * @return true | false (nothing was changed)
+ */
+bool redirect_shell(const redirections* redirs, int* saved);
+
+/**
+ * Flushes stdout and puts back the streams redirect_shell moved aside.
+ *
+ * @param saved
+ * @return void
+ */
+void restore_shell(int* saved);
+
+/**
+ * Closes the streams redirect_shell moved aside, so the redirections stay for
+ * good, as with "exec > log".
+ *
+ * @param saved
+ * @return void
+ */
+void keep_redirected(int* saved);
+
+#endif  // REDIRECT_H
@@ -0,0 +1,237 @@
+#include "script.h"
+
+#include <sys/mman.h>
+
+/**
+ * script.c - Ahead-of-time loading of script files
+ *
+ * A script file is memory mapped and every line is tokenized in one linear
+ * scan before the first command runs. Running a line then only has to copy
+ * its arguments out of the mapping into a (pooled) command block: no read
+ * calls and no rescanning.
+ */
+
+// Tokens per line reserved ahead of the scan
+#define SCRIPT_TOKENS_PER_LINE 4
+
+// Starts s out empty
+static void init_script(script* s) {
+    memset(s, 0, sizeof(*s));
+}
+
+// Appends a line with the given tokens to s, growing its arrays as needed
+static void add_line(script* s, const char* text, size_t len,
+                     const token_list* tokens) {
+    // Double the capacity of lines when full
+    if (s->line_count == s->line_capacity) {
+        int capacity = s->line_capacity == 0 ? 64 : s->line_capacity * 2;
+        script_line* grown = new script_line[capacity];
+        if (s->line_count > 0)
+            memcpy(grown, s->lines, s->line_count * sizeof(script_line));
+        delete[] s->lines;
+        s->lines = grown;
+        s->line_capacity = capacity;
+    }
+
+    // Same for tokens, making sure all of this line's tokens fit
+    if (s->token_count + tokens->count > s->token_capacity) {
+        int capacity = s->token_capacity == 0 ? 256 : s->token_capacity * 2;
+        while (capacity < s->token_count + tokens->count) capacity *= 2;
+        token* grown = new token[capacity];
+        if (s->token_count > 0)
+            memcpy(grown, s->tokens, s->token_count * sizeof(token));
+        delete[] s->tokens;
+        s->tokens = grown;
+        s->token_capacity = capacity;
+    }
+
+    script_line* line = &s->lines[s->line_count++];
+    line->text = text;
+    line->len = len;
+    line->first_token = s->token_count;
+    line->token_count = tokens->count;
+
+    memcpy(s->tokens + s->token_count, tokens->items,
+           tokens->count * sizeof(token));
+    s->token_count += tokens->count;
+}
+
+// Sizes the arrays of s for the lines of text[0] ... end[-1] up front, so a
+// big script does not spend its load time copying and faulting in ever
+// larger arrays. Counting newlines with memchr is far cheaper than that
+static void reserve(script* s, const char* text, const char* end) {
+    int lines = 1;
+    for (const char* p = text;
+         (p = static_cast<const char*>(memchr(p, '\n', end - p))) != NULL;
+         p++)
+        lines++;
+
+    delete[] s->lines;
+    delete[] s->tokens;
+    s->line_capacity = lines;
+    s->lines = new script_line[lines];
+    // A guess; add_line grows the array if the lines are longer
+    s->token_capacity = lines * SCRIPT_TOKENS_PER_LINE;
+    s->tokens = new token[s->token_capacity];
+}
+
+// Tokenizes the lines of text[0] ... end[-1] into s. *end must be a newline
+// or null terminator, so tokenize_line never runs past it
+static void tokenize_text(script* s, const char* text, const char* end) {
+    token_list tokens;
+    const char* p = text;
+
+    while (p < end) {
+        const char* line_end = tokenize_line(p, &tokens);
+
+        // A null byte inside the line stops tokenize_line early; the rest of
+        // the line is ignored, just like when a line is typed in
+        if (*line_end != '\n' && line_end < end) {
+            const char* newline =
+                static_cast<const char*>(memchr(line_end, '\n', end - line_end));
+            line_end = newline != NULL ? newline : end;
+        }
+
+        // Blank lines are dropped right away
+        if (tokens.count > 0) add_line(s, p, line_end - p, &tokens);
+        token_list_free(&tokens);
+
+        p = line_end + 1;
+    }
+}
+
+// Reads all of fd into a null-terminated heap buffer, for scripts that can't
+// be memory mapped (pipes, e.g. /dev/stdin)
+static char* read_all(int fd, size_t* size) {
+    size_t capacity = 64 * 1024;
+    // Using new instead of malloc to avoid valgrind issues
+    char* buffer = new char[capacity];
+    *size = 0;
+
+    while (true) {
+        // Always keep room for the null terminator
+        if (capacity - *size < 2) {
+            char* grown = new char[capacity * 2];
+            memcpy(grown, buffer, *size);
+            delete[] buffer;
+            buffer = grown;
+            capacity *= 2;
+        }
+
+        ssize_t count = read(fd, buffer + *size, capacity - *size - 1);
+        if (count < 0 && errno == EINTR) continue;
+        if (count < 0) {
+            delete[] buffer;
+            return NULL;
+        }
+        if (count == 0) break;
+        *size += count;
+    }
+
+    buffer[*size] = '\0';
+    return buffer;
+}
+
+// Maps the script at path and tokenizes all of it
+int load_script(const char* path, script* s) {
+    init_script(s);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return ERROR;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return ERROR;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        close(fd);
+        errno = EISDIR;
+        return ERROR;
+    }
+
+    // Not something we can map: fall back to reading it in one go
+    if (!S_ISREG(st.st_mode)) {
+        size_t size;
+        s->owned = read_all(fd, &size);
+        int saved_errno = errno;
+        close(fd);
+        if (s->owned == NULL) {
+            errno = saved_errno;
+            return ERROR;
+        }
+        reserve(s, s->owned, s->owned + size);
+        tokenize_text(s, s->owned, s->owned + size);
+        return SUCCESS;
+    }
+
+    // Nothing to run in an empty file (and mmap refuses a length of 0)
+    size_t size = st.st_size;
+    if (size == 0) {
+        close(fd);
+        return SUCCESS;
+    }
+
+    void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int saved_errno = errno;
+    // The mapping stays valid after the descriptor is closed
+    close(fd);
+    if (map == MAP_FAILED) {
+        errno = saved_errno;
+        return ERROR;
+    }
+    // The scans below read the file front to back
+    madvise(map, size, MADV_SEQUENTIAL);
+    s->map = static_cast<char*>(map);
+    s->map_size = size;
+
+    const char* end = s->map + size;
+    reserve(s, s->map, end);
+    if (end[-1] == '\n' || size % getpagesize() != 0) {
+        // Either the file ends in a newline, or the rest of its last page is
+        // zero-filled by the kernel, terminating the last line
+        tokenize_text(s, s->map, end - (end[-1] == '\n'));
+        return SUCCESS;
+    }
+
+    // The unterminated last line ends exactly at the end of the mapping, so
+    // it gets a null-terminated copy
+    const char* last = static_cast<const char*>(memrchr(s->map, '\n', size));
+    last = last != NULL ? last + 1 : s->map;
+    size_t last_len = end - last;
+    s->owned = new char[last_len + 1];
+    memcpy(s->owned, last, last_len);
+    s->owned[last_len] = '\0';
+
+    if (last > s->map) tokenize_text(s, s->map, last - 1);
+    tokenize_text(s, s->owned, s->owned + last_len);
+    return SUCCESS;
+}
+
+// Tokenizes a copy of text
+void load_script_text(const char* text, script* s) {
+    init_script(s);
+    size_t len = strlen(text);
+    s->owned = new char[len + 1];
+    memcpy(s->owned, text, len + 1);
+    reserve(s, s->owned, s->owned + len);
+    tokenize_text(s, s->owned, s->owned + len);
+}
+
+// Creates the command for line i from its recorded tokens
+command* script_command(const script* s, int i) {
+    const script_line* line = &s->lines[i];
+    return create_command_from_tokens(
+        line->text, s->tokens + line->first_token, line->token_count);
+}
+
+// Releases everything load_script or load_script_text set up
+void free_script(script* s) {
+    if (s->map != NULL) munmap(s->map, s->map_size);
+    // Using delete[] to match new[] above
+    delete[] s->owned;
+    delete[] s->lines;
+    delete[] s->tokens;
+    init_script(s);
+}
@@ -0,0 +1,77 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include "shell.h"
+
+/**
+ * One non-empty line of a script: its text (without the newline) and its
+ * tokens, which are script->tokens[first_token] ...
+ * script->tokens[first_token + token_count - 1]. Token offsets are relative
+ * to text.
+ */
+typedef struct {
+    const char* text;
+    size_t len;
+    int first_token;
+    int token_count;
+} script_line;
+
+/**
+ * A whole script, tokenized ahead of time.
+ *
+ * The text is either memory mapped from the script file (map) or, for -c,
+ * a heap copy (owned). A file whose last line has no newline and ends exactly
+ * on a page boundary also gets a heap copy of that line, since there is no
+ * byte after it in the mapping to terminate it.
+ */
+typedef struct {
+    char* map;
+    size_t map_size;
+    char* owned;
+    script_line* lines;
+    int line_count;
+    int line_capacity;
+    token* tokens;
+    int token_count;
+    int token_capacity;
+} script;
+
+/**
+ * Memory maps the file at path and tokenizes every line of it, in one linear
+ * scan, before anything is executed.
+ *
+ * @param path
+ * @param s filled with the script; release it with free_script
+ * @return SUCCESS | ERROR (with errno set)
+ */
+int load_script(const char* path, script* s);
+
+/**
+ * Tokenizes every line of text (e.g. the argument of -c) into s. text is
+ * copied, so it does not need to outlive s.
+ *
+ * @param text one or more newline separated lines
+ * @param s filled with the script; release it with free_script
+ * @return void
+ */
+void load_script_text(const char* text, script* s);
+
+/**
+ * Creates the command for line i of s from its pre-recorded tokens. Release
+ * it with cleanup as usual.
+ *
+ * @param s
+ * @param i index into s->lines
+ * @return command*
+ */
+command* script_command(const script* s, int i);
+
+/**
+ * Unmaps (or frees) the text of s and frees its lines and tokens.
+ *
+ * @param s
+ * @return void
+ */
+void free_script(script* s);
+
+#endif  // SCRIPT_H
@@ -1,5 +1,15 @@
 #include "shell.h"
 
+#include "builtins.h"
+#include "jobs.h"
+#include "path_cache.h"
+#include "pipeline.h"
+#include "redirect.h"
+#include "spawn.h"
+#include "substitution.h"
+#include "timing.h"
+#include "variables.h"
+
 /**
  * shell.c - A simple shell implementation
  *
@@ -9,88 +19,346 @@
  * and executes processes in a controlled environment.
  */
 
-// Initializes a command struct and allocates memory for its argv array
-command* create_command(int argc) {
-    // Allocate memory for the command struct
-    command* rv = new command;
+// Header of the single block backing a command. The argv array follows it
+// directly, then the argument chars:
+//
+//   [ command_block | argv[0] ... argv[argc] = NULL | "arg0\0arg1\0..." ]
+typedef struct {
+    // The command handed out, found again through live (see block_of)
+    command cmd;
+    // Bytes allocated for the whole block, which may exceed what cmd uses
+    size_t capacity;
+    // Buffer holding the full path find_full_path put in argv[0], or NULL.
+    // Kept (with its capacity) when the block goes back to the pool
+    char* resolved;
+    size_t resolved_capacity;
+    // O_PATH descriptor of the program at resolved (owned by the command
+    // cache, see path_cache_lookup_binary), or -1
+    int binary_fd;
+    // Where it is in live.blocks while handed out
+    int live_index;
+} command_block;
+
+// Smallest block the pool hands out. Blocks are sized in powers of two from
+// here, so lines of similar length land in the same block size
+#define COMMAND_POOL_MIN_BLOCK 256
+
+// Blocks released by cleanup wait here until parse or create_command needs
+// one again. In the REPL a single block cycles between the two, growing to
+// the longest line seen so far and then never being reallocated
+static struct {
+    command_block* blocks[COMMAND_POOL_MAX_BLOCKS];
+    int count;
+    command_pool_stats stats;
+} pool;
+
+// The blocks handed out and not cleaned up yet, newest last. A command is a
+// block only if it is one of these: a command assembled by hand (with
+// separate argv allocations, as in the tests) is never looked at beyond its
+// own two fields
+static struct {
+    command_block** blocks;
+    int count;
+    int capacity;
+} live;
+
+// Returns the argv array that sits right behind block
+static inline char** block_argv(command_block* block) {
+    return reinterpret_cast<char**>(block + 1);
+}
 
-    // Set argc for command
-    rv->argc = argc;
+// Adds block to the live blocks
+static void track_block(command_block* block) {
+    if (live.count == live.capacity) {
+        int capacity = live.capacity > 0 ? live.capacity * 2 : 16;
+        command_block** blocks = new command_block*[capacity];
+        if (live.count > 0)
+            memcpy(blocks, live.blocks, live.count * sizeof(command_block*));
+        delete[] live.blocks;
+        live.blocks = blocks;
+        live.capacity = capacity;
+    }
+    block->live_index = live.count;
+    live.blocks[live.count++] = block;
+}
 
-    // Allocate memory for argv (argc + 1 for NULL terminator)
-    rv->argv = new char*[argc + 1];
+// Takes block out of the live blocks, moving the newest into its place
+static void untrack_block(command_block* block) {
+    command_block* newest = live.blocks[--live.count];
+    live.blocks[block->live_index] = newest;
+    newest->live_index = block->live_index;
+}
 
-    // Allocate memory for each argument string
-    for (int i = 0; i < argc; i++) {
-        // Using new char[] because the C++ test is using char
-        // To avoid Valgrind mismatch errors
-        rv->argv[i] = new char[MAX_ARG_LEN];
+// Returns cmd's block if cmd was allocated as one, otherwise NULL. Commands
+// are mostly cleaned up newest first and few are alive at once, so the
+// search from the newest end is short
+static command_block* block_of(command* cmd) {
+    for (int i = live.count - 1; i >= 0; i--)
+        if (&live.blocks[i]->cmd == cmd) return live.blocks[i];
+    return NULL;
+}
+
+// Frees a block and the resolved path it carries
+static void free_block(command_block* block) {
+    // Using delete[] to match new char[] in allocate_block
+    delete[] block->resolved;
+    delete[] reinterpret_cast<char*>(block);
+}
+
+// Takes a block of at least size bytes out of the pool, or allocates one
+static command_block* acquire_block(size_t size) {
+    // Best fit among the pooled blocks, so big blocks stay available for big
+    // lines
+    int best = -1;
+    for (int i = 0; i < pool.count; i++) {
+        if (pool.blocks[i]->capacity >= size &&
+            (best < 0 || pool.blocks[i]->capacity < pool.blocks[best]->capacity))
+            best = i;
+    }
+
+    if (best >= 0) {
+        command_block* block = pool.blocks[best];
+        pool.blocks[best] = pool.blocks[--pool.count];
+        pool.stats.hits++;
+        return block;
+    }
+
+    // Nothing fits: give up the largest pooled block (if any) in favour of a
+    // bigger one, so the pool grows toward the high-water mark instead of
+    // collecting small blocks it can't use
+    pool.stats.misses++;
+    char* resolved = NULL;
+    size_t resolved_capacity = 0;
+    if (pool.count > 0) {
+        int largest = 0;
+        for (int i = 1; i < pool.count; i++)
+            if (pool.blocks[i]->capacity > pool.blocks[largest]->capacity)
+                largest = i;
+        command_block* old = pool.blocks[largest];
+        pool.blocks[largest] = pool.blocks[--pool.count];
+        // The resolved path buffer is still good, carry it over
+        resolved = old->resolved;
+        resolved_capacity = old->resolved_capacity;
+        old->resolved = NULL;
+        free_block(old);
     }
 
-    // Null terminate argv array
-    rv->argv[argc] = NULL;
+    size_t capacity = COMMAND_POOL_MIN_BLOCK;
+    while (capacity < size) capacity *= 2;
 
-    // Return pointer to the newly created command struct
-    return rv;
+    // Using new char[] to match delete[] in free_block
+    command_block* block =
+        reinterpret_cast<command_block*>(new char[capacity]);
+    block->capacity = capacity;
+    block->resolved = resolved;
+    block->resolved_capacity = resolved_capacity;
+    return block;
 }
 
-// Parses the input string into arguments and initializes a command structure
-command* parse(char* line) {
-    // Check validity of argument first
-    if (line == NULL) {
-        return NULL;
-    }
+// Returns a block to the pool, or frees it if the pool is full
+static void release_block(command_block* block) {
+    untrack_block(block);
+    if (pool.count < COMMAND_POOL_MAX_BLOCKS)
+        pool.blocks[pool.count++] = block;
+    else
+        free_block(block);
+}
+
+// Reports the pool counters
+void get_command_pool_stats(command_pool_stats* stats) {
+    *stats = pool.stats;
+    stats->pooled = pool.count;
+}
 
-    // Clone the input line to avoid modifying the original line
-    // // Using new instead of malloc to avoid valgrind issues
-    char* line_copy = new char[strlen(line) + 1];
-    strcpy(line_copy, line);
+// Frees every pooled block and zeroes the counters
+void command_pool_clear() {
+    for (int i = 0; i < pool.count; i++) free_block(pool.blocks[i]);
+    pool.count = 0;
+    memset(&pool.stats, 0, sizeof(pool.stats));
+}
 
-    // Count the number of arguments
-    int argc = 0;
+// Gets a block with room for argc arguments and string_bytes chars.
+// argv[argc] is set to NULL; argv[0] ... argv[argc - 1] are left to the caller
+static command_block* allocate_block(int argc, size_t string_bytes) {
+    // One block for the header, argv (argc + 1 for NULL terminator) and
+    // every argument string
+    size_t size = sizeof(command_block) + (argc + 1) * sizeof(char*) +
+                  string_bytes;
+    command_block* block = acquire_block(size);
+
+    block->cmd.argc = argc;
+    block->cmd.argv = block_argv(block);
+    block->cmd.argv[argc] = NULL;
+    block->binary_fd = -1;
+    track_block(block);
+    return block;
+}
 
-    // Split the line into spaces, tabs, and newlines to count the args
-    char* currentToken = strtok(line_copy, " \t\n");
+// Initializes a command struct with MAX_ARG_LEN chars for each argument
+command* create_command(int argc) {
+    command_block* block = allocate_block(argc, (size_t)argc * MAX_ARG_LEN);
 
-    // Count args and resumes tokenization, loop until end of line_copy
-    while (currentToken != NULL) {
-        argc++;
-        currentToken = strtok(NULL, " \t\n");
+    // Argument strings start right after the NULL terminator of argv
+    char* strings = reinterpret_cast<char*>(block->cmd.argv + argc + 1);
+    for (int i = 0; i < argc; i++) {
+        block->cmd.argv[i] = strings + (size_t)i * MAX_ARG_LEN;
+        block->cmd.argv[i][0] = '\0';
     }
 
-    // Create a command structure
-    command* cmd = create_command(argc);
+    // Return pointer to the newly created command struct
+    return &block->cmd;
+}
 
-    // If command creation fails
-    if (cmd == NULL) {
-        // Prevent memory leak by deallocating
-        // delete[] being used to avoid mismatch issues of Valgrind
-        delete[] line_copy;
-        return NULL;
+// Creates a command holding right-sized copies of the tokens of line
+command* create_command_from_tokens(const char* line, const token* tokens,
+                                    int count) {
+    // Every argument needs its length plus a null terminator
+    size_t string_bytes = 0;
+    for (int i = 0; i < count; i++) string_bytes += tokens[i].len + 1;
+
+    command_block* block = allocate_block(count, string_bytes);
+
+    // Copy the arguments back to back behind argv
+    char* next = reinterpret_cast<char*>(block->cmd.argv + count + 1);
+    for (int i = 0; i < count; i++) {
+        size_t len = tokens[i].len;
+        memcpy(next, line + tokens[i].offset, len);
+        next[len] = '\0';
+        block->cmd.argv[i] = next;
+        next += len + 1;
     }
 
-    // Reset line_copy
-    strcpy(line_copy, line);
+    return &block->cmd;
+}
+
+// Creates a command holding right-sized copies of args[0] ... args[argc - 1]
+command* create_command_from_args(int argc, char* const* args) {
+    size_t string_bytes = 0;
+    for (int i = 0; i < argc; i++) string_bytes += strlen(args[i]) + 1;
 
-    // Get the current starting token
-    currentToken = strtok(line_copy, " \t\n");
+    command_block* block = allocate_block(argc, string_bytes);
 
-    // Populate cmd->argv with tokens from the input line
+    // Copy the arguments back to back behind argv
+    char* next = reinterpret_cast<char*>(block->cmd.argv + argc + 1);
     for (int i = 0; i < argc; i++) {
-        // Check if token is not NULL before tokenizing and populating commands
-        if (currentToken != NULL) {
-            // Copy token to argv[i]
-            strncpy(cmd->argv[i], currentToken, MAX_ARG_LEN - 1);
-            // Null terminates each string in argv
-            cmd->argv[i][MAX_ARG_LEN - 1] = '\0';
-            // Continue tokenization
-            currentToken = strtok(NULL, " \t\n");
+        size_t len = strlen(args[i]) + 1;
+        memcpy(next, args[i], len);
+        block->cmd.argv[i] = next;
+        next += len;
+    }
+
+    return &block->cmd;
+}
+
+// Characters that separate arguments
+static const char SEPARATORS[] = " \t\n";
+
+// Characters that end an argument: separators, and |, &, < and > which start
+// tokens of their own even without spaces around them. $ and ` stop the scan
+// too, as they may start a command substitution, which runs on to its
+// closing ) or `
+static const char TOKEN_ENDS[] = " \t\n|&<>$`";
+
+// Records every token up to the end of line. Newlines are skipped like any
+// other separator, unless stop_at_newline is set, in which case the first one
+// ends the line. Returns where scanning stopped
+static const char* scan_tokens(const char* line, token_list* tokens,
+                               bool stop_at_newline) {
+    // Start out with the inline storage, no allocation needed
+    tokens->count = 0;
+    tokens->capacity = TOKEN_INLINE_CAPACITY;
+    tokens->items = tokens->inline_items;
+
+    const char* skipped = stop_at_newline ? " \t" : SEPARATORS;
+    const char* p = line;
+    while (true) {
+        // Skip separators in front of the next token (strspn and strcspn are
+        // vectorized in libc, so each byte is still only looked at once)
+        p += strspn(p, skipped);
+
+        // End of line, no more tokens
+        if (*p == '\0' || *p == '\n') break;
+
+        // Find the end of the token
+        const char* start = p;
+        const char* operator_end = redirection_end(p);
+        if (operator_end != NULL) {
+            // 2>&1 and the like (see redirect.h)
+            p = operator_end;
+        } else if (*p == '|' || *p == '&') {
+            p++;
+        } else {
+            while (true) {
+                p += strcspn(p, TOKEN_ENDS);
+                if (*p == '`' || (*p == '$' && p[1] == '(')) {
+                    // One that isn't closed runs on to the end of the line
+                    const char* end = substitution_end(p, stop_at_newline);
+                    p = end != NULL ? end
+                                    : p + strcspn(p, stop_at_newline ? "\n"
+                                                                     : "");
+                } else if (*p == '$') {
+                    p++;
+                } else {
+                    break;
+                }
+            }
         }
+
+        // Out of room: double the capacity, moving to (or within) the heap
+        if (tokens->count == tokens->capacity) {
+            token* grown = new token[tokens->capacity * 2];
+            memcpy(grown, tokens->items, tokens->count * sizeof(token));
+            if (tokens->items != tokens->inline_items) delete[] tokens->items;
+            tokens->items = grown;
+            tokens->capacity *= 2;
+        }
+
+        // Record where the token is, without copying it
+        tokens->items[tokens->count].offset = start - line;
+        tokens->items[tokens->count].len = p - start;
+        tokens->count++;
     }
 
+    return p;
+}
+
+// Records the offset and length of every token in line in a single scan
+int tokenize(const char* line, token_list* tokens) {
+    scan_tokens(line, tokens, false);
+    return tokens->count;
+}
+
+// Like tokenize, but only up to the first newline
+const char* tokenize_line(const char* line, token_list* tokens) {
+    return scan_tokens(line, tokens, true);
+}
+
+// Frees the heap array of a token list, if it has one
+void token_list_free(token_list* tokens) {
+    // Using delete[] to match new[] in tokenize
+    if (tokens->items != tokens->inline_items) delete[] tokens->items;
+    tokens->items = tokens->inline_items;
+    tokens->capacity = TOKEN_INLINE_CAPACITY;
+    tokens->count = 0;
+}
+
+// Parses the input string into arguments and initializes a command structure
+command* parse(char* line) {
+    // Check validity of argument first
+    if (line == NULL) {
+        return NULL;
+    }
+
+    // Find all arguments in one pass, line itself is left untouched
+    token_list tokens;
+    tokenize(line, &tokens);
+
+    // Create a command structure, copying every argument straight from the
+    // recorded token positions
+    command* cmd = create_command_from_tokens(line, tokens.items, tokens.count);
+
     // Clean up
-    // Using delete[] to prevent incompatibility issue with Valgrind
-    delete[] line_copy;
+    token_list_free(&tokens);
 
     // Return the newly created command
     return cmd;
@@ -104,106 +372,144 @@ bool find_full_path(command* cmd) {
         return false;
     }
 
-    // Get the $PATH var
-    char* path_env = getenv("PATH");
-
-    // Check if getenv successfully returns the env variable's path
-    if (path_env == NULL) {
+    // Check if getenv successfully returns the $PATH var
+    if (getenv("PATH") == NULL) {
         perror("getenv failed");
         return false;
     }
 
-    // Clone the $PATH to avoid modifying the original path
-    // Using new instead of malloc to avoid compatibility issues with Valgrind
-    char* path_copy = new char[strlen(path_env) + 1];
-    strcpy(path_copy, path_env);
-
-    // Tokenize the $PATH variable by colon(s) - each token is a directory
-    char* currentToken = strtok(path_copy, ":");
-
-    // Loop to construct the full path - iterates through all directories in
-    // $PATH
-    while (currentToken != NULL) {
-        // Construct full path by appending argv[0] to current directory
-        char full_path[MAX_LINE_SIZE];
-        // Construct the full path by combining the current token (likely a
-        // directory) and the first argument of the command
-        snprintf(full_path, sizeof(full_path), "%s/%s", currentToken,
-                 cmd->argv[0]);
-
-        // Check if the file exists and is a regular file, using built-in
-        // functions
-        struct stat buffer;
-        if (stat(full_path, &buffer) == 0 && S_ISREG(buffer.st_mode)) {
-            // First delete old argv[0] to replace it with new data
-            // Using delete[] to prevent incompatibility issue with Valgrind
-            delete[] cmd->argv[0];
-
-            // Modify cmd->argv[0] to be the full path
-            // Using new instead of malloc to avoid valgrind issues
-            cmd->argv[0] = new char[strlen(full_path) + 1];
-            strcpy(cmd->argv[0], full_path);
-
-            // Deallocate memory to prevent mem leaks
-            // Using delete[] to prevent incompatibility issue with Valgrind
-            delete[] path_copy;
-
-            // Indicate that the find full path logic succeeded
-            return true;
-        }
+    // Remembered from an earlier command, or searched for in $PATH (see
+    // path_cache.c)
+    int binary_fd;
+    const char* full_path = path_cache_lookup_binary(cmd->argv[0], &binary_fd);
+    if (full_path == NULL) {
+        // No valid executable in any directory in $PATH
+        return false;
+    }
 
-        // Continue tokenizing
-        currentToken = strtok(NULL, ":");
+    size_t len = strlen(full_path) + 1;
+    command_block* block = block_of(cmd);
+    if (block != NULL) {
+        // The old argv[0] is part of a command block and cannot be freed on
+        // its own, so the block's resolved buffer (reused from earlier
+        // commands when it is big enough) holds the path
+        if (block->resolved_capacity < len) {
+            delete[] block->resolved;
+            block->resolved = new char[len];
+            block->resolved_capacity = len;
+            pool.stats.path_misses++;
+        } else {
+            pool.stats.path_hits++;
+        }
+        cmd->argv[0] = block->resolved;
+        // execute launches the program from it
+        block->binary_fd = binary_fd;
+    } else {
+        // First delete old argv[0] to replace it with new data
+        // Using delete[] to prevent incompatibility issue with Valgrind
+        delete[] cmd->argv[0];
+        // Using new instead of malloc to avoid valgrind issues
+        cmd->argv[0] = new char[len];
     }
 
-    // Cleanup to prevent mem leaks
-    // Using delete[] to prevent incompatibility issue with Valgrind
-    delete[] path_copy;
+    // Modify cmd->argv[0] to be the full path
+    memcpy(cmd->argv[0], full_path, len);
 
-    // If the loop finishes and no valid executable is found in any directory
-    // in $PATH, return false.
-    return false;
+    // Indicate that the find full path logic succeeded
+    return true;
 }
 
-// Executes the command by first checking if it is a built-in and then executing
-// external commands
-int execute(command* cmd) {
-    // Check for validity of arguments first
-    if (cmd == NULL || cmd->argv[0] == NULL) {
-        return ERROR;
-    }
+// Runs a built-in (found), or cmd's assignments if found is NULL, in a forked
+// copy of the shell, as in a bash subshell, so e.g. cd in a pipeline leaves
+// the shell's own directory alone
+static pid_t start_in_subshell(command* cmd, const builtin* found,
+                               const int* stdio) {
+    pid_t pid = fork();
+    if (pid < 0) perror("fork failed");
+    if (pid != 0) return pid;
+
+    for (int i = 0; stdio != NULL && i < 3; i++)
+        if (stdio[i] >= 0 && stdio[i] != i) dup3(stdio[i], i, 0);
+    int status = found != NULL ? found->run(cmd) : assign_variables(cmd);
+    fflush(stdout);
+    // _exit, so the shell's atexit handlers only run in the shell
+    _exit(status == SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE);
+}
 
-    // For built-in commands:
-    // Check if the command is a built-in command
-    if (is_builtin(cmd)) {
-        return do_builtin(cmd);
-    }
+// Starts cmd, whose arguments are taken as they are, in a child process with
+// its standard streams connected to stdio
+pid_t start_literal(command* cmd, const int* stdio) {
+    // Write out anything the shell has buffered, otherwise it would show up
+    // after the child's own output (and a forked child would get a copy too)
+    fflush(stdout);
+
+    const builtin* found = find_builtin(cmd);
+    if (found != NULL) return start_in_subshell(cmd, found, stdio);
 
-    // For external commands:
     // Check if that command exist
     if (!find_full_path(cmd)) {
         printf("Command %s not found!\n", cmd->argv[0]);
-        return ERROR;
+        return -1;
     }
 
-    // Create a new process by duplicating the current process
-    pid_t pid = fork();  // Using the Process API
+    // Start the program in a child process, launched from the descriptor
+    // find_full_path got for it when there is one (see spawn.h)
+    command_block* block = block_of(cmd);
+    pid_t pid =
+        spawn_command(cmd, block != NULL ? block->binary_fd : -1, stdio);
+
+    // A negative value means the process creation (or, unless forking, the
+    // execv in the child) failed
+    if (pid < 0)
+        perror(get_spawn_backend() == SPAWN_FORK ? "fork failed"
+                                                 : "spawn failed");
+    return pid;
+}
 
-    // If fork() returns a negative value, it means the process creation failed
-    if (pid < 0) {
-        perror("fork failed");
-        return ERROR;
+// Returns cmd with its expansions replaced (see substitution.h), or cmd
+// itself if it has none, or NULL if one is bad
+static command* expand_words(command* cmd) {
+    return has_expansion(cmd) ? expand_command(cmd) : cmd;
+}
+
+// Starts cmd, which has no redirections, once its expansions are replaced
+static pid_t start_simple(command* cmd, const int* stdio) {
+    // The values of NAME=value are expanded by assign_variables
+    if (is_assignment(cmd)) {
+        fflush(stdout);
+        return start_in_subshell(cmd, NULL, stdio);
     }
+    command* expanded = expand_words(cmd);
+    if (expanded == NULL) return -1;
+    pid_t pid = expanded->argc > 0 ? start_literal(expanded, stdio) : -1;
+    if (expanded != cmd) cleanup(expanded);
+    return pid;
+}
 
-    // In the child process:
-    if (pid == 0) {
-        // replace the current process image with a new program specified by
-        // argv[0] and pass the args list argv to the new program
-        execv(cmd->argv[0], cmd->argv);
+// Starts cmd in a child process with its standard streams connected to
+// stdio, then redirected as cmd says
+pid_t start_command(command* cmd, const int* stdio) {
+    if (!has_redirection(cmd)) return start_simple(cmd, stdio);
+
+    redirections redirs;
+    command* bare = take_redirections(cmd, &redirs);
+    if (bare == NULL) return -1;
+    pid_t pid = -1;
+    if (open_redirections(&redirs, stdio)) {
+        // Nothing to run in "> log": the file is created all the same
+        if (bare->argc > 0) pid = start_simple(bare, redirs.stdio);
+    }
+    // The child has its own copies of the files
+    close_redirections(&redirs);
+    cleanup(bare);
+    return pid;
+}
 
-        // If execv() fails, it returns and does not replace the process
-        perror("execv failed");
-        exit(EXIT_FAILURE);
+// Waits for the child started by start_command, if it was, and returns
+// SUCCESS if it exited with status 0
+static int wait_for_command(pid_t pid) {
+    if (pid < 0) {
+        return ERROR;
     } else {
         // In the parent process: (pid > 0 returned to the parent)
         int status;
@@ -228,6 +534,136 @@ int execute(command* cmd) {
     }
 }
 
+// find_full_path for a program the shell is about to become: an index of the
+// $PATH directories built just for it goes without inotify watches, which
+// would only hold up its execve
+static bool find_path_to_exec(command* cmd) {
+    path_cache_use_inotify(false);
+    bool found = find_full_path(cmd);
+    path_cache_use_inotify(true);
+    return found;
+}
+
+// Replaces the shell with cmd's program, with the shell's streams redirected
+// as redirs (unless NULL) says, or applies redirs to the shell for good if
+// cmd has no arguments
+static int exec_redirected(command* cmd, const redirections* redirs) {
+    int status = ERROR;
+    int saved[3];
+    if (cmd->argc == 0) {
+        // "exec > log": the rest of the shell's output goes to log
+        if (redirs == NULL || redirect_shell(redirs, saved)) status = SUCCESS;
+        if (redirs != NULL && status == SUCCESS) keep_redirected(saved);
+    } else if (!find_path_to_exec(cmd)) {
+        printf("Command %s not found!\n", cmd->argv[0]);
+    } else if (redirs == NULL || redirect_shell(redirs, saved)) {
+        // Nothing the shell buffered may be lost with it
+        fflush(stdout);
+        command_block* block = block_of(cmd);
+        replace_shell(cmd, block != NULL ? block->binary_fd : -1);
+        perror("exec failed");
+        if (redirs != NULL) restore_shell(saved);
+    }
+    return status;
+}
+
+// Replaces the shell with cmd's program
+int exec_command(command* cmd) {
+    return exec_redirected(cmd, NULL);
+}
+
+// Runs cmd, which has no redirections left, once its expansions are
+// replaced: an assignment or a built-in in the shell itself, with its
+// streams redirected as redirs (unless NULL) says around it, and a program
+// in a child process, or in place of the shell if last is set
+static int run_simple(command* cmd, const redirections* redirs, bool last) {
+    // Told apart as typed: assign_variables expands each value in one piece
+    bool assignment = is_assignment(cmd);
+    command* expanded = assignment ? cmd : expand_words(cmd);
+    if (expanded == NULL) return ERROR;
+
+    int status = ERROR;
+    int saved[3];
+    const builtin* found =
+        expanded->argc > 0 ? find_builtin(expanded) : NULL;
+    if (expanded->argc == 0) {
+        // Only files to create, as in "> log", or expansions that came to
+        // nothing
+        status = SUCCESS;
+    } else if (found != NULL && found->run == builtin_exec) {
+        // exec, found through the table like any built-in, applies the
+        // redirections to the shell itself
+        command* program = create_command_from_args(expanded->argc - 1,
+                                                    expanded->argv + 1);
+        status = exec_redirected(program, redirs);
+        cleanup(program);
+    } else if (found == NULL && !assignment) {
+        status = last ? exec_redirected(expanded, redirs)
+                      : wait_for_command(start_literal(
+                            expanded, redirs != NULL ? redirs->stdio : NULL));
+    } else if (redirs == NULL || redirect_shell(redirs, saved)) {
+        // NAME=value, set in the shell itself (see variables.c)
+        status = found != NULL ? found->run(expanded)
+                               : assign_variables(expanded);
+        if (redirs != NULL) restore_shell(saved);
+    }
+    if (expanded != cmd) cleanup(expanded);
+    return status;
+}
+
+// Runs cmd, which has no |, & or time, applying its redirections (see
+// redirect.h) first
+static int execute_simple(command* cmd, bool last) {
+    if (!has_redirection(cmd)) return run_simple(cmd, NULL, last);
+
+    redirections redirs;
+    command* bare = take_redirections(cmd, &redirs);
+    if (bare == NULL) return ERROR;
+    int status = ERROR;
+    if (open_redirections(&redirs, NULL))
+        status = run_simple(bare, &redirs, last);
+    close_redirections(&redirs);
+    cleanup(bare);
+    return status;
+}
+
+// Executes the command by first checking if it is a built-in and then executing
+// external commands
+int execute(command* cmd) {
+    // Check for validity of arguments first
+    if (cmd == NULL || cmd->argv[0] == NULL) {
+        return ERROR;
+    }
+
+    // Operators are found among the words as they were typed. $(...), `...`
+    // and $NAME are only replaced once the simple command holding them is
+    // about to run, so what they come to is never taken for one
+
+    // time and the command it times, reaped with wait4 (see timing.c)
+    if (is_timed(cmd)) return execute_timed(cmd);
+
+    // Commands followed by &, which are not waited for (see jobs.c)
+    if (has_background(cmd)) return execute_background(cmd);
+
+    // Stages joined by |, started all at once (see pipeline.c)
+    if (is_pipeline(cmd)) return execute_pipeline(cmd);
+
+    // A built-in, found with one lookup, or a program started in a child and
+    // waited for (unless it can't be found)
+    return execute_simple(cmd, false);
+}
+
+// Executes the last command of a script, without a fork if it is a program
+// run on its own
+int execute_last(command* cmd) {
+    if (cmd == NULL || cmd->argv[0] == NULL) return ERROR;
+
+    // Anything the shell itself has a hand in still runs as usual
+    if (is_timed(cmd) || has_background(cmd) || is_pipeline(cmd))
+        return execute(cmd);
+    return execute_simple(cmd, true);
+}
+
 // Frees all memory associated with the command struct
 void cleanup(command* cmd) {
     // Check for validity of argument first
@@ -235,6 +671,14 @@ void cleanup(command* cmd) {
         return;
     }
 
+    // A command block goes back to the pool in one go, along with its
+    // resolved path buffer
+    command_block* block = block_of(cmd);
+    if (block != NULL) {
+        release_block(block);
+        return;
+    }
+
     // Free each argument string individually
     for (int i = 0; i < cmd->argc; i++) {
         delete[] cmd->argv[i];
@@ -247,29 +691,13 @@ void cleanup(command* cmd) {
     delete cmd;
 }
 
-// Determines if the command is a built-in (cd or exit)
+// Determines if the command is a built-in (see builtins.h)
 bool is_builtin(command* cmd) {
-    // Do not modify
-    char* executable = cmd->argv[0];
-
-    if (strcmp(executable, "cd") == 0 || strcmp(executable, "exit") == 0)
-        return true;
-
-    return false;
+    return find_builtin(cmd) != NULL;
 }
 
-// Executes built-in commands (cd or exit)
+// Executes built-in commands (see is_builtin)
 int do_builtin(command* cmd) {
-    // Do not modify
-    if (strcmp(cmd->argv[0], "exit") == 0) exit(SUCCESS);
-
-    // cd
-    if (cmd->argc == 1)
-        return chdir(getenv("HOME"));  // cd with no arguments
-    else if (cmd->argc == 2)
-        return chdir(cmd->argv[1]);  // cd with 1 arg
-    else {
-        fprintf(stderr, "cd: Too many arguments\n");
-        return ERROR;
-    }
+    const builtin* found = find_builtin(cmd);
+    return found != NULL ? found->run(cmd) : ERROR;
 }
@@ -15,6 +15,9 @@
 
 #define SHELL_PROMPT "thsh$ "
 
+// Size of the stdout buffer in batch (non-interactive) mode
+#define BATCH_STDOUT_BUFSIZE (64 * 1024)
+
 #define SUCCESS 0
 #define ERROR -1
 
@@ -22,6 +25,9 @@
 #define MAX_ARG_LEN 100
 #define MAX_ENV_VAR_LEN getpagesize() * 32
 
+// Most command blocks cleanup keeps around for reuse
+#define COMMAND_POOL_MAX_BLOCKS 16
+
 // Disallow exec*p* variants, lest we spoil the fun
 #pragma GCC poison execlp execvp execvpe
 
@@ -37,47 +43,143 @@ typedef struct {
 } command;
 
 /**
- * Creates a command with argc set to the value of the parameter argc.
+ * Counters of the pool that recycles command blocks (see cleanup).
  *
- * Mallocs memory for rv->argv, which should have length argc + 1.
- * rv->argv[0] ... rv->argv[argc - 1] are the arguments.
+ * Every time a command needs a block, it is a hit if a pooled block was
+ * reused and a miss if the heap allocator had to be called. The buffer a
+ * block carries for the full path find_full_path stores is counted apart, in
+ * path_hits and path_misses, the same way. Once a session has seen its
+ * longest line and path, misses stop growing.
+ */
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long path_hits;
+    unsigned long path_misses;
+    // Blocks currently waiting in the pool
+    int pooled;
+} command_pool_stats;
+
+/**
+ * Number of tokens a token_list can hold before it spills to the heap. Covers
+ * every line in data/ and almost every interactively typed command.
+ */
+#define TOKEN_INLINE_CAPACITY 32
+
+/**
+ * A single argument found by tokenize: the characters
+ * line[offset] ... line[offset + len - 1]. The line itself is not modified.
+ */
+typedef struct {
+    size_t offset;
+    size_t len;
+} token;
+
+/**
+ * Tokens of one line, in order. items points at inline_items until the line
+ * has more than TOKEN_INLINE_CAPACITY tokens, then at a heap array.
+ */
+typedef struct {
+    int count;
+    int capacity;
+    token* items;
+    token inline_items[TOKEN_INLINE_CAPACITY];
+} token_list;
+
+/**
+ * Creates a command with argc set to the value of the parameter argc.
  *
- * rv->argv[argc] should be NULL.
+ * rv->argv has length argc + 1. rv->argv[0] ... rv->argv[argc - 1] are the
+ * arguments, each with room for MAX_ARG_LEN chars, and rv->argv[argc] is NULL.
  *
- * Also, for each char* in cmd->argv, malloc MAX_ARG_LEN chars.
+ * The struct, the argv array and the argument chars all live in one
+ * allocation (see create_command_from_tokens), released by cleanup.
  *
  * @note See shell.h, command struct docstring
- * @note To review how to allocate memory for a char**, see the final slide of
- * [Memory
- * Allocation](https://uncch.instructure.com/users/9947/files/6650292?verifier=Ck555bz4rVkIUYSwscINfbZEJulLQL2N0gV09VUc&wrap=1)
  * @param argc
  * @return command*
  */
 command* create_command(int argc);
 
 /**
- * Parses line (user-inputted command) into command* and returns it.
+ * Creates a command whose arguments are copies of the tokens of line.
  *
- * Determine argc, the number of arguments, by parsing line.
+ * Like create_command, the struct, the argv array and the argument chars are
+ * laid out back to back in a single allocation, but each argument gets exactly
+ * as many chars as its token needs (plus the null terminator) rather than a
+ * fixed MAX_ARG_LEN.
  *
- * Then, call create_command(argc) and **copy** the arguments from line into
- * cmd->argv.
+ * @param line the line tokens were found in
+ * @param tokens tokens of line, e.g. items of the token_list filled by
+ * tokenize(line, ...)
+ * @param count number of tokens
+ * @return command*
+ */
+command* create_command_from_tokens(const char* line, const token* tokens,
+                                    int count);
+
+/**
+ * Creates a command whose arguments are copies of args[0] ... args[argc - 1],
+ * laid out in a single allocation like create_command_from_tokens, e.g. one
+ * stage of a pipeline.
  *
- * For examples, see tests.cpp
+ * @param argc
+ * @param args
+ * @return command*
+ */
+command* create_command_from_args(int argc, char* const* args);
+
+/**
+ * Splits line on spaces, tabs and newlines in a single pass, recording the
+ * offset and length of each token in tokens. Unlike strtok, line is neither
+ * copied nor mutated, so parse can copy arguments straight out of it.
  *
- * To parse line, we recommend strtok. If used correctly, it'll handle all
- * test inputs correctly.
- * https://systems-encyclopedia.cs.illinois.edu/articles/c-strtok/
+ * A | or & is always a token of its own, even without spaces around it, so
+ * "ls|wc" is the three tokens "ls", "|" and "wc", and "sleep 1&" is "sleep",
+ * "1" and "&". So is a redirection operator (see redirect.h), so
+ * "sort<in 2>&1" is "sort", "<", "in" and "2>&1".
  *
- * strtok's functionality is similar to that of the string split method in
- * Python and Java
+ * tokens does not need to be initialized. Release it with token_list_free.
  *
- * strtok mutates the input char* (by inserting null terminators). So, to
- * be safe, you should use strtok on a clone of the input char*. You can create
- * a clone using strdup
+ * @param line string input from user
+ * @param tokens filled with the tokens of line
+ * @return number of tokens found
+ */
+int tokenize(const char* line, token_list* tokens);
+
+/**
+ * Like tokenize, but the line ends at the first newline (or null terminator),
+ * so lines can be tokenized in place inside a larger buffer, such as a memory
+ * mapped script.
  *
- * Alternatively, you may reimplement tokenizing logic yourself, but be
- * sure to handle extra whitespaces correctly.
+ * @param line start of the line
+ * @param tokens filled with the tokens of line
+ * @return const char* the newline or null terminator that ended the line
+ */
+const char* tokenize_line(const char* line, token_list* tokens);
+
+/**
+ * Frees the heap array of tokens, if tokenize had to allocate one.
+ *
+ * @param tokens
+ * @return void
+ */
+void token_list_free(token_list* tokens);
+
+/**
+ * Parses line (user-inputted command) into command* and returns it.
+ *
+ * Determine argc, the number of arguments, by parsing line.
+ *
+ * Then, call create_command_from_tokens and **copy** the arguments from line
+ * into cmd->argv.
+ *
+ * For examples, see tests.cpp
+ *
+ * line is scanned exactly once by tokenize, which records where each argument
+ * starts and how long it is. argc is the number of tokens, and each argument
+ * is copied directly from line into cmd->argv, so line is never cloned or
+ * rescanned. Arguments are not truncated, however long they are.
  *
  * @note When copying the arguments (strings) to char** argv, DO NOT use just
  * the assignment operator =. You must actually copy the strings with
@@ -102,23 +204,18 @@ command* parse(char* line);
  * absolute path in the file system. For the $PATH above,
  * it appends "/ls" to the first directory, resulting in
  * /usr/local/sbin/ls. However, this file does not exist, and same for the next
- * two directories. However, /usr/bin/ls exists and is a regular file, so the
- * function mutates cmd->argv[0] to be "/usr/bin/ls" and returns true.
+ * two directories. However, /usr/bin/ls exists and is an executable regular
+ * file, so the function mutates cmd->argv[0] to be "/usr/bin/ls" and returns true.
  *
  * If the executable is "doesnotexist", then this function would not find that
  * file after checking all directories in $PATH, so it would return false.
  *
- * To access $PATH within C, use getenv. For example, getenv("PATH");
- *
- * If you need to specify a maximum length (e.g., when declaring a char[] to
- * store the $PATH string or as an argument to strncpy), use MAX_ENV_VAR_LEN.
- *
- * To parse PATH, we recommend strtok, as described in the docstring for the
- * parse function.
+ * A regular file we may not execute is skipped, and the search goes on in
+ * the next directories, as for a shell running it with execvp.
  *
- * To check whether a file exists and is a regular file, use stat and S_ISREG.
- * See https://man7.org/linux/man-pages/man2/stat.2.html and
- * https://stackoverflow.com/a/40163393/18479243.
+ * Results are remembered in a hashed command cache (see path_cache.h), so
+ * the directories are only searched the first time a program is run, or after
+ * $PATH changes or its file disappears.
  *
  * @param cmd
  * @return true (program in PATH) | false (program not in PATH)
@@ -131,7 +228,17 @@ bool find_full_path(command* cmd);
  * When this function is called, cmd has already been parsed. See main.c
  * Specifically, cmd is the result of calling parse on the user input
  *
- * cmd may be a built-in command (cd or exit) or non-built-in
+ * cmd may be a built-in command (see is_builtin) or non-built-in, or a
+ * pipeline: commands separated by | arguments, which execute_pipeline runs
+ * (see pipeline.h). Commands followed by an & argument are started as
+ * background jobs instead (see jobs.h), and only what follows the last & is
+ * waited for. Redirections such as "> log" apply to the command (or stage)
+ * they are part of (see redirect.h), a built-in included: it still runs in
+ * the shell. All of these are found among the words as they were typed;
+ * $(...), `...` and $NAME are replaced afterwards, just before the simple
+ * command holding them runs, and what they come to is only ever arguments
+ * (see substitution.h). A command of nothing but NAME=value assignments sets
+ * shell variables (see variables.h).
  *
  * Use is_builtin and do_builtin to detect and execute built-in commands
  *
@@ -139,6 +246,10 @@ bool find_full_path(command* cmd);
  * Also, use fork, execv, and wait. For details, see Process API content in
  * README section Background reading
  *
+ * stdout is flushed before forking, so text the shell has buffered is
+ * written once, ahead of the child's output, and never duplicated by the
+ * child.
+ *
  * You cannot use execlp, execvp, execvpe, or any other p variant that searches
  * PATH for you. Doing so would cause a compile error due to a line in shell.h
  *
@@ -153,8 +264,67 @@ bool find_full_path(command* cmd);
 int execute(command* cmd);
 
 /**
- * Frees memory used by cmd. Free each char* in cmd->argv,
- * free cmd->argv, and free cmd (in this order).
+ * Replaces the shell with the program cmd runs, as the exec built-in does:
+ * the program takes over the shell's process, its descriptors and its exit
+ * status. cmd's arguments are taken as they are (its expansions and
+ * redirections were dealt with already, see execute), and a built-in's name
+ * runs the program of the same name. A cmd without arguments does nothing.
+ *
+ * If the program can't be found, prints "Command {command} not found!\n"
+ * like execute does, and the shell goes on.
+ *
+ * @param cmd
+ * @return does not return | SUCCESS (no arguments) | ERROR
+ */
+int exec_command(command* cmd);
+
+/**
+ * Executes cmd knowing that the shell will run nothing after it, as for the
+ * last line of a script or of -c text. As in dash, a program run on its own
+ * (no |, &, time, built-in or assignment; expansions come first) then replaces
+ * the shell, with its redirections applied, instead of being started in a
+ * child and waited for, which saves a process and a wait. Anything else is
+ * executed as usual.
+ *
+ * @param cmd
+ * @return does not return | SUCCESS | ERROR
+ */
+int execute_last(command* cmd);
+
+/**
+ * Starts cmd in a child process, without waiting for it: an external program
+ * through spawn_command (see spawn.h), or a built-in in a forked copy of the
+ * shell. stdio is as for spawn_command: NULL, or the descriptors to connect
+ * stdin, stdout and stderr to (-1 to leave one alone). cmd's own
+ * redirections (see redirect.h) are applied on top of them, and its
+ * expansions replaced (see substitution.h).
+ *
+ * If the program can't be found, prints "Command {command} not found!\n" like
+ * execute does.
+ *
+ * @param cmd
+ * @param stdio 3 descriptors | NULL
+ * @return pid_t of the child | -1 if it was not started
+ */
+pid_t start_command(command* cmd, const int* stdio);
+
+/**
+ * Starts cmd in a child process as start_command does, but takes its
+ * arguments as they are: none is a redirection or an expansion, as for the
+ * arguments xargs reads or those an expansion came to.
+ *
+ * @param cmd
+ * @param stdio 3 descriptors | NULL
+ * @return pid_t of the child | -1 if it was not started
+ */
+pid_t start_literal(command* cmd, const int* stdio);
+
+/**
+ * Frees memory used by cmd. Commands from create_command, parse or
+ * create_command_from_tokens are a single block, which goes back to a pool of
+ * up to COMMAND_POOL_MAX_BLOCKS blocks for the next command to reuse (and is
+ * freed if the pool is full). Otherwise, each char* in cmd->argv, cmd->argv
+ * and cmd are freed (in this order).
  *
  * @note Not unit tested in tests.cpp but necessary to pass Valgrind test case
  * @param cmd
@@ -163,7 +333,24 @@ int execute(command* cmd);
 void cleanup(command* cmd);
 
 /**
- * Determines whether cmd is a valid built-in command (in this lab, cd or exit)
+ * Copies the command pool's hit and miss counters into stats.
+ *
+ * @param stats
+ * @return void
+ */
+void get_command_pool_stats(command_pool_stats* stats);
+
+/**
+ * Frees every block waiting in the command pool and resets its counters.
+ *
+ * @return void
+ */
+void command_pool_clear();
+
+/**
+ * Determines whether cmd is a valid built-in command: cd, exit, hash, or one
+ * of echo, pwd, true, false and printf, which run in the shell instead of as
+ * programs unless the invocation needs the program (see builtins.h)
  *
  * @param cmd
  * @return true | false
@@ -171,7 +358,8 @@ void cleanup(command* cmd);
 bool is_builtin(command* cmd);
 
 /**
- * Executes built-in commands (in this lab, cd or exit)
+ * Executes built-in commands (see is_builtin). execute and start_command use
+ * find_builtin directly, which tells builtins apart and finds them at once.
  *
  * @param cmd
  * @return SUCCESS | ERROR
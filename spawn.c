@@ -0,0 +1,211 @@
+#include "spawn.h"
+
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "variables.h"
+
+/**
+ * spawn.c - Starting external commands
+ *
+ * fork has to duplicate the shell's page tables (and mark every writable page
+ * copy-on-write) just so the child can throw it all away in execv, so its
+ * cost grows with the shell's memory. clone(CLONE_VM | CLONE_VFORK) avoids
+ * that: the child runs on the shell's own memory, on a small stack of its
+ * own, while the shell waits for its execve. posix_spawn does the same inside
+ * glibc. fork is kept for systems without either, and for comparison
+ * (THSH_SPAWN=fork).
+ */
+
+// Stack of a SPAWN_VFORK child, which only has to last until execve
+#define SPAWN_CHILD_STACK_SIZE (64 * 1024)
+
+// Chosen backend, or -1 until the first call to get_spawn_backend
+static int backend = -1;
+
+// Returns the backend, picking it from $THSH_SPAWN the first time
+spawn_backend get_spawn_backend() {
+    if (backend < 0) {
+        const char* choice = getenv("THSH_SPAWN");
+        if (choice != NULL && strcmp(choice, "fork") == 0)
+            backend = SPAWN_FORK;
+        else if (choice != NULL && strcmp(choice, "posix_spawn") == 0)
+            backend = SPAWN_POSIX_SPAWN;
+        else
+            backend = SPAWN_VFORK;
+    }
+    return static_cast<spawn_backend>(backend);
+}
+
+void set_spawn_backend(spawn_backend chosen) {
+    backend = chosen;
+}
+
+// Connects the standard streams of the child to stdio (see spawn_command).
+// The descriptors in stdio are close-on-exec, the copies made here are not
+static int redirect_stdio(const int* stdio) {
+    for (int i = 0; stdio != NULL && i < 3; i++)
+        if (stdio[i] >= 0 && stdio[i] != i && dup3(stdio[i], i, 0) < 0)
+            return ERROR;
+    // Those are all the program gets: whatever else is open, even without
+    // O_CLOEXEC, goes at execve. Flagged rather than closed, as execveat
+    // still needs the program's descriptor (and before Linux 5.11 this fails
+    // harmlessly)
+    close_range(3, ~0U, CLOSE_RANGE_CLOEXEC);
+    return SUCCESS;
+}
+
+// Replaces the current process with cmd's program, from fd if it is open,
+// with the environment envp. Only returns (with errno set) if that fails
+static void exec_program(const command* cmd, int fd, const int* stdio,
+                         char* const* envp) {
+    if (redirect_stdio(stdio) == ERROR) return;
+    if (fd >= 0) {
+        execveat(fd, "", cmd->argv, envp, AT_EMPTY_PATH);
+        // A script's interpreter is handed /dev/fd/N, which is gone by then
+        // as fd is close-on-exec: run it by path instead
+        if (errno != ENOENT) return;
+    }
+    execve(cmd->argv[0], cmd->argv, envp);
+}
+
+// fork + execv: the child reports its own exec failure
+static pid_t fork_command(const command* cmd, int fd, const int* stdio,
+                          char* const* envp) {
+    // Create a new process by duplicating the current process
+    pid_t pid = fork();  // Using the Process API
+
+    // In the child process:
+    if (pid == 0) {
+        // replace the current process image with a new program specified by
+        // argv[0] (or fd) and pass the args list argv to the new program
+        exec_program(cmd, fd, stdio, envp);
+
+        // If execv() fails, it returns and does not replace the process
+        perror("execv failed");
+        exit(EXIT_FAILURE);
+    }
+    return pid;
+}
+
+// What a SPAWN_VFORK child needs. It shares our memory, so it can also hand
+// its exec error back in here
+typedef struct {
+    const command* cmd;
+    int fd;
+    const int* stdio;
+    char* const* envp;
+    // Signal mask to restore in the child
+    sigset_t mask;
+    int error;
+} vfork_child;
+
+// Runs in the SPAWN_VFORK child, on the shared memory: only async-signal-safe
+// calls, and nothing that changes state the shell relies on
+static int run_vfork_child(void* arg) {
+    vfork_child* child = static_cast<vfork_child*>(arg);
+    // The shell installs no signal handlers, so nothing can run on the shared
+    // memory once signals are let through again
+    sigprocmask(SIG_SETMASK, &child->mask, NULL);
+    exec_program(child->cmd, child->fd, child->stdio, child->envp);
+    child->error = errno;
+    _exit(127);
+}
+
+// clone(CLONE_VM | CLONE_VFORK) + execveat
+static pid_t vfork_command(const command* cmd, int fd, const int* stdio,
+                           char* const* envp) {
+    // Only one child ever runs on it: we are suspended until it has called
+    // execve or exited
+    static char* stack = NULL;
+    if (stack == NULL) {
+        void* map = mmap(NULL, SPAWN_CHILD_STACK_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+        if (map == MAP_FAILED) return -1;
+        stack = static_cast<char*>(map);
+    }
+
+    vfork_child child;
+    child.cmd = cmd;
+    child.fd = fd;
+    child.stdio = stdio;
+    child.envp = envp;
+    child.error = 0;
+
+    // No signal may be handled in the child before it is a process of its own
+    sigset_t all;
+    sigfillset(&all);
+    sigprocmask(SIG_SETMASK, &all, &child.mask);
+    // The stack grows down, from its end
+    pid_t pid = clone(run_vfork_child, stack + SPAWN_CHILD_STACK_SIZE,
+                      CLONE_VM | CLONE_VFORK | SIGCHLD, &child);
+    int saved_errno = errno;
+    sigprocmask(SIG_SETMASK, &child.mask, NULL);
+
+    if (pid < 0) {
+        errno = saved_errno;
+        return -1;
+    }
+
+    // It never became the program: reap it and report why
+    if (child.error != 0) {
+        waitpid(pid, NULL, 0);
+        errno = child.error;
+        return -1;
+    }
+    return pid;
+}
+
+// posix_spawn, with the stdio redirections as file actions
+static int posix_spawn_command(pid_t* pid, const command* cmd,
+                               const int* stdio, char* const* envp) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    for (int i = 0; stdio != NULL && i < 3; i++)
+        if (stdio[i] >= 0 && stdio[i] != i)
+            posix_spawn_file_actions_adddup2(&actions, stdio[i], i);
+    // As in redirect_stdio (glibc uses close_range for it)
+    posix_spawn_file_actions_addclosefrom_np(&actions, 3);
+    int error =
+        posix_spawn(pid, cmd->argv[0], &actions, NULL, cmd->argv, envp);
+    posix_spawn_file_actions_destroy(&actions);
+    return error;
+}
+
+// Starts cmd with the chosen backend
+pid_t spawn_command(const command* cmd, int fd, const int* stdio) {
+    // Kept ready by variables.c, so every program gets the same array
+    char* const* envp = variables_envp();
+    if (get_spawn_backend() == SPAWN_VFORK)
+        return vfork_command(cmd, fd, stdio, envp);
+    if (get_spawn_backend() == SPAWN_FORK)
+        return fork_command(cmd, fd, stdio, envp);
+
+    pid_t pid;
+    // posix_spawn returns the error instead of setting errno, and this
+    // includes errors from the execve in the child
+    int error = posix_spawn_command(&pid, cmd, stdio, envp);
+    if (error == 0) return pid;
+
+    // No support for posix_spawn here: stick with fork from now on
+    if (error == ENOSYS) {
+        set_spawn_backend(SPAWN_FORK);
+        return fork_command(cmd, fd, stdio, envp);
+    }
+    errno = error;
+    return -1;
+}
+
+// execveat or execve, in the shell's own process
+int replace_shell(const command* cmd, int fd) {
+    exec_program(cmd, fd, NULL, variables_envp());
+    return -1;
+}
+
+// glibc's <sys/pidfd.h> is not usable from C++
+int open_pidfd(pid_t pid) {
+    return syscall(SYS_pidfd_open, pid, 0);
+}
@@ -0,0 +1,91 @@
+#ifndef SPAWN_H
+#define SPAWN_H
+
+#include "shell.h"
+
+/**
+ * How external commands are started.
+ *
+ * SPAWN_VFORK clones the shell with CLONE_VM | CLONE_VFORK: the child shares
+ * the shell's memory until it calls execve, so starting it costs the same
+ * however large the shell's heap has grown, and it can launch a program from
+ * its O_PATH descriptor with execveat. SPAWN_POSIX_SPAWN uses posix_spawn,
+ * which glibc implements the same way but which only takes a path.
+ * SPAWN_FORK is the classic fork + execv, which has to copy the shell's page
+ * tables first.
+ */
+typedef enum {
+    SPAWN_VFORK,
+    SPAWN_POSIX_SPAWN,
+    SPAWN_FORK,
+} spawn_backend;
+
+/**
+ * The backend spawn_command uses. Unless set_spawn_backend was called, it is
+ * chosen on first use from $THSH_SPAWN: "fork" or "posix_spawn", and
+ * SPAWN_VFORK otherwise.
+ *
+ * @return spawn_backend
+ */
+spawn_backend get_spawn_backend();
+
+/**
+ * Has spawn_command use backend from now on.
+ *
+ * @param backend
+ * @return void
+ */
+void set_spawn_backend(spawn_backend backend);
+
+/**
+ * Starts the program cmd->argv[0] (a full path, see find_full_path) in a child
+ * process, with cmd's arguments and the exported variables as its
+ * environment (see variables_envp).
+ *
+ * When fd is an O_PATH descriptor of that same program (see
+ * path_cache_lookup_binary), SPAWN_VFORK and SPAWN_FORK launch it with
+ * execveat(fd, "", ..., AT_EMPTY_PATH), so the kernel does not walk its path
+ * again. Scripts are still launched by path, as their interpreter needs a
+ * name to open.
+ *
+ * stdio, unless NULL, holds the descriptors to connect the child's stdin,
+ * stdout and stderr to, with -1 leaving a stream as it is in the shell (e.g.
+ * the ends of the pipes around a pipeline stage). They should be
+ * close-on-exec. The program only gets 0, 1 and 2: every other descriptor
+ * (even one the shell inherited without close-on-exec) is closed at its
+ * execve, by a single close_range in the child.
+ *
+ * With SPAWN_VFORK and SPAWN_POSIX_SPAWN, failing to execute the program is
+ * reported here. With SPAWN_FORK it can only be noticed in the child, which
+ * prints why and exits with EXIT_FAILURE. Should posix_spawn not be supported
+ * at all, the backend falls back to SPAWN_FORK for good.
+ *
+ * @param cmd
+ * @param fd descriptor of the program | -1
+ * @param stdio 3 descriptors for stdin, stdout and stderr | NULL
+ * @return pid_t of the child | -1 (with errno set) if it was not started
+ */
+pid_t spawn_command(const command* cmd, int fd, const int* stdio);
+
+/**
+ * Replaces the shell itself with the program cmd->argv[0] (a full path), as
+ * the exec built-in does: from fd with execveat when it is open, as
+ * spawn_command would, and with the same descriptors (0, 1 and 2 only).
+ *
+ * @param cmd
+ * @param fd descriptor of the program | -1
+ * @return only returns (-1, with errno set) if the program can't be executed
+ */
+int replace_shell(const command* cmd, int fd);
+
+/**
+ * Opens a pidfd for the child pid (pidfd_open(2)): a close-on-exec descriptor
+ * that turns readable, for poll and epoll, once the child has exited. It
+ * doesn't reap the child.
+ *
+ * @param pid
+ * @return the descriptor | -1 (with errno set, e.g. ENOSYS before Linux 5.3)
+ */
+int open_pidfd(pid_t pid);
+
+#endif  // SPAWN_H
@@ -0,0 +1,418 @@
+#include "substitution.h"
+
+#include <sys/mman.h>
+
+#include "builtins.h"
+#include "jobs.h"
+#include "pipeline.h"
+#include "redirect.h"
+#include "timing.h"
+#include "variables.h"
+
+/**
+ * substitution.c - $(command), `command`, $NAME and ${NAME}
+ *
+ * Output is split straight out of wherever it landed (the in-memory stream
+ * of a built-in, or the mapped memfd of a process), and a variable's value
+ * straight out of the variable table, and the arguments of the new command
+ * are gathered back to back in one buffer, so an expansion is copied once,
+ * into the command.
+ */
+
+
+// memfds receiving the output of processes, one per level of substitutions
+// running inside each other (a $(...) in a stage of a $(...) is run while
+// the outer one's stages are started), kept between substitutions
+static struct {
+    int* fds;
+    int count;
+    // Levels in use
+    int depth;
+} captures = {NULL, 0, 0};
+
+// A growable run of bytes
+typedef struct {
+    char* data;
+    size_t len;
+    size_t capacity;
+} byte_buffer;
+
+// What a substitution's command wrote, and what to release once it is used
+typedef struct {
+    const char* data;
+    size_t len;
+    // From open_memstream, or NULL
+    char* stream;
+    // The mapped memfd, or NULL
+    void* map;
+} captured_output;
+
+// Appends len bytes of data to buffer
+static void append(byte_buffer* buffer, const char* data, size_t len) {
+    if (buffer->len + len > buffer->capacity) {
+        size_t capacity = buffer->capacity > 0 ? buffer->capacity * 2 : 256;
+        while (capacity < buffer->len + len) capacity *= 2;
+        char* grown = new char[capacity];
+        if (buffer->len > 0) memcpy(grown, buffer->data, buffer->len);
+        delete[] buffer->data;
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+}
+
+const char* substitution_end(const char* p, bool stop_at_newline) {
+    const char* line_ends = stop_at_newline ? "`\n" : "`";
+    if (*p == '`') {
+        p += 1 + strcspn(p + 1, line_ends);
+        return *p == '`' ? p + 1 : NULL;
+    }
+
+    int depth = 0;
+    for (; *p != '\0' && !(stop_at_newline && *p == '\n'); p++) {
+        if (*p == '(') {
+            depth++;
+        } else if (*p == ')' && --depth == 0) {
+            return p + 1;
+        } else if (*p == '`') {
+            p = substitution_end(p, stop_at_newline);
+            if (p == NULL) return NULL;
+            p--;
+        }
+    }
+    return NULL;
+}
+
+// Returns true if the $ at p starts an expansion: $(, ${, $NAME, $n or $#
+static inline bool starts_expansion(const char* p) {
+    return p[1] == '(' || p[1] == '{' || isalnum((unsigned char)p[1]) ||
+           p[1] == '_' || p[1] == '#';
+}
+
+// Checks word for a $ or ` starting an expansion. Run on every argument of
+// every command, so it goes by memchr, which looks at a vector of chars at a
+// time: most words are ruled out by a strlen and two memchr calls
+bool word_has_expansion(const char* word) {
+    const char* end = word + strlen(word);
+    if (memchr(word, '`', end - word) != NULL) return true;
+    const char* p = word;
+    while ((p = static_cast<const char*>(memchr(p, '$', end - p))) != NULL) {
+        if (starts_expansion(p)) return true;
+        p++;
+    }
+    return false;
+}
+
+// Checks cmd's arguments for an expansion
+bool has_expansion(const command* cmd) {
+    for (int i = 0; i < cmd->argc; i++)
+        if (word_has_expansion(cmd->argv[i])) return true;
+    return false;
+}
+
+// Runs the built-in found for cmd with stdout going into an in-memory stream
+static void capture_builtin(const builtin* found, command* cmd,
+                            captured_output* output) {
+    size_t len = 0;
+    FILE* stream = open_memstream(&output->stream, &len);
+    if (stream == NULL) {
+        perror("open_memstream failed");
+        return;
+    }
+    // The shell's own buffered output stays where it is until it's flushed
+    FILE* shell_stdout = stdout;
+    stdout = stream;
+    found->run(cmd);
+    stdout = shell_stdout;
+    fclose(stream);
+    output->data = output->stream;
+    output->len = len;
+}
+
+// Runs cmd in processes of their own with stdout going to the memfd, and
+// maps what they wrote. A literal cmd's arguments are taken as they are (see
+// start_literal)
+static void capture_process(command* cmd, bool literal,
+                            captured_output* output) {
+    int depth = captures.depth;
+    if (depth == captures.count) {
+        int* fds = new int[depth + 1];
+        if (depth > 0) memcpy(fds, captures.fds, depth * sizeof(int));
+        delete[] captures.fds;
+        captures.fds = fds;
+        captures.fds[captures.count++] = -1;
+    }
+    int capture_fd = captures.fds[depth];
+    if (capture_fd < 0) {
+        capture_fd = memfd_create("substitution", MFD_CLOEXEC);
+        if (capture_fd < 0)
+            capture_fd = open("/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        if (capture_fd < 0) {
+            perror("memfd_create failed");
+            return;
+        }
+        captures.fds[depth] = capture_fd;
+    }
+    // Empty it of the previous substitution's output. The processes share its
+    // offset, so they write from the start
+    ftruncate(capture_fd, 0);
+    lseek(capture_fd, 0, SEEK_SET);
+    // Substitutions expanded while cmd's stages are started get the next one
+    captures.depth++;
+
+    int stdio[3] = {-1, capture_fd, -1};
+    if (literal) {
+        pid_t pid = start_literal(cmd, stdio);
+        if (pid > 0) waitpid(pid, NULL, 0);
+    } else if (is_timed(cmd) || has_background(cmd)) {
+        // A subshell running it all, as execute would
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            dup2(capture_fd, STDOUT_FILENO);
+            int status = execute(cmd);
+            fflush(stdout);
+            _exit(status == SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        if (pid > 0) waitpid(pid, NULL, 0);
+    } else {
+        // A command without | is a pipeline of one
+        int count;
+        pid_t* pids = start_pipeline(cmd, -1, capture_fd, &count);
+        if (pids != NULL) wait_pipeline(pids, count, NULL, NULL);
+        delete[] pids;
+    }
+    captures.depth--;
+
+    struct stat st;
+    if (fstat(capture_fd, &st) < 0 || st.st_size == 0) return;
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, capture_fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap failed");
+        return;
+    }
+    output->map = map;
+    output->data = static_cast<const char*>(map);
+    output->len = st.st_size;
+}
+
+// Runs the command line text (len chars, not null-terminated) and sets
+// output to what it wrote. Returns false if a substitution in it isn't closed
+static bool capture(const char* text, size_t len, captured_output* output) {
+    output->data = "";
+    output->len = 0;
+    output->stream = NULL;
+    output->map = NULL;
+
+    char* line = new char[len + 1];
+    memcpy(line, text, len);
+    line[len] = '\0';
+    command* cmd = parse(line);
+    delete[] line;
+
+    // Operators are found in the text as it is, and anything else is left to
+    // execute. A simple command is expanded here instead, to see whether it
+    // is a built-in that can run in the shell
+    if (is_pipeline(cmd) || has_background(cmd) || is_timed(cmd) ||
+        has_redirection(cmd) || is_assignment(cmd)) {
+        capture_process(cmd, false, output);
+        cleanup(cmd);
+        return true;
+    }
+    command* expanded = cmd;
+    if (has_expansion(cmd)) {
+        expanded = expand_command(cmd);
+        cleanup(cmd);
+        if (expanded == NULL) return false;
+    }
+    if (expanded->argc > 0) {
+        const builtin* found = find_builtin(expanded);
+        if (found != NULL && found->output_only)
+            capture_builtin(found, expanded, output);
+        else
+            capture_process(expanded, true, output);
+    }
+    cleanup(expanded);
+    return true;
+}
+
+// Frees what output holds
+static void release(captured_output* output) {
+    // Using free to match open_memstream's malloc
+    free(output->stream);
+    if (output->map != NULL) munmap(output->map, output->len);
+}
+
+// Returns true if output is split into arguments at c (null chars included,
+// as they can't be part of an argument)
+static inline bool is_field_separator(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\0';
+}
+
+// Adds the argument in current (unless it's empty) to words, and empties it
+static void end_word(byte_buffer* words, int* count, byte_buffer* current) {
+    if (current->len == 0) return;
+    append(words, current->data, current->len);
+    append(words, "", 1);
+    (*count)++;
+    current->len = 0;
+}
+
+// Splits the text from p to end into arguments, the first one continuing
+// current, or adds all of it to current (less null chars) unless words is
+// set
+static void split_fields(const char* p, const char* end, byte_buffer* words,
+                         int* count, byte_buffer* current) {
+    while (words == NULL && p < end) {
+        const char* null = static_cast<const char*>(memchr(p, '\0', end - p));
+        const char* stop = null != NULL ? null : end;
+        append(current, p, stop - p);
+        p = stop + (null != NULL ? 1 : 0);
+    }
+    while (p < end) {
+        const char* field = p;
+        while (p < end && !is_field_separator(*p)) p++;
+        append(current, field, p - field);
+        if (p == end) break;
+        end_word(words, count, current);
+        while (p < end && is_field_separator(*p)) p++;
+    }
+}
+
+// Splits output, less trailing newlines, into arguments, the first one
+// continuing current
+static void split_output(const captured_output* output, byte_buffer* words,
+                         int* count, byte_buffer* current) {
+    const char* end = output->data + output->len;
+    while (end > output->data && end[-1] == '\n') end--;
+    split_fields(output->data, end, words, count, current);
+}
+
+// Returns the length of the positional parameter (n, or # for their count)
+// p starts with: a single digit, unless braced
+static size_t parameter_length(const char* p, bool braced) {
+    if (*p == '#') return 1;
+    size_t len = 0;
+    while (isdigit((unsigned char)p[len]) && (braced || len == 0)) len++;
+    return len;
+}
+
+// Returns the value of the positional parameter (see parameter_length) of
+// len chars at p, writing $# into count_text
+static const char* parameter_value(const char* p, size_t len,
+                                   char* count_text, size_t size) {
+    if (*p == '#') {
+        snprintf(count_text, size, "%d", positional_parameter_count());
+        return count_text;
+    }
+    // No script gets anywhere near that many arguments
+    if (len > 9) return NULL;
+    int n = 0;
+    for (size_t i = 0; i < len; i++) n = n * 10 + (p[i] - '0');
+    return get_positional_parameter(n);
+}
+
+// Replaces the $NAME, ${NAME}, $n, ${n} or $# at p with the value, split
+// into arguments like the output of a substitution (an unset variable adds
+// nothing), or kept in one piece in current if words is NULL. A $ starting
+// none of them is kept as it is. Returns the char after it, or NULL if ${
+// isn't followed by a name and }
+static const char* expand_variable(const char* p, byte_buffer* words,
+                                   int* count, byte_buffer* current) {
+    bool braced = p[1] == '{';
+    const char* name = p + (braced ? 2 : 1);
+    size_t len = variable_name_length(name);
+    bool parameter = len == 0;
+    if (parameter) len = parameter_length(name, braced);
+    if (braced && (len == 0 || name[len] != '}')) {
+        const char* close = strchr(p, '}');
+        int shown = close != NULL ? close + 1 - p : strlen(p);
+        fprintf(stderr, "%.*s: bad substitution\n", shown, p);
+        return NULL;
+    }
+    if (len == 0) {
+        append(current, p, 1);
+        return p + 1;
+    }
+
+    char count_text[16];
+    const char* value =
+        parameter ? parameter_value(name, len, count_text, sizeof(count_text))
+                  : get_variable(name, len);
+    if (value != NULL)
+        split_fields(value, value + strlen(value), words, count, current);
+    return name + len + (braced ? 1 : 0);
+}
+
+// Replaces every expansion of arg, adding the resulting arguments to words
+// (or, if words is NULL, all of it to current). Returns false if a
+// substitution isn't closed or a ${ is bad
+static bool expand_argument(const char* arg, byte_buffer* words, int* count,
+                            byte_buffer* current) {
+    const char* p = arg;
+    while (*p != '\0') {
+        size_t literal = strcspn(p, "$`");
+        append(current, p, literal);
+        p += literal;
+        if (*p == '\0') break;
+        if (*p == '$' && p[1] != '(') {
+            p = expand_variable(p, words, count, current);
+            if (p == NULL) return false;
+            continue;
+        }
+
+        const char* end = substitution_end(p, false);
+        if (end == NULL) {
+            fprintf(stderr,
+                    "unexpected EOF while looking for matching `%c'\n",
+                    *p == '`' ? '`' : ')');
+            return false;
+        }
+        // The command between $( and ), or between the backticks
+        const char* text = p + (*p == '`' ? 1 : 2);
+        captured_output output;
+        if (!capture(text, end - 1 - text, &output)) return false;
+        split_output(&output, words, count, current);
+        release(&output);
+        p = end;
+    }
+    if (words != NULL) end_word(words, count, current);
+    return true;
+}
+
+command* expand_command(const command* cmd) {
+    byte_buffer words = {NULL, 0, 0};
+    byte_buffer current = {NULL, 0, 0};
+    int count = 0;
+    bool closed = true;
+    for (int i = 0; i < cmd->argc && closed; i++)
+        closed = expand_argument(cmd->argv[i], &words, &count, &current);
+
+    command* expanded = NULL;
+    if (closed) {
+        char** args = new char*[count + 1];
+        char* word = words.data;
+        for (int i = 0; i < count; i++) {
+            args[i] = word;
+            word += strlen(word) + 1;
+        }
+        expanded = create_command_from_args(count, args);
+        delete[] args;
+    }
+    delete[] words.data;
+    delete[] current.data;
+    return expanded;
+}
+
+char* expand_word(const char* word) {
+    byte_buffer current = {NULL, 0, 0};
+    char* expanded = NULL;
+    if (expand_argument(word, NULL, NULL, &current)) {
+        expanded = new char[current.len + 1];
+        if (current.len > 0) memcpy(expanded, current.data, current.len);
+        expanded[current.len] = '\0';
+    }
+    delete[] current.data;
+    return expanded;
+}
@@ -0,0 +1,85 @@
+#ifndef SUBSTITUTION_H
+#define SUBSTITUTION_H
+
+#include "shell.h"
+
+/**
+ * Expansions: command substitution, $(command) and `command`, and variables,
+ * $NAME and ${NAME} (see variables.h).
+ *
+ * The command runs when the command around it is executed, and what it
+ * writes to stdout takes its place, less trailing newlines and split into
+ * arguments at spaces, tabs and newlines (there being no quotes in this
+ * shell, the output is always split). An argument left empty disappears.
+ *
+ * Built-ins that only write output (echo, printf, pwd, true, false) run in
+ * the shell itself, writing into an in-memory stream that stands in for
+ * stdout: no process, no pipe, no system call. Any other command runs in
+ * processes of its own (built-ins in a forked copy of the shell, as in a bash
+ * subshell), with stdout a memfd that the shell maps once they have exited,
+ * rather than reading their output through a pipe a few KiB at a time. The
+ * memfd is kept and emptied for the next substitution; one nested in a stage
+ * of another, which runs while that one's stages are started, gets a memfd
+ * of its own.
+ *
+ * A variable's value is split into arguments the same way, and an unset
+ * variable adds nothing. So are the positional parameters, $0 to $9, ${10}
+ * and up, and $# (see set_positional_parameters). A $ that starts no
+ * expansion (e.g. "$", "$%" or "10$") is kept as it is.
+ *
+ * What an expansion comes to is only ever arguments: |, &, time and
+ * redirections are found among the words of the command as it was typed,
+ * and its expansions replaced only once the simple command they are part of
+ * is about to run (see execute), so "echo $(printf '>') f" prints "> f".
+ */
+
+/**
+ * Returns the end of the command substitution starting at p: "$(" (which may
+ * hold nested parentheses and substitutions) or "`".
+ *
+ * @param p
+ * @param stop_at_newline if set, a newline ends the text like a null char
+ * @return the char after its closing ) or ` | NULL if the text ends first
+ */
+const char* substitution_end(const char* p, bool stop_at_newline);
+
+/**
+ * Returns true if word holds a command substitution or a variable.
+ *
+ * @param word
+ * @return true | false
+ */
+bool word_has_expansion(const char* word);
+
+/**
+ * Returns true if one of cmd's arguments holds a command substitution or a
+ * variable.
+ *
+ * @param cmd
+ * @return true | false
+ */
+bool has_expansion(const command* cmd);
+
+/**
+ * Runs every command substitution in cmd's arguments and looks up every
+ * variable, in order, and returns a copy of cmd with what they came to in
+ * their place. Expansions within a substitution's command come first.
+ *
+ * @param cmd
+ * @return the new command, to be freed with cleanup | NULL (a substitution
+ * isn't closed, or a ${ isn't a name and a }, which is reported on stderr)
+ */
+command* expand_command(const command* cmd);
+
+/**
+ * Replaces the expansions of word as expand_command does, but keeps what
+ * they come to in one piece rather than splitting it into arguments, as for
+ * the file of a redirection.
+ *
+ * @param word
+ * @return the expanded word, to be freed with delete[] | NULL (as for
+ * expand_command)
+ */
+char* expand_word(const char* word);
+
+#endif  // SUBSTITUTION_H
@@ -1,12 +1,102 @@
 #include "tests.hpp"
 
+#include <algorithm>
 #include <cstdlib>
 
 #include "main.c"
+#include "builtins.h"
+#include "path_cache.h"
 #include "shell.h"
+#include "spawn.h"
+#include "variables.h"
+#include "xargs.h"
 
 const int EXECUTE_POINTS_PER_TEST_CASE = 2;
 
+/**
+ * Returns a file descriptor open for reading at the start of a temporary file
+ * holding contents
+ */
+static int fd_with_contents(const std::string& contents) {
+    FILE* file = tmpfile();
+    fwrite(contents.data(), 1, contents.size(), file);
+    fflush(file);
+    int fd = dup(fileno(file));
+    fclose(file);
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+/**
+ * Writes contents to a new temporary file and returns its path
+ */
+static std::string file_with_contents(const std::string& contents) {
+    char path[] = "/tmp/thsh_test_XXXXXX";
+    int fd = mkstemp(path);
+    write(fd, contents.data(), contents.size());
+    close(fd);
+    return path;
+}
+
+/**
+ * Creates an executable file called name in a new temporary directory and
+ * returns the directory
+ */
+static std::string dir_with_program(const char* name) {
+    char dir[] = "/tmp/thsh_bin_XXXXXX";
+    mkdtemp(dir);
+    std::string path = std::string(dir) + "/" + name;
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT, 0755);
+    write(fd, "#!/bin/sh\n", 10);
+    close(fd);
+    return dir;
+}
+
+/**
+ * Returns everything in file, from its start, and closes it
+ */
+static std::string contents_of(FILE* file) {
+    std::string contents;
+    char buffer[4096];
+    size_t count;
+    rewind(file);
+    while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        contents.append(buffer, count);
+    fclose(file);
+    return contents;
+}
+
+/**
+ * Runs _main(args) in a child process with stdin read from input, and returns
+ * what it wrote to stdout (and in errors, if not NULL, what it wrote to
+ * stderr). args must start with the program name.
+ */
+static std::string run_main(std::vector<const char*> args,
+                            const std::string& input,
+                            int* exit_status = NULL,
+                            std::string* errors = NULL) {
+    int in_fd = fd_with_contents(input);
+    FILE* out = tmpfile();
+    FILE* err = errors != NULL ? tmpfile() : NULL;
+    // Nothing buffered in this process may leak into the child's output
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(in_fd, STDIN_FILENO);
+        dup2(fileno(out), STDOUT_FILENO);
+        if (err != NULL) dup2(fileno(err), STDERR_FILENO);
+        args.push_back(NULL);
+        exit(_main(args.size() - 1, args.data()));
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (exit_status != NULL) *exit_status = WEXITSTATUS(status);
+    close(in_fd);
+
+    if (err != NULL) *errors = contents_of(err);
+    return contents_of(out);
+}
+
 // Not easily possible to test that enough memory was allocated for argv or
 // argv's char* elements See README section create_command
 SAFE_TEST(CreateCommand, Basic, {
@@ -69,6 +159,281 @@ SAFE_TEST(Parse, lsWithWhitespaces, {
     cleanup(rv);
 })
 
+SAFE_TEST(Parse, manyArgsSpillPastInlineTokens, {
+    // More tokens than fit in token_list's inline storage
+    std::string input = "echo";
+    for (int i = 0; i < 3 * TOKEN_INLINE_CAPACITY; i++)
+        input += " a" + std::to_string(i);
+    command* rv = parse(&input[0]);
+    ASSERT_EQ(3 * TOKEN_INLINE_CAPACITY + 1, rv->argc);
+    EXPECT_STREQ("echo", rv->argv[0]);
+    EXPECT_STREQ("a0", rv->argv[1]);
+    EXPECT_STREQ("a95", rv->argv[3 * TOKEN_INLINE_CAPACITY]);
+    EXPECT_EQ(NULL, rv->argv[3 * TOKEN_INLINE_CAPACITY + 1]);
+    cleanup(rv);
+})
+
+SAFE_TEST(Parse, longArgNotTruncated, {
+    std::string path(5 * MAX_ARG_LEN, 'x');
+    std::string input = "touch " + path;
+    command* rv = parse(&input[0]);
+    ASSERT_EQ(2, rv->argc);
+    EXPECT_STREQ(path.c_str(), rv->argv[1]);
+    cleanup(rv);
+})
+
+SAFE_TEST(Parse, argsShareOneBlock, {
+    // argv and the argument chars sit back to back right behind the struct
+    char input[] = "ls -l -a";
+    command* rv = parse(input);
+    char* block_end = reinterpret_cast<char*>(rv->argv + rv->argc + 1);
+    EXPECT_LT(reinterpret_cast<char*>(rv), reinterpret_cast<char*>(rv->argv));
+    EXPECT_EQ(block_end, rv->argv[0]);
+    EXPECT_EQ(rv->argv[0] + strlen("ls") + 1, rv->argv[1]);
+    EXPECT_EQ(rv->argv[1] + strlen("-l") + 1, rv->argv[2]);
+    cleanup(rv);
+})
+
+SAFE_TEST(CommandPool, steadyStateDoesNotAllocate, {
+    command_pool_clear();
+    char shorter[] = "mv a b";
+    char longer[] = "mv --no-clobber /tmp/source/file /tmp/dest/file";
+
+    // Warm up: the first command allocates
+    cleanup(parse(longer));
+    command_pool_stats warm;
+    get_command_pool_stats(&warm);
+    EXPECT_EQ(1u, warm.misses);
+    EXPECT_EQ(1, warm.pooled);
+
+    // Same or shorter lines, and resolving the path, reuse what is pooled
+    for (int i = 0; i < 100; i++) {
+        command* cmd = parse(i % 2 ? shorter : longer);
+        EXPECT_TRUE(find_full_path(cmd));
+        cleanup(cmd);
+    }
+    command_pool_stats steady;
+    get_command_pool_stats(&steady);
+    EXPECT_EQ(1u, steady.misses);
+    EXPECT_EQ(1, steady.pooled);
+    EXPECT_EQ(warm.hits + 100, steady.hits);
+    // Only the first resolved path needs a buffer of its own, and paths are
+    // counted apart from blocks
+    EXPECT_EQ(1u, steady.path_misses);
+    EXPECT_EQ(99u, steady.path_hits);
+    command_pool_clear();
+})
+
+SAFE_TEST(CommandPool, liveCommandsGetDistinctBlocks, {
+    command_pool_clear();
+    char input[] = "echo hello";
+    command* a = parse(input);
+    command* b = parse(input);
+    EXPECT_NE(a, b);
+    cleanup(a);
+    // b is untouched by a going back to the pool
+    EXPECT_STREQ("hello", b->argv[1]);
+    command* c = parse(input);
+    EXPECT_EQ(a, c);
+    cleanup(b);
+    cleanup(c);
+    command_pool_stats stats;
+    get_command_pool_stats(&stats);
+    EXPECT_EQ(2, stats.pooled);
+    command_pool_clear();
+})
+
+SAFE_TEST(Tokenize, offsetsAndLengths, {
+    const char input[] = "\t ls  -la\n";
+    token_list tokens;
+    EXPECT_EQ(2, tokenize(input, &tokens));
+    EXPECT_EQ(2u, tokens.items[0].offset);
+    EXPECT_EQ(2u, tokens.items[0].len);
+    EXPECT_EQ(6u, tokens.items[1].offset);
+    EXPECT_EQ(3u, tokens.items[1].len);
+    // The line itself must not be touched
+    EXPECT_STREQ("\t ls  -la\n", input);
+    token_list_free(&tokens);
+})
+
+SAFE_TEST(Tokenize, onlyWhitespace, {
+    token_list tokens;
+    EXPECT_EQ(0, tokenize(" \t \n", &tokens));
+    token_list_free(&tokens);
+})
+
+SAFE_TEST(Tokenize, pipeIsItsOwnToken, {
+    const char input[] = "ls|wc -l | x||";
+    token_list tokens;
+    EXPECT_EQ(8, tokenize(input, &tokens));
+    EXPECT_EQ(2u, tokens.items[1].offset);
+    EXPECT_EQ(1u, tokens.items[1].len);
+    EXPECT_EQ(3u, tokens.items[2].offset);
+    EXPECT_EQ(2u, tokens.items[2].len);
+    EXPECT_EQ(13u, tokens.items[7].offset);
+    token_list_free(&tokens);
+})
+
+SAFE_TEST(Tokenize, ampersandIsItsOwnToken, {
+    const char input[] = "sleep 1&echo x &";
+    token_list tokens;
+    EXPECT_EQ(6, tokenize(input, &tokens));
+    EXPECT_EQ(7u, tokens.items[2].offset);
+    EXPECT_EQ(1u, tokens.items[2].len);
+    EXPECT_EQ(8u, tokens.items[3].offset);
+    EXPECT_EQ(15u, tokens.items[5].offset);
+    token_list_free(&tokens);
+})
+
+SAFE_TEST(Tokenize, substitutionIsOneToken, {
+    const char input[] = "echo $(ls | wc -l)x `a b` $HOME";
+    token_list tokens;
+    EXPECT_EQ(4, tokenize(input, &tokens));
+    EXPECT_EQ(14u, tokens.items[1].len);
+    EXPECT_EQ(20u, tokens.items[2].offset);
+    EXPECT_EQ(5u, tokens.items[2].len);
+    EXPECT_EQ(5u, tokens.items[3].len);
+    token_list_free(&tokens);
+})
+
+SAFE_TEST(Tokenize, redirectionIsItsOwnToken, {
+    const char input[] = "sort<in -n>>out 2>&1 &>x a2>b";
+    token_list tokens;
+    EXPECT_EQ(12, tokenize(input, &tokens));
+    EXPECT_EQ(1u, tokens.items[1].len);
+    EXPECT_EQ(2u, tokens.items[4].len);
+    EXPECT_EQ(4u, tokens.items[6].len);
+    EXPECT_EQ(2u, tokens.items[7].len);
+    // A digit only names a stream at the start of a token
+    EXPECT_EQ(2u, tokens.items[9].len);
+    EXPECT_EQ(1u, tokens.items[10].len);
+    token_list_free(&tokens);
+})
+
+SAFE_TEST(LineReader, linesOfAnyLength, {
+    // Longer than MAX_LINE_SIZE and than a single read
+    std::string long_line = "echo " + std::string(3 * LINE_READER_CHUNK, 'y');
+    int fd = fd_with_contents("ls -la\n" + long_line + "\n\nexit\n");
+    line_reader reader;
+    line_reader_init(&reader, fd);
+    size_t len;
+    EXPECT_STREQ("ls -la", read_line(&reader, &len));
+    EXPECT_EQ(6u, len);
+    EXPECT_STREQ(long_line.c_str(), read_line(&reader, &len));
+    EXPECT_EQ(long_line.size(), len);
+    EXPECT_STREQ("", read_line(&reader, &len));
+    EXPECT_STREQ("exit", read_line(&reader, NULL));
+    EXPECT_EQ(NULL, read_line(&reader, &len));
+    EXPECT_EQ(NULL, read_line(&reader, &len));
+    line_reader_free(&reader);
+    close(fd);
+})
+
+SAFE_TEST(LineReader, lastLineWithoutNewline, {
+    int fd = fd_with_contents("pwd\nexit");
+    line_reader reader;
+    line_reader_init(&reader, fd);
+    EXPECT_STREQ("pwd", read_line(&reader, NULL));
+    EXPECT_STREQ("exit", read_line(&reader, NULL));
+    EXPECT_EQ(NULL, read_line(&reader, NULL));
+    line_reader_free(&reader);
+    close(fd);
+})
+
+SAFE_TEST(LineReader, recordsWithOtherDelimiter, {
+    int fd = fd_with_contents(std::string("a b\nc\0\0d", 8));
+    line_reader reader;
+    line_reader_init(&reader, fd);
+    size_t len;
+    EXPECT_STREQ("a b\nc", read_record(&reader, '\0', &len));
+    EXPECT_EQ(5u, len);
+    EXPECT_STREQ("", read_record(&reader, '\0', &len));
+    EXPECT_STREQ("d", read_record(&reader, '\0', &len));
+    EXPECT_EQ(NULL, read_record(&reader, '\0', &len));
+    line_reader_free(&reader);
+    close(fd);
+})
+
+SAFE_TEST(LineReader, manyLinesFromPipe, {
+    int pipe_fd[2];
+    ASSERT_EQ(0, pipe(pipe_fd));
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(pipe_fd[0]);
+        // Lines written one at a time, so they straddle reads
+        for (int i = 0; i < 20000; i++) {
+            std::string line = "line " + std::to_string(i) + "\n";
+            write(pipe_fd[1], line.data(), line.size());
+        }
+        _exit(0);
+    }
+    close(pipe_fd[1]);
+    line_reader reader;
+    line_reader_init(&reader, pipe_fd[0]);
+    int count = 0;
+    char* line;
+    while ((line = read_line(&reader, NULL)) != NULL) {
+        ASSERT_EQ("line " + std::to_string(count), std::string(line));
+        count++;
+    }
+    EXPECT_EQ(20000, count);
+    line_reader_free(&reader);
+    close(pipe_fd[0]);
+    waitpid(pid, NULL, 0);
+})
+
+SAFE_TEST(Script, linesTokenizedAheadOfTime, {
+    std::string path =
+        file_with_contents("echo   one\n\n  \t \nls -l -a\n   pwd");
+    script s;
+    ASSERT_EQ(SUCCESS, load_script(path.c_str(), &s));
+    unlink(path.c_str());
+    // Blank lines are dropped, the unterminated last line is kept
+    ASSERT_EQ(3, s.line_count);
+    EXPECT_EQ("ls -l -a", std::string(s.lines[1].text, s.lines[1].len));
+    command* cmd = script_command(&s, 1);
+    ASSERT_EQ(3, cmd->argc);
+    EXPECT_STREQ("ls", cmd->argv[0]);
+    EXPECT_STREQ("-a", cmd->argv[2]);
+    cleanup(cmd);
+    cmd = script_command(&s, 2);
+    ASSERT_EQ(1, cmd->argc);
+    EXPECT_STREQ("pwd", cmd->argv[0]);
+    cleanup(cmd);
+    free_script(&s);
+})
+
+SAFE_TEST(Script, lastLineEndsOnPageBoundary, {
+    // No newline and no zero-filled bytes after the last line in the mapping
+    std::string line = "echo " + std::string(getpagesize() - 6, 'z');
+    std::string path = file_with_contents("pwd\n" + line);
+    script s;
+    ASSERT_EQ(SUCCESS, load_script(path.c_str(), &s));
+    unlink(path.c_str());
+    ASSERT_EQ(2, s.line_count);
+    command* cmd = script_command(&s, 1);
+    ASSERT_EQ(2, cmd->argc);
+    EXPECT_EQ(line.substr(5), cmd->argv[1]);
+    cleanup(cmd);
+    free_script(&s);
+})
+
+SAFE_TEST(Script, missingFile, {
+    script s;
+    EXPECT_EQ(ERROR, load_script("/nonexistent/script.thsh", &s));
+    EXPECT_EQ(ENOENT, errno);
+})
+
+SAFE_TEST(Script, commandText, {
+    script s;
+    load_script_text("cd /\npwd", &s);
+    ASSERT_EQ(2, s.line_count);
+    command* cmd = script_command(&s, 0);
+    EXPECT_STREQ("/", cmd->argv[1]);
+    cleanup(cmd);
+    free_script(&s);
+})
+
 SAFE_TEST(FindFullPath, mv, {
     command cmd;
     cmd.argc = 1;
@@ -123,6 +488,1192 @@ SAFE_TEST(FindFullPath, nonexistentcommand, {
     delete[] cmd.argv;
 })
 
+SAFE_TEST(FindFullPath, parsedCommand, {
+    // The full path replaces argv[0] of a block-allocated command, and is
+    // released along with it by cleanup
+    char input[] = "mv -n a b";
+    command* cmd = parse(input);
+    EXPECT_TRUE(find_full_path(cmd));
+    EXPECT_STREQ("/usr/bin/mv", cmd->argv[0]);
+    EXPECT_STREQ("-n", cmd->argv[1]);
+    cleanup(cmd);
+})
+
+SAFE_TEST(Main, batchModeHasNoPrompt, {
+    EXPECT_EQ("hello\n", run_main({"./main"}, "echo hello\nexit\n"));
+    EXPECT_EQ("hello\n", run_main({"./main", "-s"}, "echo hello\nexit\n"));
+})
+
+SAFE_TEST(Main, interactiveFlagPrompts, {
+    // Prompts are flushed before the child runs, so they come out in order
+    EXPECT_EQ("thsh$ hello\nthsh$ ",
+              run_main({"./main", "-i"}, "echo hello\nexit\n"));
+})
+
+SAFE_TEST(Main, bufferedOutputNotDuplicatedByChildren, {
+    // The not found message is still buffered when echo is forked
+    EXPECT_EQ("Command nosuchcommand not found!\nhello\nhello\n",
+              run_main({"./main"},
+                       "nosuchcommand\necho hello\necho hello\nexit\n"));
+})
+
+SAFE_TEST(Main, runsScriptFile, {
+    std::string path = file_with_contents("cd /\npwd\nnosuchcommand\n");
+    int status;
+    // stdin is not read when running a script
+    EXPECT_EQ("/\nCommand nosuchcommand not found!\n",
+              run_main({"./main", path.c_str(), "arg"}, "echo stdin\n",
+                       &status));
+    EXPECT_EQ(EXIT_FAILURE, status);
+    unlink(path.c_str());
+})
+
+SAFE_TEST(Main, runsCommandText, {
+    int status;
+    EXPECT_EQ("hello\nworld\n",
+              run_main({"./main", "-c", "echo hello\necho world"}, "",
+                       &status));
+    EXPECT_EQ(EXIT_SUCCESS, status);
+    run_main({"./main", "-c"}, "", &status);
+    EXPECT_EQ(EXIT_FAILURE, status);
+})
+
+SAFE_TEST(Main, positionalParameters, {
+    std::string path = file_with_contents("echo $# $1-$2-$3 ${10}\necho $0\n");
+    EXPECT_EQ("10 a-b- j\n" + path + "\n",
+              run_main({"./main", path.c_str(), "a", "b", "", "d", "e", "f",
+                        "g", "h", "i", "j"},
+                       ""));
+    unlink(path.c_str());
+    // For -c, $0 is the first argument after the text, or the shell
+    EXPECT_EQ("sh x 1\n",
+              run_main({"./main", "-c", "echo $0 $1 $#", "sh", "x"}, ""));
+    EXPECT_EQ("./main 0\n", run_main({"./main", "-c", "echo $0 $#"}, ""));
+})
+
+SAFE_TEST(Main, missingScriptFile, {
+    int status;
+    EXPECT_EQ("", run_main({"./main", "/nonexistent.thsh"}, "", &status));
+    EXPECT_EQ(127, status);
+})
+
+SAFE_TEST(Main, invalidOption, {
+    int status;
+    EXPECT_EQ("", run_main({"./main", "-q"}, "echo hello\n", &status));
+    EXPECT_EQ(EXIT_FAILURE, status);
+})
+
+SAFE_TEST(PathCache, hitsAreCounted, {
+    path_cache_clear();
+    EXPECT_STREQ("/usr/bin/mv", path_cache_lookup("mv"));
+    EXPECT_STREQ("/usr/bin/mv", path_cache_lookup("mv"));
+    EXPECT_EQ(NULL, path_cache_lookup("nonexistentcommand"));
+    ASSERT_EQ(1, path_cache_size());
+    path_cache_entry entry;
+    ASSERT_EQ(1, path_cache_entries(&entry, 1));
+    EXPECT_STREQ("mv", entry.name);
+    EXPECT_EQ(2u, entry.hits);
+})
+
+SAFE_TEST(PathCache, pathChangeInvalidates, {
+    std::string dir = dir_with_program("thsh_tool");
+    std::string original = getenv("PATH");
+    setenv("PATH", (dir + ":" + original).c_str(), 1);
+    EXPECT_EQ(dir + "/thsh_tool", path_cache_lookup("thsh_tool"));
+    setenv("PATH", original.c_str(), 1);
+    EXPECT_EQ(NULL, path_cache_lookup("thsh_tool"));
+    EXPECT_EQ(0, path_cache_size());
+    unlink((dir + "/thsh_tool").c_str());
+    rmdir(dir.c_str());
+})
+
+SAFE_TEST(PathCache, deletedProgramIsForgotten, {
+    std::string dir = dir_with_program("mv");
+    setenv("PATH", (dir + ":/usr/bin").c_str(), 1);
+    EXPECT_EQ(dir + "/mv", path_cache_lookup("mv"));
+    // The next directory in $PATH takes over
+    unlink((dir + "/mv").c_str());
+    path_cache_poll();
+    EXPECT_STREQ("/usr/bin/mv", path_cache_lookup("mv"));
+    rmdir(dir.c_str());
+})
+
+SAFE_TEST(PathCache, firstDirectoryWins, {
+    std::string first = dir_with_program("thsh_tool");
+    std::string second = dir_with_program("thsh_tool");
+    setenv("PATH", (first + ":" + second).c_str(), 1);
+    EXPECT_EQ(first + "/thsh_tool", path_cache_lookup("thsh_tool"));
+    unlink((first + "/thsh_tool").c_str());
+    unlink((second + "/thsh_tool").c_str());
+    rmdir(first.c_str());
+    rmdir(second.c_str());
+})
+
+SAFE_TEST(PathCache, linkToDirectoryIsSkipped, {
+    // The first directory's entry is a symbolic link, to a directory
+    std::string first = dir_with_program("other");
+    std::string second = dir_with_program("thsh_tool");
+    symlink("/tmp", (first + "/thsh_tool").c_str());
+    setenv("PATH", (first + ":" + second).c_str(), 1);
+    EXPECT_EQ(second + "/thsh_tool", path_cache_lookup("thsh_tool"));
+    unlink((first + "/thsh_tool").c_str());
+    unlink((first + "/other").c_str());
+    unlink((second + "/thsh_tool").c_str());
+    rmdir(first.c_str());
+    rmdir(second.c_str());
+})
+
+SAFE_TEST(PathCache, nonExecutableFileIsSkipped, {
+    std::string first = dir_with_program("thsh_tool");
+    std::string second = dir_with_program("thsh_tool");
+    chmod((first + "/thsh_tool").c_str(), 0644);
+    setenv("PATH", (first + ":" + second).c_str(), 1);
+    EXPECT_EQ(second + "/thsh_tool", path_cache_lookup("thsh_tool"));
+    // Made executable, it shadows the second directory's
+    chmod((first + "/thsh_tool").c_str(), 0755);
+    path_cache_poll();
+    EXPECT_EQ(first + "/thsh_tool", path_cache_lookup("thsh_tool"));
+    unlink((first + "/thsh_tool").c_str());
+    unlink((second + "/thsh_tool").c_str());
+    rmdir(first.c_str());
+    rmdir(second.c_str());
+})
+
+SAFE_TEST(PathCache, newProgramFoundAfterRecheck, {
+    std::string dir = dir_with_program("thsh_tool");
+    setenv("PATH", (dir + ":/usr/bin").c_str(), 1);
+    EXPECT_EQ(NULL, path_cache_lookup("thsh_new"));
+    std::string path = dir + "/thsh_new";
+    close(open(path.c_str(), O_WRONLY | O_CREAT, 0755));
+    // hash -r has the index look at its directories again
+    path_cache_clear();
+    EXPECT_EQ(path, path_cache_lookup("thsh_new"));
+    unlink(path.c_str());
+    unlink((dir + "/thsh_tool").c_str());
+    rmdir(dir.c_str());
+})
+
+SAFE_TEST(PathCache, newProgramFoundAfterPoll, {
+    std::string dir = dir_with_program("thsh_tool");
+    setenv("PATH", (dir + ":/usr/bin").c_str(), 1);
+    EXPECT_EQ(NULL, path_cache_lookup("thsh_new"));
+    std::string path = dir + "/thsh_new";
+    close(open(path.c_str(), O_WRONLY | O_CREAT, 0755));
+    path_cache_poll();
+    EXPECT_EQ(path, path_cache_lookup("thsh_new"));
+    unlink(path.c_str());
+    unlink((dir + "/thsh_tool").c_str());
+    rmdir(dir.c_str());
+})
+
+SAFE_TEST(PathCache, pollForgetsOnlyChangedNames, {
+    std::string dir = dir_with_program("thsh_tool");
+    setenv("PATH", (dir + ":/usr/bin").c_str(), 1);
+    EXPECT_EQ(dir + "/thsh_tool", path_cache_lookup("thsh_tool"));
+    EXPECT_STREQ("/usr/bin/mv", path_cache_lookup("mv"));
+    unlink((dir + "/thsh_tool").c_str());
+    path_cache_poll();
+    EXPECT_EQ(1, path_cache_size());
+    EXPECT_EQ(NULL, path_cache_lookup("thsh_tool"));
+    // A program installed earlier in $PATH shadows the cached one
+    std::string mv = dir + "/mv";
+    close(open(mv.c_str(), O_WRONLY | O_CREAT, 0755));
+    path_cache_poll();
+    EXPECT_EQ(mv, path_cache_lookup("mv"));
+    unlink(mv.c_str());
+    rmdir(dir.c_str());
+})
+
+// Programs expected in /usr/bin, enough to make probe runs collide
+static const char* COMMON_PROGRAMS[] = {"ls",   "mv",    "cp",  "rm",   "cat",
+                                        "head", "tail",  "env", "find", "sort",
+                                        "uniq", "mkdir", "wc",  "tr",   "cut"};
+
+SAFE_TEST(PathCache, removeKeepsOtherEntriesReachable, {
+    const char** names = COMMON_PROGRAMS;
+    const int n = sizeof(COMMON_PROGRAMS) / sizeof(COMMON_PROGRAMS[0]);
+    for (int i = 0; i < n; i++) EXPECT_TRUE(path_cache_add(names[i]));
+    for (int i = 0; i < n; i += 2) EXPECT_TRUE(path_cache_remove(names[i]));
+    EXPECT_FALSE(path_cache_remove("ls"));
+    EXPECT_EQ(n / 2, path_cache_size());
+    // Whatever moved to fill the holes must still be found in the cache
+    for (int i = 1; i < n; i += 2) {
+        path_cache_lookup(names[i]);
+        EXPECT_EQ(n / 2, path_cache_size());
+    }
+})
+
+/**
+ * Returns the builtin line invokes, if any
+ */
+static const builtin* builtin_for(std::string line) {
+    command* cmd = parse(&line[0]);
+    const builtin* found = find_builtin(cmd);
+    cleanup(cmd);
+    return found;
+}
+
+static const char* BUILTIN_NAMES[] = {"cd",   "exit",  "hash",   "echo",
+                                      "pwd",  "true",  "false",  "printf",
+                                      "exec", "export", "unset"};
+// Names that must not be taken for builtins, despite their likeness
+static const char* NOT_BUILTIN_NAMES[] = {"ls",      "ech", "echoo",
+                                          "Echo",    "c",   "/bin/echo",
+                                          "printf_", "cdd", "exit2"};
+
+SAFE_TEST(Builtin, lookupIsExact, {
+    for (const char* name : BUILTIN_NAMES) {
+        // printf needs an argument, otherwise it is left to the program
+        const builtin* found = builtin_for(std::string(name) + " x");
+        ASSERT_NE(nullptr, found) << name;
+        EXPECT_STREQ(name, found->name);
+    }
+    for (const char* name : NOT_BUILTIN_NAMES)
+        EXPECT_EQ(nullptr, builtin_for(name)) << name;
+    // Left to the program
+    EXPECT_EQ(nullptr, builtin_for("echo --help"));
+})
+
+SAFE_TEST(Builtin, hash, {
+    EXPECT_EQ(
+        "hash: hash table empty\n"
+        "hits\tcommand\n   0\t/usr/bin/mv\n"
+        "hash: hash table empty\n",
+        run_main({"./main", "-c", "hash\nhash mv\nhash\nhash -r\nhash"}, ""));
+    int status;
+    run_main({"./main", "-c", "hash nonexistentcommand"}, "", &status);
+    EXPECT_EQ(EXIT_FAILURE, status);
+})
+
+/**
+ * Runs the program /usr/bin/<first word of line>, with the other words of line
+ * as arguments, and returns what it wrote to stdout
+ */
+static std::string program_output(const std::string& line) {
+    std::vector<std::string> words;
+    for (size_t start = 0, end; start < line.size(); start = end + 1) {
+        end = line.find(' ', start);
+        if (end == std::string::npos) end = line.size();
+        words.push_back(line.substr(start, end - start));
+    }
+    std::string path = "/usr/bin/" + words[0];
+    std::vector<char*> argv;
+    for (std::string& word : words) argv.push_back(&word[0]);
+    argv.push_back(NULL);
+
+    FILE* out = tmpfile();
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(fileno(out), STDOUT_FILENO);
+        execv(path.c_str(), argv.data());
+        _exit(127);
+    }
+    waitpid(pid, NULL, 0);
+
+    std::string output;
+    char buffer[4096];
+    size_t count;
+    rewind(out);
+    while ((count = fread(buffer, 1, sizeof(buffer), out)) > 0)
+        output.append(buffer, count);
+    fclose(out);
+    return output;
+}
+
+// Invocations of the in-process builtins, each of which must print exactly
+// what the program of the same name prints
+static const char* BUILTIN_LINES[] = {
+    "echo hello world",
+    "echo -n hi",
+    "echo -e a\\tb\\nc",
+    "echo -e a\\cb c",
+    "echo -e \\0101\\101\\1234\\x41\\x4g\\xZ\\q\\\\",
+    "echo -neE a\\tb",
+    "echo -- -n x",
+    "echo -nx y",
+    "printf %d\\n 1 2 3",
+    "printf %5.2f/%-5s/%05d\\n 3.14159 ab 42",
+    "printf %x%X%o%u/%i\\n 255 255 8 -1 0x1f",
+    "printf %*d/%.*f\\n 5 3 2 1.23456",
+    "printf %e/%g/%a/%c%c\\n 1.5 0.0001 1 abc x",
+    "printf %b/%s\\n a\\tb\\0101c\\101 a\\tb",
+    "printf %s-%s\\n a b c",
+    "printf %d/%d/%d\\n 'A 12abc nan",
+    "printf %b a\\cb x",
+    "printf \\x414\\101\\q%%%5%",
+    "printf hello x y",
+    "pwd",
+    "pwd -L",
+};
+
+SAFE_TEST(Builtin, outputMatchesPrograms, {
+    for (const char* line : BUILTIN_LINES)
+        EXPECT_EQ(program_output(line), run_main({"./main", "-c", line}, ""))
+            << line;
+})
+
+SAFE_TEST(Builtin, exitStatus, {
+    int status;
+    run_main({"./main", "-c", "false"}, "", &status);
+    EXPECT_EQ(EXIT_FAILURE, status);
+    run_main({"./main", "-c", "false\ntrue x"}, "", &status);
+    EXPECT_EQ(EXIT_SUCCESS, status);
+    run_main({"./main", "-c", "printf %d x"}, "", &status);
+    EXPECT_EQ(EXIT_FAILURE, status);
+    // \c ends printf successfully, even after a bad argument
+    run_main({"./main", "-c", "printf %d%b x \\c"}, "", &status);
+    EXPECT_EQ(EXIT_SUCCESS, status);
+})
+
+SAFE_TEST(Builtin, runsInProcess, {
+    // Neither looked up nor started
+    EXPECT_EQ("x\n\nhash: hash table empty\n",
+              run_main({"./main", "-c", "hash -r\necho x\nprintf \\n\nhash"},
+                       ""));
+    // Unless only the program knows what to do
+    EXPECT_EQ("hits\tcommand\n   1\t/usr/bin/printf\n",
+              run_main({"./main", "-c", "printf %q\nhash"}, ""));
+})
+
+SAFE_TEST(Pipeline, stagesAreConnected, {
+    EXPECT_EQ("HELLO\n",
+              run_main({"./main", "-c", "echo hello | tr a-z A-Z"}, ""));
+    EXPECT_EQ("100000\n",
+              run_main({"./main", "-c", "seq 100000 | sort -rn | head -n 1"},
+                       ""));
+    // No spaces needed around |
+    EXPECT_EQ("b\n", run_main({"./main", "-c", "echo a|tr a b"}, ""));
+})
+
+SAFE_TEST(Pipeline, stagesRunConcurrently, {
+    // yes never ends on its own: only a concurrent head stops it
+    EXPECT_EQ("y\n", run_main({"./main", "-c", "yes | head -n 1"}, ""));
+})
+
+SAFE_TEST(Pipeline, statusIsLastStage, {
+    int status;
+    run_main({"./main", "-c", "false | true"}, "", &status);
+    EXPECT_EQ(EXIT_SUCCESS, status);
+    run_main({"./main", "-c", "true | false"}, "", &status);
+    EXPECT_EQ(EXIT_FAILURE, status);
+    // The missing stage is skipped, cat just sees end of file
+    EXPECT_EQ("Command nosuchcommand not found!\n",
+              run_main({"./main", "-c", "nosuchcommand | cat"}, "", &status));
+    EXPECT_EQ(EXIT_SUCCESS, status);
+})
+
+SAFE_TEST(Pipeline, builtinStage, {
+    EXPECT_EQ("hash: hash table empty\n",
+              run_main({"./main", "-c", "hash -r\nhash | cat"}, ""));
+})
+
+SAFE_TEST(Pipeline, emptyStageIsSyntaxError, {
+    int status;
+    EXPECT_EQ("", run_main({"./main", "-c", "| ls"}, "", &status));
+    EXPECT_EQ(EXIT_FAILURE, status);
+    EXPECT_EQ("", run_main({"./main", "-c", "ls || ls"}, "", &status));
+    EXPECT_EQ(EXIT_FAILURE, status);
+    EXPECT_EQ("", run_main({"./main", "-c", "ls |"}, "", &status));
+    EXPECT_EQ(EXIT_FAILURE, status);
+})
+
+SAFE_TEST(Jobs, notWaitedFor, {
+    // The second line runs while the job is still sleeping
+    EXPECT_EQ("started\n[1]+  Running                 sleep 0.3 &\n",
+              run_main({"./main", "-c", "sleep 0.3 &\necho started\njobs"},
+                       ""));
+    EXPECT_EQ("b\n", run_main({"./main", "-c", "echo a | tr a b &\nwait"}, ""));
+    // Several on one line, and what follows the last & is waited for
+    EXPECT_EQ("x\n", run_main({"./main", "-c", "true & true&echo x"}, ""));
+})
+
+SAFE_TEST(Jobs, stdinIsDevNull, {
+    EXPECT_EQ("", run_main({"./main", "-c", "cat &\nwait"}, "not for cat\n"));
+})
+
+SAFE_TEST(Jobs, waitReturnsJobStatus, {
+    int status;
+    run_main({"./main", "-c", "true &\nfalse &\nwait %1"}, "", &status);
+    EXPECT_EQ(EXIT_SUCCESS, status);
+    run_main({"./main", "-c", "true &\nfalse &\nwait %2"}, "", &status);
+    EXPECT_EQ(EXIT_FAILURE, status);
+    // All of them
+    run_main({"./main", "-c", "false &\nwait"}, "", &status);
+    EXPECT_EQ(EXIT_SUCCESS, status);
+    run_main({"./main", "-c", "wait %3"}, "", &status);
+    EXPECT_EQ(EXIT_FAILURE, status);
+})
+
+SAFE_TEST(Jobs, waitNextTakesFirstToFinish, {
+    int status;
+    run_main({"./main", "-c", "sleep 0.3 &\nfalse &\nwait -n"}, "", &status);
+    EXPECT_EQ(EXIT_FAILURE, status);
+    EXPECT_EQ("[1]+  Running                 sleep 0.3 &\n",
+              run_main({"./main", "-c", "sleep 0.3 &\ntrue &\nwait -n\njobs"},
+                       "", &status));
+    run_main({"./main", "-c", "wait -n"}, "", &status);
+    EXPECT_EQ(EXIT_FAILURE, status);
+})
+
+SAFE_TEST(Jobs, fgWaitsForCurrentJob, {
+    int status;
+    EXPECT_EQ("sleep 0.1\n[1]+  Exit 1                  false\n",
+              run_main({"./main", "-c", "false &\nsleep 0.1 &\nfg\njobs"}, "",
+                       &status));
+    EXPECT_EQ(EXIT_SUCCESS, status);
+    EXPECT_EQ("false\n", run_main({"./main", "-c", "false &\nfg %1"}, "",
+                                  &status));
+    EXPECT_EQ(EXIT_FAILURE, status);
+})
+
+SAFE_TEST(Jobs, manyWorkers, {
+    std::string text;
+    for (int i = 0; i < 300; i++) text += "sleep 0.2 &\n";
+    text += "jobs\nwait\njobs\necho done";
+    std::string output = run_main({"./main", "-c", text.c_str()}, "");
+    // All listed as running, none left after wait
+    EXPECT_EQ(300, std::count(output.begin(), output.end(), '\n') - 1);
+    EXPECT_NE(std::string::npos, output.find("[300]+  Running"));
+    EXPECT_EQ("done\n", output.substr(output.size() - 5));
+})
+
+SAFE_TEST(Jobs, emptyJobIsSyntaxError, {
+    int status;
+    EXPECT_EQ("", run_main({"./main", "-c", "& echo x"}, "", &status));
+    EXPECT_EQ(EXIT_FAILURE, status);
+    EXPECT_EQ("", run_main({"./main", "-c", "echo x & & echo y"}, "", &status));
+    EXPECT_EQ(EXIT_FAILURE, status);
+})
+
+/**
+ * Returns the seconds run_main(args, input) takes, and its output in output
+ */
+static double seconds_to_run(std::vector<const char*> args,
+                             const std::string& input, std::string* output,
+                             int* exit_status = NULL) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    *output = run_main(args, input, exit_status);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/**
+ * Returns the lines of text, sorted
+ */
+static std::vector<std::string> sorted_lines(const std::string& text) {
+    std::vector<std::string> lines;
+    size_t start = 0, end;
+    while ((end = text.find('\n', start)) != std::string::npos) {
+        lines.push_back(text.substr(start, end - start));
+        start = end + 1;
+    }
+    std::sort(lines.begin(), lines.end());
+    return lines;
+}
+
+static const std::vector<std::string> PARALLEL_LINES = {"a", "b", "c", "d"};
+
+SAFE_TEST(Parallel, linesRunConcurrently, {
+    std::string output;
+    // echo is done at once, but each line ends with its sleep
+    std::string lines = "sleep 0.3 | echo a\nsleep 0.3 | echo b\n"
+                        "sleep 0.3 | echo c\nsleep 0.3 | echo d\n";
+    EXPECT_GT(1.0, seconds_to_run({"./main", "-c", "parallel -j 4"}, lines,
+                                  &output));
+    EXPECT_EQ(PARALLEL_LINES, sorted_lines(output));
+    // The same from main's own --jobs
+    std::string path = file_with_contents(lines);
+    EXPECT_GT(1.0, seconds_to_run({"./main", "--jobs", "4", path.c_str()}, "",
+                                  &output));
+    EXPECT_EQ(PARALLEL_LINES, sorted_lines(output));
+    EXPECT_GT(1.0, seconds_to_run({"./main", "-j", "4"}, lines, &output));
+    EXPECT_EQ(PARALLEL_LINES, sorted_lines(output));
+    unlink(path.c_str());
+})
+
+SAFE_TEST(Parallel, jobsBoundsConcurrency, {
+    std::string output;
+    std::string lines = "sleep 0.2\nsleep 0.2\nsleep 0.2\nsleep 0.2\n";
+    double seconds =
+        seconds_to_run({"./main", "-c", "parallel -j 2"}, lines, &output);
+    EXPECT_LT(0.4, seconds);
+    EXPECT_GT(0.8, seconds);
+    EXPECT_LT(0.8, seconds_to_run({"./main", "-j", "1"}, lines, &output));
+})
+
+SAFE_TEST(Parallel, failedLineFailsRun, {
+    int status;
+    run_main({"./main", "-c", "parallel -j 2"}, "true\nfalse\ntrue\n",
+             &status);
+    EXPECT_EQ(EXIT_FAILURE, status);
+    run_main({"./main", "-c", "parallel -j 2"}, "true\ntrue\n", &status);
+    EXPECT_EQ(EXIT_SUCCESS, status);
+    run_main({"./main", "-j", "2"}, "nosuchcommand\ntrue\n", &status);
+    EXPECT_EQ(EXIT_FAILURE, status);
+    // Every line still runs
+    EXPECT_EQ("x\n", run_main({"./main", "-j", "1"}, "false\necho x\n"));
+})
+
+SAFE_TEST(Parallel, haltOnError, {
+    int status;
+    EXPECT_EQ("", run_main({"./main", "-c", "parallel -j 1 --halt-on-error"},
+                           "false\necho x\n", &status));
+    EXPECT_EQ(EXIT_FAILURE, status);
+    EXPECT_EQ("", run_main({"./main", "-j", "1", "--halt-on-error"},
+                           "false\necho x\n", &status));
+    EXPECT_EQ(EXIT_FAILURE, status);
+    // What is running already is waited for
+    std::string script = file_with_contents("sleep 0.2; echo x\n");
+    EXPECT_EQ("x\n", run_main({"./main", "-j", "2", "--halt-on-error"},
+                              "sh " + script + "\nfalse\nfalse\n"));
+    unlink(script.c_str());
+})
+
+SAFE_TEST(Parallel, joblog, {
+    std::string log = file_with_contents("");
+    std::string line = "parallel -j 1 --joblog " + log;
+    std::string script = file_with_contents("exit 3\n");
+    run_main({"./main", "-c", line.c_str()}, "true\nsh " + script + "\n");
+    std::ifstream file(log);
+    std::vector<std::string> fields[3];
+    std::string text;
+    for (int i = 0; i < 3 && std::getline(file, text); i++) {
+        std::istringstream stream(text);
+        std::string field;
+        while (std::getline(stream, field, '\t')) fields[i].push_back(field);
+    }
+    EXPECT_EQ("Seq", fields[0].at(0));
+    EXPECT_EQ("Command", fields[0].at(5));
+    EXPECT_EQ("1", fields[1].at(0));
+    EXPECT_EQ("0", fields[1].at(3));
+    EXPECT_EQ("true", fields[1].at(5));
+    EXPECT_EQ("2", fields[2].at(0));
+    EXPECT_EQ("3", fields[2].at(3));
+    EXPECT_EQ("sh " + script, fields[2].at(5));
+    unlink(log.c_str());
+    unlink(script.c_str());
+})
+
+SAFE_TEST(Parallel, keepOrder, {
+    std::string slow = file_with_contents("sleep 0.3; echo a; echo b\n");
+    std::string lines = "sh " + slow + "\necho c\nsleep 0.1 | echo d\n";
+    EXPECT_EQ("c\nd\na\nb\n",
+              run_main({"./main", "-c", "parallel -j 3"}, lines));
+    EXPECT_EQ("a\nb\nc\nd\n",
+              run_main({"./main", "-c", "parallel -j 3 -k"}, lines));
+    EXPECT_EQ("a\nb\nc\nd\n",
+              run_main({"./main", "-j", "3", "--keep-order"}, lines));
+    // The lines after a slow one go on running while it holds them back
+    std::string output;
+    EXPECT_GT(0.6, seconds_to_run({"./main", "-j", "3", "-k"}, lines + lines,
+                                  &output));
+    EXPECT_EQ("a\nb\nc\nd\na\nb\nc\nd\n", output);
+    unlink(slow.c_str());
+})
+
+SAFE_TEST(Parallel, linesRunAsExecuteWould, {
+    std::string lines = "echo $(echo x)y\ntime -p true\nsleep 0.1 & echo z\n";
+    int status;
+    std::string errors;
+    EXPECT_EQ("xy\nz\n", run_main({"./main", "-c", "parallel -k"}, lines,
+                                   &status, &errors));
+    EXPECT_EQ(EXIT_SUCCESS, status);
+    EXPECT_NE(std::string::npos, errors.find("real "));
+    EXPECT_EQ("xy\nz\n",
+              run_main({"./main", "-j", "2", "-k"}, lines, &status));
+    EXPECT_EQ(EXIT_SUCCESS, status);
+})
+
+SAFE_TEST(Parallel, keepOrderSpillsToMemfd, {
+    std::string expected =
+        run_main({"./main", "-c", "seq 100000\nseq 3\nseq 20000"}, "");
+    std::string lines = "seq 100000\nseq 3\nseq 20000\n";
+    // Over the spill threshold for one line
+    EXPECT_EQ(expected, run_main({"./main", "-j", "3", "-k"}, lines));
+    // Nothing at all in memory
+    EXPECT_EQ(expected, run_main({"./main", "-j", "3", "-k", "--memory-cap",
+                                  "0"}, lines));
+    EXPECT_EQ(expected,
+              run_main({"./main", "-c", "parallel -k --memory-cap 1K"},
+                       lines));
+    int status;
+    run_main({"./main", "-j", "2", "--memory-cap", "1X"}, lines, &status);
+    EXPECT_EQ(EXIT_FAILURE, status);
+})
+
+SAFE_TEST(Parallel, invalidArguments, {
+    int status;
+    run_main({"./main", "-c", "parallel -j 0"}, "true\n", &status);
+    EXPECT_EQ(EXIT_FAILURE, status);
+    run_main({"./main", "-c", "parallel /nonexistent"}, "", &status);
+    EXPECT_EQ(EXIT_FAILURE, status);
+    EXPECT_EQ("", run_main({"./main", "-j", "x"}, "echo x\n", &status));
+    EXPECT_EQ(EXIT_FAILURE, status);
+})
+
+SAFE_TEST(Xargs, itemsBecomeArguments, {
+    EXPECT_EQ("x a b c d\n", run_main({"./main", "-c", "xargs echo x"},
+                                      "a b\n  c\td  \n\n"));
+    // echo by default
+    EXPECT_EQ("a b\n", run_main({"./main", "-c", "xargs"}, "a\nb\n"));
+    EXPECT_EQ("1 2\n3 4\n5\n",
+              run_main({"./main", "-c", "seq 5 | xargs -n 2 echo"}, ""));
+    std::string items = file_with_contents(std::string("a b\0c\0", 6));
+    std::string line = "xargs -0 -a " + items + " printf [%s]";
+    EXPECT_EQ("[a b][c]", run_main({"./main", "-c", line.c_str()}, ""));
+    unlink(items.c_str());
+})
+
+SAFE_TEST(Xargs, itemsAreNeverOperators, {
+    std::string path = file_with_contents("");
+    unlink(path.c_str());
+    std::string items =
+        file_with_contents("a > " + path + " b | cat & $HOME `true`\n");
+    std::string line = "xargs -a " + items + " echo";
+    EXPECT_EQ("a > " + path + " b | cat & $HOME `true`\n",
+              run_main({"./main", "-c", line.c_str()}, ""));
+    // Nine items, three at a time
+    line = "xargs -P 2 -n 3 -a " + items + " echo | wc -l";
+    EXPECT_EQ("3\n", run_main({"./main", "-c", line.c_str()}, ""));
+    EXPECT_NE(0, access(path.c_str(), F_OK));
+    unlink(items.c_str());
+})
+
+SAFE_TEST(Xargs, batchesFitArgMax, {
+    size_t limit = xargs_batch_limit();
+    EXPECT_LT(limit, (size_t)sysconf(_SC_ARG_MAX));
+    EXPECT_LT((size_t)sysconf(_SC_ARG_MAX) / 2, limit);
+    // 100,000 numbers (about 1.4 MB as arguments) in one or two echos
+    std::string output = run_main(
+        {"./main", "-c", "seq 100000 | xargs echo | wc -lw"}, "");
+    int lines = 0;
+    int words = 0;
+    sscanf(output.c_str(), "%d %d", &lines, &words);
+    EXPECT_GE(2, lines);
+    EXPECT_EQ(100000, words);
+    // With -s, batches stay under max-chars
+    output = run_main({"./main", "-c", "seq 1000 | xargs -s 200 echo"}, "");
+    std::vector<std::string> batches = sorted_lines(output);
+    EXPECT_LT(10u, batches.size());
+    for (const std::string& batch : batches) EXPECT_GE(200u, batch.size());
+    EXPECT_EQ(1000, std::count(output.begin(), output.end(), ' ') +
+                        (long)batches.size());
+})
+
+SAFE_TEST(Xargs, noItems, {
+    EXPECT_EQ("x\n", run_main({"./main", "-c", "xargs echo x"}, ""));
+    EXPECT_EQ("", run_main({"./main", "-c", "xargs -r echo x"}, ""));
+})
+
+SAFE_TEST(Xargs, status, {
+    int status;
+    run_main({"./main", "-c", "xargs -n 1 false"}, "a b\n", &status);
+    EXPECT_EQ(EXIT_FAILURE, status);
+    run_main({"./main", "-c", "xargs -n 1 true"}, "a b\n", &status);
+    EXPECT_EQ(EXIT_SUCCESS, status);
+    run_main({"./main", "-c", "xargs -n 0 true"}, "a b\n", &status);
+    EXPECT_EQ(EXIT_FAILURE, status);
+    // An item that can't fit at all
+    EXPECT_EQ("short\n",
+              run_main({"./main", "-c", "xargs -s 40 echo"},
+                       "short " + std::string(30, 'x') + " y\n", &status));
+    EXPECT_EQ(EXIT_FAILURE, status);
+})
+
+SAFE_TEST(Xargs, parallelBatches, {
+    std::string output;
+    EXPECT_GT(1.0, seconds_to_run({"./main", "-c", "xargs -n 1 -P 4 sleep"},
+                                  "0.3 0.3 0.3 0.3\n", &output));
+    EXPECT_LT(0.5, seconds_to_run({"./main", "-c", "xargs -n 2 -P 1 sleep"},
+                                  "0.2 0.1 0.2 0.1\n", &output));
+})
+
+/**
+ * Returns the space-separated numbers in text
+ */
+static std::vector<double> numbers_in(const std::string& text) {
+    std::vector<double> numbers;
+    std::istringstream stream(text);
+    double number;
+    while (stream >> number) numbers.push_back(number);
+    return numbers;
+}
+
+SAFE_TEST(Time, reportsOnStderr, {
+    std::string errors;
+    EXPECT_EQ("", run_main({"./main", "-c", "time -p sleep 0.2"}, "", NULL,
+                           &errors));
+    EXPECT_EQ(0u, errors.find("real 0.2"));
+    EXPECT_NE(std::string::npos, errors.find("\nuser 0.0"));
+    EXPECT_NE(std::string::npos, errors.find("\nsys 0.0"));
+
+    EXPECT_EQ("x\n", run_main({"./main", "-c", "time echo x"}, "", NULL,
+                              &errors));
+    EXPECT_EQ(0u, errors.find("\nreal\t0m0.0"));
+    EXPECT_NE(std::string::npos, errors.find("\nmaxrss\t"));
+    EXPECT_NE(std::string::npos, errors.find("\nfaults\t0 major, "));
+    EXPECT_NE(std::string::npos, errors.find("\nctxsw\t"));
+    // Only pipelines get a line per stage
+    EXPECT_EQ(std::string::npos, errors.find("stage"));
+})
+
+SAFE_TEST(Time, figuresInVariables, {
+    std::vector<double> figures = numbers_in(run_main(
+        {"./main", "-c",
+         "time sleep 0.2\necho $TIME_REAL $TIME_USER $TIME_STAGE_REAL"},
+        ""));
+    ASSERT_EQ(3u, figures.size());
+    EXPECT_LE(0.2, figures[0]);
+    EXPECT_GT(0.1, figures[1]);
+    // The only stage ended before the timing did
+    EXPECT_LE(figures[2], figures[0]);
+    // Programs run afterwards don't get them
+    EXPECT_EQ("", run_main({"./main", "-c", "time true\nprintenv TIME_REAL"},
+                           ""));
+})
+
+SAFE_TEST(Time, stagesOfPipeline, {
+    std::string errors;
+    std::string output = run_main(
+        {"./main", "-c",
+         "time seq 1000000 | sort -n -S 50M | tail -n 1\n"
+         "echo $TIME_STAGE_MAXRSS"},
+        "", NULL, &errors);
+    EXPECT_EQ(0u, output.find("1000000\n"));
+    // wait4 gives each stage's own figures: sort fills a 50 MB buffer, the
+    // others hold a line at a time
+    std::vector<double> maxrss = numbers_in(output.substr(8));
+    ASSERT_EQ(3u, maxrss.size());
+    EXPECT_LT(maxrss[2] + 16384, maxrss[1]);
+    EXPECT_NE(std::string::npos, errors.find("  seq 1000000\n"));
+    EXPECT_NE(std::string::npos, errors.find("  sort -n -S 50M\n"));
+    EXPECT_NE(std::string::npos, errors.find("  tail -n 1\n"));
+})
+
+SAFE_TEST(Time, statusOfCommand, {
+    int status;
+    run_main({"./main", "-c", "time false"}, "", &status);
+    EXPECT_EQ(EXIT_FAILURE, status);
+    run_main({"./main", "-c", "time true | false"}, "", &status);
+    EXPECT_EQ(EXIT_FAILURE, status);
+    run_main({"./main", "-c", "time false | true"}, "", &status);
+    EXPECT_EQ(EXIT_SUCCESS, status);
+    // Built-ins and assignments still run in the shell itself
+    EXPECT_EQ("/tmp\n", run_main({"./main", "-c", "time cd /tmp\npwd"}, ""));
+    EXPECT_EQ("1\n", run_main({"./main", "-c", "time X=1\necho $X"}, ""));
+})
+
+SAFE_TEST(Substitution, outputBecomesArguments, {
+    EXPECT_EQ("1 2 3\n", run_main({"./main", "-c", "echo $(seq 3)"}, ""));
+    EXPECT_EQ("xa by\n", run_main({"./main", "-c", "echo x$(echo a b)y"}, ""));
+    EXPECT_EQ("a b\n", run_main({"./main", "-c", "echo `echo a` b"}, ""));
+    EXPECT_EQ("5\n", run_main({"./main", "-c", "echo $(seq 5 | tail -n 1)"},
+                              ""));
+    // Empty output leaves no argument
+    EXPECT_EQ("[]\n", run_main({"./main", "-c", "printf [%s]\\n $(true)"},
+                               ""));
+    // $x is unset, so only the lone $ is left
+    EXPECT_EQ("$\n", run_main({"./main", "-c", "echo $x $"}, ""));
+})
+
+SAFE_TEST(Substitution, nested, {
+    EXPECT_EQ("/tmp\n",
+              run_main({"./main", "-c", "cd /tmp\necho $(echo $(pwd))"}, ""));
+    EXPECT_EQ("a\n", run_main({"./main", "-c", "echo $(echo `echo a`)"}, ""));
+    // Inside a stage of a pipeline, or time, each output stays its own
+    EXPECT_EQ("[2]\n", run_main({"./main", "-c",
+                                 "echo [$(true | expr $(expr 1 + 1))]"},
+                                ""));
+    EXPECT_EQ("[6]\n", run_main({"./main", "-c",
+                                 "echo [$(time expr $(expr 5 + 1))]"},
+                                ""));
+    EXPECT_EQ("[]\n", run_main({"./main", "-c",
+                                "echo [$(cat $(expr 3) 2> /dev/null | cat)]"},
+                               ""));
+})
+
+SAFE_TEST(Substitution, runsInSubshell, {
+    std::string cwd = std::filesystem::current_path().string();
+    EXPECT_EQ("\n" + cwd + "\n",
+              run_main({"./main", "-c", "echo $(cd /tmp)\npwd"}, ""));
+    int status;
+    EXPECT_EQ("x\n", run_main({"./main", "-c", "echo $(exit 3)x"}, "",
+                              &status));
+    EXPECT_EQ(EXIT_SUCCESS, status);
+})
+
+SAFE_TEST(Substitution, unclosed, {
+    int status;
+    std::string errors;
+    EXPECT_EQ("", run_main({"./main", "-c", "echo $(echo x"}, "", &status,
+                           &errors));
+    EXPECT_EQ(EXIT_FAILURE, status);
+    EXPECT_NE(std::string::npos, errors.find("matching `)'"));
+})
+
+SAFE_TEST(Substitution, outputIsNeverAnOperator, {
+    std::string path = file_with_contents("");
+    unlink(path.c_str());
+    // >, | and & from printf's octal escapes are only arguments
+    std::string line = "echo hi $(printf \\076) " + path;
+    EXPECT_EQ("hi > " + path + "\n",
+              run_main({"./main", "-c", line.c_str()}, ""));
+    line = "echo a $(printf \\174) cat $(printf \\046) " + path + " | cat";
+    EXPECT_EQ("a | cat & " + path + "\n",
+              run_main({"./main", "-c", line.c_str()}, ""));
+    EXPECT_NE(0, access(path.c_str(), F_OK));
+
+    // The file of a redirection is expanded in one piece
+    line = "echo x > $(echo " + path + ")\ncat " + path;
+    EXPECT_EQ("x\n", run_main({"./main", "-c", line.c_str()}, ""));
+    unlink(path.c_str());
+})
+
+SAFE_TEST(Variables, setAndExpand, {
+    EXPECT_EQ("a b/c a\n",
+              run_main({"./main", "-c", "X=a\nY=b Z=c\necho $X $Y/$Z ${X}"},
+                       ""));
+    EXPECT_EQ("xay 10$ $%\n",
+              run_main({"./main", "-c", "X=a\necho x${X}y 10$ $%"}, ""));
+    // Unset variables leave nothing, and values are split like output
+    setenv("FIELDS", "a  b", 1);
+    EXPECT_EQ("[a][b]",
+              run_main({"./main", "-c", "printf [%s] $FIELDS$Y"}, ""));
+    unsetenv("FIELDS");
+    // From the environment the shell got
+    std::string home = getenv("HOME");
+    EXPECT_EQ(home + "\n", run_main({"./main", "-c", "echo $HOME"}, ""));
+    // Expanded when the line runs, after the lines before it
+    EXPECT_EQ("1\n2\n", run_main({"./main", "-c", "X=1\necho $X\nX=2\necho $X"},
+                                 ""));
+})
+
+SAFE_TEST(Variables, valuesAreNeverOperators, {
+    std::string path = file_with_contents("");
+    unlink(path.c_str());
+    // V is "x > path", in one piece
+    std::string line = "V=x$(printf \\040\\076\\040)" + path + "\necho $V";
+    EXPECT_EQ("x > " + path + "\n",
+              run_main({"./main", "-c", line.c_str()}, ""));
+    EXPECT_NE(0, access(path.c_str(), F_OK));
+})
+
+SAFE_TEST(Variables, assignedValuesAreNotSplit, {
+    EXPECT_EQ("a b\n1a b\n",
+              run_main({"./main", "-c",
+                        "X=$(echo a b)\necho $X\nY=1$X\necho $Y"},
+                       ""));
+    // What an expansion comes to is no assignment
+    int status;
+    EXPECT_EQ("Command Z=1 not found!\n",
+              run_main({"./main", "-c", "A=Z=1\n$A"}, "", &status));
+    EXPECT_EQ(EXIT_FAILURE, status);
+})
+
+SAFE_TEST(Variables, exportAndUnset, {
+    // Only exported variables reach programs
+    EXPECT_EQ("b\n", run_main({"./main", "-c",
+                               "A=a\nexport B=b\nprintenv A B"},
+                              ""));
+    EXPECT_EQ("a\nexport A=a\n",
+              run_main({"./main", "-c",
+                        "A=a\nexport A\nprintenv A\nexport | grep ^export.A="},
+                       ""));
+    // Set again, an exported variable stays exported
+    EXPECT_EQ("c\n", run_main({"./main", "-c",
+                               "export A=a\nA=c\nprintenv A"},
+                              ""));
+    EXPECT_EQ("[]\n", run_main({"./main", "-c",
+                                "export A=a\nunset A\nprintf [%s]\\n $A"},
+                               ""));
+    int status;
+    run_main({"./main", "-c", "export A=a\nunset A\nprintenv A"}, "",
+             &status);
+    EXPECT_EQ(EXIT_FAILURE, status);
+})
+
+/**
+ * Returns how many entries of envp are name=value
+ */
+static int count_entries(char* const* envp, const std::string& name,
+                         const std::string& value) {
+    std::string entry = name + "=" + value;
+    int count = 0;
+    for (; *envp != NULL; envp++) count += entry == *envp;
+    return count;
+}
+
+SAFE_TEST(Variables, envpKeptUpToDate, {
+    unsigned long generation = variables_generation();
+    EXPECT_EQ(variables_generation(), generation);
+    export_variable("ENVP_A", 6, "1");
+    export_variable("ENVP_B", 6, "2");
+    set_variable("ENVP_A", 6, "3");
+    EXPECT_NE(variables_generation(), generation);
+    EXPECT_EQ(environ, variables_envp());
+    EXPECT_EQ(1, count_entries(variables_envp(), "ENVP_A", "3"));
+    EXPECT_STREQ("2", getenv("ENVP_B"));
+
+    // The last entry moves into the hole
+    unset_variable("ENVP_A", 6);
+    EXPECT_EQ(0, count_entries(variables_envp(), "ENVP_A", "3"));
+    EXPECT_EQ(1, count_entries(variables_envp(), "ENVP_B", "2"));
+    EXPECT_EQ(NULL, getenv("ENVP_A"));
+
+    // A new array from setenv or unsetenv is picked up (though an entry
+    // setenv replaces in place wouldn't be)
+    setenv("ENVP_C", "4", 1);
+    EXPECT_STREQ("4", get_variable("ENVP_C", 6));
+    unsetenv("ENVP_C");
+    EXPECT_EQ(NULL, get_variable("ENVP_C", 6));
+    EXPECT_EQ(0, count_entries(variables_envp(), "ENVP_C", "4"));
+    unset_variable("ENVP_B", 6);
+    EXPECT_EQ(0, count_entries(variables_envp(), "ENVP_B", "2"));
+})
+
+SAFE_TEST(Variables, errors, {
+    int status;
+    std::string errors;
+    run_main({"./main", "-c", "export 1x=a"}, "", &status, &errors);
+    EXPECT_EQ(EXIT_FAILURE, status);
+    EXPECT_NE(std::string::npos, errors.find("`1x=a': not a valid identifier"));
+    run_main({"./main", "-c", "unset A=b"}, "", &status, &errors);
+    EXPECT_EQ(EXIT_FAILURE, status);
+    EXPECT_EQ("", run_main({"./main", "-c", "echo ${1x}"}, "", &status,
+                           &errors));
+    EXPECT_EQ(EXIT_FAILURE, status);
+    EXPECT_NE(std::string::npos, errors.find("${1x}: bad substitution"));
+})
+
+SAFE_TEST(Variables, subshellsLeaveShellAlone, {
+    EXPECT_EQ("a\n", run_main({"./main", "-c",
+                               "X=a\nX=b | true\necho $(X=c)$X"},
+                              ""));
+})
+
+/**
+ * Returns what the file at path holds
+ */
+static std::string contents_of_path(const std::string& path) {
+    std::ifstream file(path);
+    std::stringstream contents;
+    contents << file.rdbuf();
+    return contents.str();
+}
+
+SAFE_TEST(Redirect, toAndFromFiles, {
+    std::string path = file_with_contents("old\n");
+    std::string line = "echo a > " + path + "\necho b>>" + path +
+                       "\nsort -r <" + path;
+    EXPECT_EQ("b\na\n", run_main({"./main", "-c", line.c_str()}, ""));
+    EXPECT_EQ("a\nb\n", contents_of_path(path));
+    // Only creates (or empties) the file
+    line = "> " + path;
+    EXPECT_EQ("", run_main({"./main", "-c", line.c_str()}, ""));
+    EXPECT_EQ("", contents_of_path(path));
+    unlink(path.c_str());
+})
+
+SAFE_TEST(Redirect, stderrAndCopies, {
+    std::string path = file_with_contents("");
+    std::string errors;
+    std::string line = "ls /nonexistent 2> " + path;
+    EXPECT_EQ("", run_main({"./main", "-c", line.c_str()}, "", NULL,
+                           &errors));
+    EXPECT_EQ(std::string::npos, errors.find("/nonexistent:"));
+    EXPECT_NE(std::string::npos, contents_of_path(path).find("/nonexistent"));
+
+    line = "ls /nonexistent / &> " + path;
+    EXPECT_EQ("", run_main({"./main", "-c", line.c_str()}, ""));
+    std::string both = contents_of_path(path);
+    EXPECT_NE(std::string::npos, both.find("/nonexistent"));
+    EXPECT_NE(std::string::npos, both.find("tmp\n"));
+
+    // Left to right: stderr goes where stdout was, into the pipe
+    line = "ls /nonexistent 2>&1 > " + path + " | wc -l";
+    EXPECT_EQ("1\n", run_main({"./main", "-c", line.c_str()}, ""));
+    EXPECT_EQ("", contents_of_path(path));
+    line = "ls /nonexistent > " + path + " 2>&1 | wc -l";
+    EXPECT_EQ("0\n", run_main({"./main", "-c", line.c_str()}, ""));
+    EXPECT_NE(std::string::npos, contents_of_path(path).find("/nonexistent"));
+    unlink(path.c_str());
+})
+
+SAFE_TEST(Redirect, builtinsRunInTheShell, {
+    std::string path = file_with_contents("");
+    std::string line = "cd /tmp > " + path + "\npwd >> " + path +
+                       "\necho x\npwd";
+    EXPECT_EQ("x\n/tmp\n", run_main({"./main", "-c", line.c_str()}, ""));
+    EXPECT_EQ("/tmp\n", contents_of_path(path));
+
+    std::string items = file_with_contents("a b\n");
+    line = "xargs echo got < " + items;
+    EXPECT_EQ("got a b\n", run_main({"./main", "-c", line.c_str()}, ""));
+    unlink(items.c_str());
+    unlink(path.c_str());
+})
+
+SAFE_TEST(Redirect, errors, {
+    int status;
+    std::string errors;
+    EXPECT_EQ("", run_main({"./main", "-c", "cat < /nonexistent"}, "",
+                           &status, &errors));
+    EXPECT_EQ(EXIT_FAILURE, status);
+    EXPECT_NE(std::string::npos,
+              errors.find("/nonexistent: No such file or directory"));
+    run_main({"./main", "-c", "echo x >"}, "", &status, &errors);
+    EXPECT_EQ(EXIT_FAILURE, status);
+    EXPECT_NE(std::string::npos, errors.find("unexpected token `newline'"));
+    EXPECT_EQ("", run_main({"./main", "-c", "echo x 5>&1"}, "", &status));
+    EXPECT_EQ(EXIT_FAILURE, status);
+})
+
+SAFE_TEST(Spawn, programsOnlyGetStandardStreams, {
+    // Not even a descriptor the shell has open without O_CLOEXEC
+    int fd = open("/dev/null", O_RDONLY);
+    std::string output = run_main({"./main", "-c", "ls /proc/self/fd"}, "");
+    close(fd);
+    // ls's own descriptor of the directory is the 4th
+    EXPECT_EQ("0\n1\n2\n3\n", output);
+})
+
+/**
+ * Returns the parent pid in the /proc/PID/stat line stat
+ */
+static long parent_in_stat(const std::string& stat) {
+    // pid (comm) state ppid ...
+    std::istringstream fields(stat.substr(stat.rfind(')') + 2));
+    std::string state;
+    long ppid = -1;
+    fields >> state >> ppid;
+    return ppid;
+}
+
+SAFE_TEST(Exec, lastProgramReplacesShell, {
+    // run_main's child is the shell: the program took its place
+    std::string stat = run_main({"./main", "-c", "cat /proc/self/stat"}, "");
+    EXPECT_EQ(getpid(), parent_in_stat(stat));
+    std::string path = file_with_contents("true\ncat /proc/self/stat\n");
+    stat = run_main({"./main", path.c_str()}, "");
+    EXPECT_EQ(getpid(), parent_in_stat(stat));
+    unlink(path.c_str());
+
+    // Not when something comes after it
+    stat = run_main({"./main", "-c", "cat /proc/self/stat\ntrue"}, "");
+    EXPECT_NE(getpid(), parent_in_stat(stat));
+    stat = run_main({"./main", "-c", "cat /proc/self/stat | cat"}, "");
+    EXPECT_NE(getpid(), parent_in_stat(stat));
+
+    // Its exit status is the shell's
+    int status;
+    run_main({"./main", "-c", "ls /nonexistent"}, "", &status);
+    EXPECT_EQ(2, status);
+    EXPECT_EQ("x\n", run_main({"./main", "-c", "echo $(echo x)"}, ""));
+})
+
+SAFE_TEST(Exec, builtin, {
+    std::string stat = run_main(
+        {"./main", "-c", "exec cat /proc/self/stat\necho not reached"}, "");
+    EXPECT_EQ(getpid(), parent_in_stat(stat));
+    EXPECT_EQ(std::string::npos, stat.find("not reached"));
+
+    int status;
+    std::string errors;
+    EXPECT_EQ("Command nonexistent not found!\nafter\n",
+              run_main({"./main", "-c", "exec nonexistent\necho after"}, "",
+                       &status, &errors));
+    EXPECT_EQ(EXIT_SUCCESS, status);
+
+    // Only redirections: they stay
+    std::string path = file_with_contents("");
+    std::string line = "echo before\nexec > " + path + "\necho x\npwd -P";
+    EXPECT_EQ("before\n", run_main({"./main", "-c", line.c_str()}, ""));
+    EXPECT_EQ("x\n" + std::filesystem::current_path().string() + "\n",
+              contents_of_path(path));
+    unlink(path.c_str());
+})
+
+/**
+ * Executes line with backend, returning what execute returned
+ */
+static int execute_with(spawn_backend backend, std::string line) {
+    set_spawn_backend(backend);
+    command* cmd = parse(&line[0]);
+    int status = execute(cmd);
+    cleanup(cmd);
+    set_spawn_backend(SPAWN_VFORK);
+    return status;
+}
+
+/**
+ * Starts line's program (a full path) from fd with backend, returning its
+ * exit status, or -1 if it could not be started
+ */
+static int exit_status_of(spawn_backend backend, std::string line, int fd) {
+    set_spawn_backend(backend);
+    command* cmd = parse(&line[0]);
+    pid_t pid = spawn_command(cmd, fd, NULL);
+    cleanup(cmd);
+    set_spawn_backend(SPAWN_VFORK);
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid) return -1;
+    return WEXITSTATUS(status);
+}
+
+SAFE_TEST(Spawn, vforkRunsPrograms, {
+    EXPECT_EQ(SUCCESS, execute_with(SPAWN_VFORK, "true"));
+    EXPECT_EQ(ERROR, execute_with(SPAWN_VFORK, "false"));
+    EXPECT_EQ(SUCCESS, execute_with(SPAWN_VFORK, "test -d /tmp"));
+})
+
+SAFE_TEST(Spawn, posixSpawnRunsPrograms, {
+    EXPECT_EQ(SUCCESS, execute_with(SPAWN_POSIX_SPAWN, "true"));
+    EXPECT_EQ(ERROR, execute_with(SPAWN_POSIX_SPAWN, "false"));
+    EXPECT_EQ(SUCCESS, execute_with(SPAWN_POSIX_SPAWN, "test -d /tmp"));
+})
+
+SAFE_TEST(Spawn, forkRunsPrograms, {
+    EXPECT_EQ(SUCCESS, execute_with(SPAWN_FORK, "true"));
+    EXPECT_EQ(ERROR, execute_with(SPAWN_FORK, "false"));
+    EXPECT_EQ(SUCCESS, execute_with(SPAWN_FORK, "test -d /tmp"));
+})
+
+SAFE_TEST(Spawn, reportsExecFailure, {
+    // Executable, but not in any format the kernel can run
+    std::string path = file_with_contents("not a program");
+    chmod(path.c_str(), 0755);
+    command* cmd = parse(&path[0]);
+    errno = 0;
+    EXPECT_EQ(-1, spawn_command(cmd, -1, NULL));
+    EXPECT_EQ(ENOEXEC, errno);
+    set_spawn_backend(SPAWN_POSIX_SPAWN);
+    errno = 0;
+    EXPECT_EQ(-1, spawn_command(cmd, -1, NULL));
+    EXPECT_EQ(ENOEXEC, errno);
+    set_spawn_backend(SPAWN_VFORK);
+    cleanup(cmd);
+    unlink(path.c_str());
+})
+
+SAFE_TEST(Spawn, launchesFromDescriptor, {
+    // argv[0] names no file at all, so only the descriptor can be run
+    int fd = open("/usr/bin/false", O_PATH | O_CLOEXEC);
+    EXPECT_EQ(1, exit_status_of(SPAWN_VFORK, "/nonexistent/false", fd));
+    EXPECT_EQ(1, exit_status_of(SPAWN_FORK, "/nonexistent/false", fd));
+    close(fd);
+})
+
+SAFE_TEST(Spawn, scriptFromDescriptorRunsByPath, {
+    std::string path = file_with_contents("#!/bin/sh\nexit 3\n");
+    chmod(path.c_str(), 0755);
+    int fd = open(path.c_str(), O_PATH | O_CLOEXEC);
+    EXPECT_EQ(3, exit_status_of(SPAWN_VFORK, path, fd));
+    close(fd);
+    unlink(path.c_str());
+})
+
 /**
  * Checks whether the stdout of ./main < data/in*.txt is the same as the
  * contents of data/out*.txt
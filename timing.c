@@ -0,0 +1,257 @@
+#include "timing.h"
+
+#include <sys/resource.h>
+#include <time.h>
+
+#include "builtins.h"
+#include "jobs.h"
+#include "pipeline.h"
+#include "variables.h"
+
+/**
+ * timing.c - The time prefix
+ *
+ * waitpid only tells the shell how a child ended. wait4 also returns the
+ * child's own rusage, so reaping every process of the timed command with it
+ * gives exact figures for each of them, without the noise of whatever else
+ * the shell ran (as getrusage(RUSAGE_CHILDREN) would have).
+ */
+
+// What time reports about a command, or one stage of it
+typedef struct {
+    double real;
+    double user;
+    double sys;
+    long maxrss;
+    long majflt;
+    long minflt;
+    long nvcsw;
+    long nivcsw;
+} time_figures;
+
+// Suffixes of the variables holding the figures, in the order of time_figures
+static const char* const FIGURE_NAMES[] = {
+    "REAL", "USER", "SYS", "MAXRSS", "MAJFLT", "MINFLT", "NVCSW", "NIVCSW",
+};
+
+static const int FIGURE_COUNT = sizeof(FIGURE_NAMES) / sizeof(FIGURE_NAMES[0]);
+
+// Longest text of one figure
+#define FIGURE_TEXT_SIZE 32
+
+// Checks cmd's first argument
+bool is_timed(const command* cmd) {
+    return cmd->argc > 0 && strcmp(cmd->argv[0], TIME_TOKEN) == 0;
+}
+
+// Seconds in t
+static double seconds_of(const struct timeval* t) {
+    return t->tv_sec + t->tv_usec / 1e6;
+}
+
+// Seconds from start to now
+static double seconds_since(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Sets figures (but real) from usage
+static void set_usage(time_figures* figures, const struct rusage* usage) {
+    figures->user = seconds_of(&usage->ru_utime);
+    figures->sys = seconds_of(&usage->ru_stime);
+    figures->maxrss = usage->ru_maxrss;
+    figures->majflt = usage->ru_majflt;
+    figures->minflt = usage->ru_minflt;
+    figures->nvcsw = usage->ru_nvcsw;
+    figures->nivcsw = usage->ru_nivcsw;
+}
+
+// Adds stage's figures (but real) to total; maxrss is the larger of the two
+static void add_figures(time_figures* total, const time_figures* stage) {
+    total->user += stage->user;
+    total->sys += stage->sys;
+    if (stage->maxrss > total->maxrss) total->maxrss = stage->maxrss;
+    total->majflt += stage->majflt;
+    total->minflt += stage->minflt;
+    total->nvcsw += stage->nvcsw;
+    total->nivcsw += stage->nivcsw;
+}
+
+// Writes figure which (an index into FIGURE_NAMES) of figures to text
+static void format_figure(const time_figures* figures, int which, char* text) {
+    const double seconds[] = {figures->real, figures->user, figures->sys};
+    const long counts[] = {figures->maxrss, figures->majflt, figures->minflt,
+                           figures->nvcsw, figures->nivcsw};
+    if (which < 3)
+        snprintf(text, FIGURE_TEXT_SIZE, "%.3f", seconds[which]);
+    else
+        snprintf(text, FIGURE_TEXT_SIZE, "%ld", counts[which - 3]);
+}
+
+// Leaves the figures in TIME_* and those of each stage in TIME_STAGE_*,
+// shell variables that aren't exported unless the script exports them
+static void set_variables(const time_figures* total,
+                          const time_figures* stages, int count) {
+    char name[FIGURE_TEXT_SIZE];
+    char* list = new char[count * (FIGURE_TEXT_SIZE + 1) + 1];
+    for (int which = 0; which < FIGURE_COUNT; which++) {
+        format_figure(total, which, list);
+        snprintf(name, sizeof(name), "TIME_%s", FIGURE_NAMES[which]);
+        set_variable(name, strlen(name), list);
+
+        char* end = list;
+        *end = '\0';
+        for (int i = 0; i < count; i++) {
+            if (i > 0) *end++ = ' ';
+            format_figure(&stages[i], which, end);
+            end += strlen(end);
+        }
+        snprintf(name, sizeof(name), "TIME_STAGE_%s", FIGURE_NAMES[which]);
+        set_variable(name, strlen(name), list);
+    }
+    delete[] list;
+}
+
+// Prints seconds as bash does, e.g. "real\t0m1.204s"
+static void print_clock(const char* label, double seconds) {
+    long minutes = seconds / 60;
+    fprintf(stderr, "%s\t%ldm%.3fs\n", label, minutes, seconds - minutes * 60);
+}
+
+// Prints the words of stage (counting from 0) of the pipeline cmd
+static void print_stage_words(const command* cmd, int stage) {
+    const char* separator = "";
+    for (int i = 0; i < cmd->argc; i++) {
+        if (strcmp(cmd->argv[i], PIPE_TOKEN) == 0) {
+            stage--;
+        } else if (stage == 0) {
+            fprintf(stderr, "%s%s", separator, cmd->argv[i]);
+            separator = " ";
+        }
+    }
+}
+
+// Prints the report on the timed command cmd
+static void report(const command* cmd, bool posix, const time_figures* total,
+                   const time_figures* stages, int count) {
+    // Whatever the command printed comes first
+    fflush(stdout);
+    if (posix) {
+        fprintf(stderr, "real %.2f\nuser %.2f\nsys %.2f\n", total->real,
+                total->user, total->sys);
+        return;
+    }
+
+    fprintf(stderr, "\n");
+    print_clock("real", total->real);
+    print_clock("user", total->user);
+    print_clock("sys", total->sys);
+    fprintf(stderr, "maxrss\t%ld KiB\n", total->maxrss);
+    fprintf(stderr, "faults\t%ld major, %ld minor\n", total->majflt,
+            total->minflt);
+    fprintf(stderr, "ctxsw\t%ld voluntary, %ld involuntary\n", total->nvcsw,
+            total->nivcsw);
+    if (count < 2) return;
+
+    fprintf(stderr, "%-6s%9s%9s%9s%11s%8s%8s%8s%8s  %s\n", "stage", "real",
+            "user", "sys", "maxrss", "majflt", "minflt", "nvcsw", "nivcsw",
+            "command");
+    for (int i = 0; i < count; i++) {
+        const time_figures* stage = &stages[i];
+        fprintf(stderr, "%-6d%8.3fs%8.3fs%8.3fs%7ld KiB%8ld%8ld%8ld%8ld  ",
+                i + 1, stage->real, stage->user, stage->sys, stage->maxrss,
+                stage->majflt, stage->minflt, stage->nvcsw, stage->nivcsw);
+        print_stage_words(cmd, i);
+        fprintf(stderr, "\n");
+    }
+}
+
+// Runs cmd (through execute) and sets total from the shell's usage and its
+// children's before and after
+static int run_as_a_whole(command* cmd, time_figures* total) {
+    struct rusage self_before, children_before, self, children;
+    getrusage(RUSAGE_SELF, &self_before);
+    getrusage(RUSAGE_CHILDREN, &children_before);
+    int status = cmd->argc > 0 ? execute(cmd) : SUCCESS;
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+
+    time_figures before, after;
+    set_usage(&before, &self_before);
+    set_usage(&after, &self);
+    time_figures children_figures;
+    set_usage(&children_figures, &children_before);
+    add_figures(&before, &children_figures);
+    set_usage(&children_figures, &children);
+    add_figures(&after, &children_figures);
+
+    total->user = after.user - before.user;
+    total->sys = after.sys - before.sys;
+    // A peak can't be split up: this is the shell's own
+    total->maxrss = self.ru_maxrss;
+    total->majflt = after.majflt - before.majflt;
+    total->minflt = after.minflt - before.minflt;
+    total->nvcsw = after.nvcsw - before.nvcsw;
+    total->nivcsw = after.nivcsw - before.nivcsw;
+    return status;
+}
+
+// time [-p] command
+int execute_timed(command* cmd) {
+    bool posix = cmd->argc > 1 && strcmp(cmd->argv[1], "-p") == 0;
+    int skipped = posix ? 2 : 1;
+    command* timed =
+        create_command_from_args(cmd->argc - skipped, cmd->argv + skipped);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    time_figures total;
+    memset(&total, 0, sizeof(total));
+    time_figures* stages;
+    int count = 1;
+    int status;
+
+    // Only processes started here can be reaped with wait4; built-ins and
+    // assignments run in the shell itself, and jobs and nested times reap
+    // their own
+    bool whole = timed->argc == 0 || is_timed(timed) ||
+                 has_background(timed) ||
+                 (!is_pipeline(timed) &&
+                  (find_builtin(timed) != NULL || is_assignment(timed)));
+    if (whole) {
+        status = run_as_a_whole(timed, &total);
+        total.real = seconds_since(&start);
+        stages = new time_figures[1];
+        stages[0] = total;
+    } else {
+        // A command without | is a pipeline of one
+        pid_t* pids = start_pipeline(timed, -1, -1, &count);
+        if (pids == NULL) {
+            cleanup(timed);
+            return ERROR;
+        }
+        stage_usage* usage = new stage_usage[count];
+        int last_status = wait_pipeline(pids, count, &start, usage);
+        total.real = seconds_since(&start);
+        status = last_status != -1 && WIFEXITED(last_status) &&
+                         WEXITSTATUS(last_status) == 0
+                     ? SUCCESS
+                     : ERROR;
+
+        stages = new time_figures[count];
+        for (int i = 0; i < count; i++) {
+            stages[i].real = usage[i].real;
+            set_usage(&stages[i], &usage[i].usage);
+            add_figures(&total, &stages[i]);
+        }
+        delete[] usage;
+        delete[] pids;
+    }
+
+    report(timed, posix, &total, stages, count);
+    set_variables(&total, stages, count);
+    delete[] stages;
+    cleanup(timed);
+    return status;
+}
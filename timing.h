@@ -0,0 +1,52 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include "shell.h"
+
+// First argument of a timed command
+#define TIME_TOKEN "time"
+
+/**
+ * Returns true if cmd starts with time (see execute_timed).
+ *
+ * @param cmd
+ * @return true | false
+ */
+bool is_timed(const command* cmd);
+
+/**
+ * Runs cmd, "time [-p] command" (e.g. "time sort big.txt | uniq -c"), and
+ * reports on stderr how long the command took and what it used, as bash's
+ * time keyword does:
+ *
+ *   real    0m1.204s
+ *   user    0m0.913s
+ *   sys     0m0.120s
+ *   maxrss  10240 KiB
+ *   faults  0 major, 2473 minor
+ *   ctxsw   12 voluntary, 35 involuntary
+ *
+ * Every process of an external command or a pipeline is reaped with wait4,
+ * which hands back its own resource usage; a pipeline's user and sys time,
+ * faults and context switches are the sums over its stages, and maxrss is
+ * the largest of them (the kernel counts a process's peak from before its
+ * execve, so it can include some of the shell's own memory). A pipeline is
+ * followed by a line per stage, with the same figures for that stage alone.
+ * Built-ins, assignments (which set the variables in the shell itself) and
+ * commands with & are timed as a whole, from getrusage of the shell and its
+ * reaped children. With -p, only real, user and sys are
+ * reported, in the POSIX format ("real 1.20").
+ *
+ * The figures are also left in shell variables (not exported, so the
+ * programs started afterwards don't get them), for scripts to read:
+ * TIME_REAL, TIME_USER and TIME_SYS in seconds, TIME_MAXRSS in KiB,
+ * TIME_MAJFLT, TIME_MINFLT, TIME_NVCSW and TIME_NIVCSW, and the same for each
+ * stage in TIME_STAGE_REAL, TIME_STAGE_USER, ..., one space-separated entry
+ * per stage.
+ *
+ * @param cmd
+ * @return the status of the command | SUCCESS if there is none
+ */
+int execute_timed(command* cmd);
+
+#endif  // TIMING_H
@@ -0,0 +1,452 @@
+#include "variables.h"
+
+#include "substitution.h"
+
+/**
+ * variables.c - Shell variables
+ *
+ * Variables live in an open-addressing hash table (linear probing,
+ * power-of-two capacity) looked up by a name and its length, so $NAME is
+ * found straight from the argument it is in, without copying the name out.
+ *
+ * Names are interned: the first time a name is set, it is copied once into a
+ * chunk of names that is never moved or freed, and its slot keeps it for
+ * good (unset only drops the value). Setting a variable again, or unsetting
+ * and setting it in a loop, never copies its name or moves a slot, and a
+ * value is only reallocated when it outgrows its buffer.
+ *
+ * A value is kept as "NAME=value", so the entry of an exported variable can
+ * go into envp as it is. envp lists every exported variable that is set, and
+ * environ points at it: programs are started with it, and getenv reads it.
+ * It is only touched when a variable is exported, unset or changed, and then
+ * only at that variable's entry (an unset moves the last entry into the hole,
+ * as order doesn't matter), never rebuilt from the table. Each change counts
+ * up a generation, so what is worked out from envp can be kept until then.
+ *
+ * Changing the environment other than through this file (setenv, unsetenv,
+ * putenv) is not supported; the shell never does. The table only checks what
+ * costs nothing to check: that environ still points at envp, and that its
+ * last entry wasn't shifted down. A setenv adding a name, or an unsetenv
+ * (which swap or shift the array), is imported afresh, but a setenv that
+ * replaces an exported variable's entry in place goes unnoticed.
+ */
+
+extern char** environ;
+
+// Initial number of slots, must be a power of two
+#define VARIABLES_INITIAL_CAPACITY 64
+
+// Size of a chunk of interned names (a longer name gets a chunk of its own)
+#define VARIABLE_NAMES_CHUNK_SIZE 4096
+
+typedef struct {
+    // Interned and null-terminated, NULL for an empty slot
+    const char* name;
+    size_t len;
+    unsigned int hash;
+    // "NAME=value", NULL while the variable is not set
+    char* entry;
+    size_t entry_capacity;
+    bool exported;
+    // Index of entry in envp, or -1 when not in envp
+    int envp_index;
+} variable;
+
+// A chunk of interned names, which follow the header
+typedef struct name_chunk {
+    struct name_chunk* next;
+    size_t used;
+    size_t size;
+} name_chunk;
+
+static struct {
+    variable* slots;
+    int capacity;
+    // Slots with a name, whether it is set or not
+    int count;
+    // The chunk names are added to, then the older ones
+    name_chunk* names;
+
+    // The entries of the exported variables that are set, NULL-terminated,
+    // and the slot of each one
+    char** envp;
+    int* envp_slots;
+    int envp_count;
+    int envp_capacity;
+    // Counted up at every change to envp
+    unsigned long generation;
+} table;
+
+// $0, $1... (see set_positional_parameters)
+static struct {
+    const char* const* args;
+    int count;
+} positional;
+
+// FNV-1a hash of the len chars of name
+static unsigned int hash_name(const char* name, size_t len) {
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Returns a copy of the len chars of name that stays where it is for good
+static const char* intern(const char* name, size_t len) {
+    name_chunk* chunk = table.names;
+    if (chunk == NULL || chunk->used + len + 1 > chunk->size) {
+        size_t size = len + 1 > VARIABLE_NAMES_CHUNK_SIZE
+                          ? len + 1
+                          : VARIABLE_NAMES_CHUNK_SIZE;
+        chunk = reinterpret_cast<name_chunk*>(
+            new char[sizeof(name_chunk) + size]);
+        chunk->next = table.names;
+        chunk->used = 0;
+        chunk->size = size;
+        table.names = chunk;
+    }
+    char* copy = reinterpret_cast<char*>(chunk + 1) + chunk->used;
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+    chunk->used += len + 1;
+    return copy;
+}
+
+// Returns the slot of name, or the empty slot where it would go
+static variable* find_slot(const char* name, size_t len, unsigned int hash) {
+    unsigned int mask = table.capacity - 1;
+    for (unsigned int i = hash & mask;; i = (i + 1) & mask) {
+        variable* v = &table.slots[i];
+        if (v->name == NULL || (v->hash == hash && v->len == len &&
+                                memcmp(v->name, name, len) == 0))
+            return v;
+    }
+}
+
+// Doubles the number of slots (or allocates the first ones), rehashing every
+// variable into its new place
+static void grow() {
+    variable* old = table.slots;
+    int old_capacity = table.capacity;
+
+    table.capacity = old_capacity == 0 ? VARIABLES_INITIAL_CAPACITY
+                                       : old_capacity * 2;
+    table.slots = new variable[table.capacity];
+    memset(table.slots, 0, table.capacity * sizeof(variable));
+
+    for (int i = 0; i < old_capacity; i++) {
+        if (old[i].name == NULL) continue;
+        variable* v = find_slot(old[i].name, old[i].len, old[i].hash);
+        *v = old[i];
+        if (v->envp_index >= 0)
+            table.envp_slots[v->envp_index] = v - table.slots;
+    }
+    delete[] old;
+}
+
+// Returns the slot of name, giving it one (and interning the name) if it
+// has none yet
+static variable* slot_of(const char* name, size_t len) {
+    // Keep the table at most half full, so probe runs stay short
+    if (2 * (table.count + 1) > table.capacity) grow();
+
+    unsigned int hash = hash_name(name, len);
+    variable* v = find_slot(name, len, hash);
+    if (v->name == NULL) {
+        v->name = intern(name, len);
+        v->len = len;
+        v->hash = hash;
+        v->envp_index = -1;
+        table.count++;
+    }
+    return v;
+}
+
+// Makes room in envp for count entries and its NULL
+static void reserve_envp(int count) {
+    if (count + 1 <= table.envp_capacity) return;
+    int capacity = table.envp_capacity > 0 ? table.envp_capacity * 2 : 64;
+    while (capacity < count + 1) capacity *= 2;
+
+    char** envp = new char*[capacity];
+    int* slots = new int[capacity];
+    if (table.envp_count > 0) {
+        memcpy(envp, table.envp, table.envp_count * sizeof(char*));
+        memcpy(slots, table.envp_slots, table.envp_count * sizeof(int));
+    }
+    envp[table.envp_count] = NULL;
+    delete[] table.envp;
+    delete[] table.envp_slots;
+    table.envp = envp;
+    table.envp_slots = slots;
+    table.envp_capacity = capacity;
+    environ = table.envp;
+}
+
+// Adds v's entry to the end of envp
+static void add_to_envp(variable* v) {
+    reserve_envp(table.envp_count + 1);
+    v->envp_index = table.envp_count++;
+    table.envp[v->envp_index] = v->entry;
+    table.envp_slots[v->envp_index] = v - table.slots;
+    table.envp[table.envp_count] = NULL;
+    table.generation++;
+}
+
+// Takes v's entry out of envp, moving the last entry into its place
+static void remove_from_envp(variable* v) {
+    int last = --table.envp_count;
+    int index = v->envp_index;
+    table.envp[index] = table.envp[last];
+    table.envp_slots[index] = table.envp_slots[last];
+    table.slots[table.envp_slots[index]].envp_index = index;
+    table.envp[last] = NULL;
+    v->envp_index = -1;
+    table.generation++;
+}
+
+// Sets v to value, reusing its entry when the value fits, and keeps envp up
+// to date
+static void set_value(variable* v, const char* value) {
+    size_t size = v->len + 1 + strlen(value) + 1;
+    if (v->entry_capacity < size) {
+        char* entry = new char[size];
+        memcpy(entry, v->name, v->len);
+        entry[v->len] = '=';
+        delete[] v->entry;
+        v->entry = entry;
+        v->entry_capacity = size;
+    }
+    memcpy(v->entry + v->len + 1, value, size - v->len - 1);
+
+    if (v->envp_index >= 0) {
+        table.envp[v->envp_index] = v->entry;
+        table.generation++;
+    } else if (v->exported) {
+        add_to_envp(v);
+    }
+}
+
+// Removes v's value, and its entry from envp
+static void drop_value(variable* v) {
+    if (v->envp_index >= 0) remove_from_envp(v);
+    delete[] v->entry;
+    v->entry = NULL;
+    v->entry_capacity = 0;
+}
+
+// Takes the table's exported variables from environ, the environment the
+// shell was started with or an array setenv or unsetenv swapped in
+static void import_environment() {
+    if (table.capacity == 0) grow();
+
+    // environ may be envp itself, which is about to be refilled
+    int count = 0;
+    while (environ[count] != NULL) count++;
+    char** imported = new char*[count];
+    memcpy(imported, environ, count * sizeof(char*));
+
+    for (int i = 0; i < table.envp_count; i++)
+        table.slots[table.envp_slots[i]].envp_index = -1;
+    table.envp_count = 0;
+    reserve_envp(count);
+    for (int i = 0; i < count; i++) {
+        const char* equals = strchr(imported[i], '=');
+        if (equals == NULL) continue;
+        variable* v = slot_of(imported[i], equals - imported[i]);
+        // As for getenv, the first of the same name counts
+        if (v->envp_index >= 0) continue;
+        v->exported = true;
+        if (v->entry == imported[i])
+            add_to_envp(v);
+        else
+            set_value(v, equals + 1);
+    }
+    table.envp[table.envp_count] = NULL;
+
+    // Exported variables environ no longer has were unset
+    for (int i = 0; i < table.capacity; i++) {
+        variable* v = &table.slots[i];
+        if (v->exported && v->entry != NULL && v->envp_index < 0) {
+            drop_value(v);
+            v->exported = false;
+        }
+    }
+    delete[] imported;
+    environ = table.envp;
+}
+
+// Imports environ on first use, and whenever it is plainly no longer envp
+// as the table left it: another array, or one entry short. Each entry isn't
+// checked, as this runs at every lookup and every launch
+static void sync_environment() {
+    bool in_sync = table.capacity > 0 && environ == table.envp &&
+                   (table.envp_count == 0 ||
+                    table.envp[table.envp_count - 1] != NULL);
+    if (!in_sync) import_environment();
+}
+
+// Letters, digits and underscores, not starting with a digit
+size_t variable_name_length(const char* p) {
+    if (!isalpha((unsigned char)*p) && *p != '_') return 0;
+    size_t len = 1;
+    while (isalnum((unsigned char)p[len]) || p[len] == '_') len++;
+    return len;
+}
+
+// Looks name up, without adding it
+const char* get_variable(const char* name, size_t len) {
+    sync_environment();
+    variable* v = find_slot(name, len, hash_name(name, len));
+    return v->entry != NULL ? v->entry + v->len + 1 : NULL;
+}
+
+// NAME=value
+void set_variable(const char* name, size_t len, const char* value) {
+    sync_environment();
+    set_value(slot_of(name, len), value);
+}
+
+// export NAME[=value]
+void export_variable(const char* name, size_t len, const char* value) {
+    sync_environment();
+    variable* v = slot_of(name, len);
+    v->exported = true;
+    if (value != NULL)
+        set_value(v, value);
+    else if (v->entry != NULL && v->envp_index < 0)
+        add_to_envp(v);
+}
+
+// unset NAME: the name keeps its slot, for when it is set again
+bool unset_variable(const char* name, size_t len) {
+    sync_environment();
+    variable* v = find_slot(name, len, hash_name(name, len));
+    if (v->name == NULL) return false;
+    v->exported = false;
+    if (v->entry == NULL) return false;
+    drop_value(v);
+    return true;
+}
+
+// The exported variables, kept ready
+char* const* variables_envp() {
+    sync_environment();
+    return table.envp;
+}
+
+// Counted up by every change to envp
+unsigned long variables_generation() {
+    sync_environment();
+    return table.generation;
+}
+
+// The arguments are kept where they are, as they outlive the shell's run
+void set_positional_parameters(int count, const char* const* args) {
+    positional.args = args;
+    positional.count = count;
+}
+
+// $n
+const char* get_positional_parameter(int n) {
+    return n < positional.count ? positional.args[n] : NULL;
+}
+
+// $#, which leaves $0 out
+int positional_parameter_count() {
+    return positional.count > 0 ? positional.count - 1 : 0;
+}
+
+// Checks that every argument is NAME=value
+bool is_assignment(const command* cmd) {
+    for (int i = 0; i < cmd->argc; i++) {
+        size_t len = variable_name_length(cmd->argv[i]);
+        if (len == 0 || cmd->argv[i][len] != '=') return false;
+    }
+    return cmd->argc > 0;
+}
+
+// NAME=value..., each value expanded in one piece, after the assignments
+// before it
+int assign_variables(const command* cmd) {
+    for (int i = 0; i < cmd->argc; i++) {
+        const char* arg = cmd->argv[i];
+        size_t len = variable_name_length(arg);
+        const char* value = arg + len + 1;
+        if (!word_has_expansion(value)) {
+            set_variable(arg, len, value);
+            continue;
+        }
+        char* expanded = expand_word(value);
+        if (expanded == NULL) return ERROR;
+        set_variable(arg, len, expanded);
+        delete[] expanded;
+    }
+    return SUCCESS;
+}
+
+// Orders variables by name, for qsort
+static int compare_names(const void* a, const void* b) {
+    return strcmp((*static_cast<variable* const*>(a))->name,
+                  (*static_cast<variable* const*>(b))->name);
+}
+
+// Prints "export NAME=value" for every exported variable, sorted by name
+static void list_exported() {
+    sync_environment();
+    variable** exported = new variable*[table.count];
+    int count = 0;
+    for (int i = 0; i < table.capacity; i++)
+        if (table.slots[i].name != NULL && table.slots[i].exported)
+            exported[count++] = &table.slots[i];
+    qsort(exported, count, sizeof(variable*), compare_names);
+
+    for (int i = 0; i < count; i++) {
+        if (exported[i]->entry != NULL)
+            printf("export %s\n", exported[i]->entry);
+        else
+            printf("export %s\n", exported[i]->name);
+    }
+    delete[] exported;
+}
+
+// export [-p] [name[=value]...]
+int builtin_export(command* cmd) {
+    bool list = cmd->argc == 1 ||
+                (cmd->argc == 2 && strcmp(cmd->argv[1], "-p") == 0);
+    if (list) {
+        list_exported();
+        return SUCCESS;
+    }
+
+    int status = SUCCESS;
+    for (int i = 1; i < cmd->argc; i++) {
+        const char* arg = cmd->argv[i];
+        size_t len = variable_name_length(arg);
+        if (len == 0 || (arg[len] != '\0' && arg[len] != '=')) {
+            fprintf(stderr, "export: `%s': not a valid identifier\n", arg);
+            status = ERROR;
+            continue;
+        }
+        export_variable(arg, len, arg[len] == '=' ? arg + len + 1 : NULL);
+    }
+    return status;
+}
+
+// unset name...
+int builtin_unset(command* cmd) {
+    int status = SUCCESS;
+    for (int i = 1; i < cmd->argc; i++) {
+        const char* arg = cmd->argv[i];
+        size_t len = variable_name_length(arg);
+        if (len == 0 || arg[len] != '\0') {
+            fprintf(stderr, "unset: `%s': not a valid identifier\n", arg);
+            status = ERROR;
+            continue;
+        }
+        unset_variable(arg, len);
+    }
+    return status;
+}
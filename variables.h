@@ -0,0 +1,154 @@
+#ifndef VARIABLES_H
+#define VARIABLES_H
+
+#include "shell.h"
+
+/**
+ * Shell variables: NAME=value sets one in the shell, export makes it part of
+ * the environment programs are started with, and unset removes it. $NAME and
+ * ${NAME} in a command's arguments are replaced by the value (see
+ * substitution.h). Names are letters, digits and underscores, not starting
+ * with a digit.
+ *
+ * The variables of the environment the shell was started with are there from
+ * the start, exported. The exported variables make up the process
+ * environment: environ points at the envp the table keeps (see
+ * variables_envp), so getenv sees them too. The environment is only to be
+ * changed through these functions: a setenv replacing a variable's value in
+ * place isn't seen by the table.
+ */
+
+/**
+ * Returns the length of the variable name p starts with.
+ *
+ * @param p
+ * @return size_t number of chars of the name | 0 if p doesn't start one
+ */
+size_t variable_name_length(const char* p);
+
+/**
+ * Returns the value of the variable name.
+ *
+ * @param name the name, which needn't be null-terminated (e.g. the NAME of
+ * "$NAME/bin" inside an argument)
+ * @param len number of chars of name
+ * @return const char* value, valid until the variable next changes | NULL if
+ * it is not set
+ */
+const char* get_variable(const char* name, size_t len);
+
+/**
+ * Sets the variable name to value, in the environment too if it is exported.
+ *
+ * @param name a valid name, needn't be null-terminated
+ * @param len number of chars of name
+ * @param value
+ * @return void
+ */
+void set_variable(const char* name, size_t len, const char* value);
+
+/**
+ * Exports the variable name, setting it to value first unless value is NULL.
+ * A name exported without ever being set stays out of the environment until
+ * it is.
+ *
+ * @param name a valid name, needn't be null-terminated
+ * @param len number of chars of name
+ * @param value
+ * @return void
+ */
+void export_variable(const char* name, size_t len, const char* value);
+
+/**
+ * Removes the variable name, from the environment too.
+ *
+ * @param name a valid name, needn't be null-terminated
+ * @param len number of chars of name
+ * @return true (it was set) | false
+ */
+bool unset_variable(const char* name, size_t len);
+
+/**
+ * Returns the exported variables that are set, as "NAME=value" strings
+ * followed by NULL, for execve. The array is kept up to date as variables
+ * change rather than built for each call, so this costs nothing; it stays
+ * valid until the next change to a variable.
+ *
+ * @return char* const* envp, also what environ points to
+ */
+char* const* variables_envp();
+
+/**
+ * Returns a number that changes whenever variables_envp does (a variable is
+ * exported, unset or changes value while exported), so anything worked out
+ * from it can be kept until then.
+ *
+ * @return unsigned long
+ */
+unsigned long variables_generation();
+
+/**
+ * Sets the positional parameters: $0 is args[0] (the script, or the shell),
+ * $1 to $N the arguments after it, and $# is N. They are replaced like
+ * variables, ${10} and up only in braces.
+ *
+ * @param count number of args, N + 1
+ * @param args kept as they are (e.g. main's argv), not copied
+ * @return void
+ */
+void set_positional_parameters(int count, const char* const* args);
+
+/**
+ * Returns the positional parameter $n.
+ *
+ * @param n
+ * @return const char* | NULL if there are fewer than n
+ */
+const char* get_positional_parameter(int n);
+
+/**
+ * Returns the number of positional parameters after $0, $#.
+ *
+ * @return int
+ */
+int positional_parameter_count();
+
+/**
+ * Returns true if every argument of cmd is an assignment, NAME=value. This
+ * is told from the arguments as they were typed, before any expansion.
+ *
+ * @param cmd
+ * @return true | false
+ */
+bool is_assignment(const command* cmd);
+
+/**
+ * Carries out the assignments of cmd, in order (see is_assignment). The
+ * expansions in a value are replaced first, and what they come to is kept in
+ * one piece (see expand_word), so X=$(echo a b) sets X to "a b".
+ *
+ * @param cmd
+ * @return SUCCESS | ERROR (an expansion in a value is bad, the assignments
+ * after it are not carried out)
+ */
+int assign_variables(const command* cmd);
+
+/**
+ * export [-p] [name[=value]...]: exports each name, set to value if given.
+ * Without names, lists the exported variables as "export NAME=value" lines,
+ * sorted by name.
+ *
+ * @param cmd
+ * @return SUCCESS | ERROR (a name was not valid)
+ */
+int builtin_export(command* cmd);
+
+/**
+ * unset name...: removes each variable name.
+ *
+ * @param cmd
+ * @return SUCCESS | ERROR (a name was not valid)
+ */
+int builtin_unset(command* cmd);
+
+#endif  // VARIABLES_H
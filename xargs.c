@@ -0,0 +1,248 @@
+#include "xargs.h"
+
+#include <limits.h>
+
+#include "line_reader.h"
+#include "parallel.h"
+#include "variables.h"
+
+/**
+ * xargs.c - Running a command on many items with few processes
+ *
+ * Items are packed into the argument list of a command until it is as long as
+ * the kernel takes, so e.g. 100,000 file names cost a handful of rm processes
+ * rather than 100,000 of them. Every full batch goes straight to a parallel
+ * run (see parallel.h), which with -P starts it while the next one is filled.
+ */
+
+// Separators of items without -0
+static const char BLANKS[] = " \t";
+
+// The command and initial arguments, and the items gathered for their next run
+typedef struct {
+    char** args;
+    int count;
+    int capacity;
+    // Leading args that are the command and its initial arguments
+    int fixed;
+    // The chars of the items, back to back
+    char* strings;
+    size_t used;
+    // Argument bytes of args so far, counted as in xargs_batch_limit
+    size_t bytes;
+    size_t limit;
+    // Most items in a batch, or 0 for as many as fit
+    int max_items;
+    // The command's words, for the joblog of the run
+    char* text;
+    // Batches started
+    long runs;
+} xargs_batch;
+
+// Bytes an argument of len chars takes out of the batch limit
+static size_t argument_bytes(size_t len) {
+    return len + 1 + sizeof(char*);
+}
+
+size_t xargs_batch_limit() {
+    long arg_max = sysconf(_SC_ARG_MAX);
+    if (arg_max <= 0) arg_max = _POSIX_ARG_MAX;
+
+    // Added up again only once the environment has changed
+    static size_t environment = 0;
+    static unsigned long counted = 0;
+    unsigned long generation = variables_generation();
+    if (generation != counted) {
+        environment = 0;
+        for (char* const* entry = variables_envp(); *entry != NULL; entry++)
+            environment += argument_bytes(strlen(*entry));
+        counted = generation;
+    }
+
+    size_t used = environment + XARGS_HEADROOM;
+    return (size_t)arg_max > used ? arg_max - used : 0;
+}
+
+// Starts the command with the items gathered so far, and empties the batch.
+// An item is only ever an argument, whatever chars it holds
+static void run_batch(xargs_batch* batch, parallel_run* run) {
+    command* cmd = create_command_from_args(batch->count, batch->args);
+    parallel_submit_literal(run, cmd, batch->text, strlen(batch->text));
+    cleanup(cmd);
+    batch->runs++;
+
+    batch->count = batch->fixed;
+    batch->used = 0;
+    batch->bytes = 0;
+    for (int i = 0; i < batch->fixed; i++)
+        batch->bytes += argument_bytes(strlen(batch->args[i]));
+}
+
+// Adds the item of len chars to the batch, first starting the batch if the
+// item doesn't fit. Returns false if it wouldn't fit even in an empty batch
+static bool add_item(xargs_batch* batch, parallel_run* run, const char* item,
+                     size_t len) {
+    size_t bytes = argument_bytes(len);
+    bool has_items = batch->count > batch->fixed;
+    if (has_items && (batch->bytes + bytes > batch->limit ||
+                      batch->count - batch->fixed == batch->max_items))
+        run_batch(batch, run);
+    if (len >= XARGS_MAX_ARG_LEN || batch->bytes + bytes > batch->limit) {
+        fprintf(stderr, "xargs: argument line too long\n");
+        return false;
+    }
+
+    if (batch->count == batch->capacity) {
+        batch->capacity *= 2;
+        char** args = new char*[batch->capacity];
+        memcpy(args, batch->args, batch->count * sizeof(char*));
+        delete[] batch->args;
+        batch->args = args;
+    }
+    // The limit bounds the strings too, so they always fit
+    char* copy = batch->strings + batch->used;
+    memcpy(copy, item, len);
+    copy[len] = '\0';
+    batch->used += len + 1;
+    batch->args[batch->count++] = copy;
+    batch->bytes += bytes;
+    return true;
+}
+
+// Parses a number for -n, -s or -P that is at least min, or returns -1
+static long parse_number(const char* arg, long min) {
+    char* end;
+    errno = 0;
+    long number = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || errno != 0 || number < min) return -1;
+    return number;
+}
+
+// xargs [-0] [-r] [-a file] [-n max-args] [-s max-chars] [-P max-procs]
+//       [command [initial-arguments]]
+int builtin_xargs(command* cmd) {
+    bool null_separated = false;
+    bool run_if_empty = true;
+    const char* path = NULL;
+    long max_items = 0;
+    long max_chars = 0;
+    long max_procs = 1;
+
+    int i = 1;
+    for (; i < cmd->argc && cmd->argv[i][0] == '-'; i++) {
+        const char* arg = cmd->argv[i];
+        if (strcmp(arg, "--") == 0) {
+            i++;
+            break;
+        }
+        if (strcmp(arg, "-0") == 0) {
+            null_separated = true;
+            continue;
+        }
+        if (strcmp(arg, "-r") == 0) {
+            run_if_empty = false;
+            continue;
+        }
+
+        const char* value = i + 1 < cmd->argc ? cmd->argv[i + 1] : NULL;
+        long* number = strcmp(arg, "-n") == 0   ? &max_items
+                       : strcmp(arg, "-s") == 0 ? &max_chars
+                       : strcmp(arg, "-P") == 0 ? &max_procs
+                                                : NULL;
+        if (strcmp(arg, "-a") == 0 && value != NULL) {
+            path = value;
+        } else if (number != NULL && value != NULL) {
+            *number = parse_number(value, number == &max_procs ? 0 : 1);
+            if (*number < 0) {
+                fprintf(stderr, "xargs: invalid number for %s: '%s'\n", arg,
+                        value);
+                return ERROR;
+            }
+        } else {
+            fprintf(stderr, "xargs: invalid option %s\n", arg);
+            return ERROR;
+        }
+        i++;
+    }
+
+    xargs_batch batch;
+    static char default_command[] = "echo";
+    batch.fixed = i < cmd->argc ? cmd->argc - i : 1;
+    batch.capacity = batch.fixed + 64;
+    batch.args = new char*[batch.capacity];
+    batch.count = batch.fixed;
+    batch.limit = xargs_batch_limit();
+    if (max_chars > 0 && (size_t)max_chars < batch.limit)
+        batch.limit = max_chars;
+    batch.strings = new char[batch.limit];
+    batch.used = 0;
+    batch.bytes = 0;
+    batch.max_items = max_items;
+    batch.runs = 0;
+
+    size_t text_len = 0;
+    for (int j = 0; j < batch.fixed; j++) {
+        batch.args[j] = i < cmd->argc ? cmd->argv[i + j] : default_command;
+        batch.bytes += argument_bytes(strlen(batch.args[j]));
+        text_len += strlen(batch.args[j]) + 1;
+    }
+    batch.text = new char[text_len];
+    batch.text[0] = '\0';
+    for (int j = 0; j < batch.fixed; j++) {
+        if (j > 0) strcat(batch.text, " ");
+        strcat(batch.text, batch.args[j]);
+    }
+
+    int status = SUCCESS;
+    int fd = STDIN_FILENO;
+    if (path != NULL) {
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "xargs: %s: %s\n", path, strerror(errno));
+            status = ERROR;
+        }
+    }
+
+    parallel_options options;
+    parallel_default_options(&options);
+    options.name = "xargs";
+    options.jobs = max_procs > 0 && max_procs < INT_MAX ? max_procs : INT_MAX;
+    parallel_run run;
+    if (status == SUCCESS) status = parallel_start(&run, &options);
+
+    if (status == SUCCESS) {
+        line_reader reader;
+        line_reader_init(&reader, fd);
+        char delimiter = null_separated ? '\0' : '\n';
+        size_t len;
+        char* record;
+        while (status == SUCCESS &&
+               (record = read_record(&reader, delimiter, &len)) != NULL) {
+            if (null_separated) {
+                if (!add_item(&batch, &run, record, len)) status = ERROR;
+                continue;
+            }
+            // Every blank-separated word of the line is an item
+            char* end = record + len;
+            for (char* item = record + strspn(record, BLANKS);
+                 item < end && status == SUCCESS;) {
+                size_t item_len = strcspn(item, BLANKS);
+                if (!add_item(&batch, &run, item, item_len)) status = ERROR;
+                item += item_len;
+                item += strspn(item, BLANKS);
+            }
+        }
+        line_reader_free(&reader);
+
+        if (status == SUCCESS &&
+            (batch.count > batch.fixed || (batch.runs == 0 && run_if_empty)))
+            run_batch(&batch, &run);
+        if (parallel_finish(&run) == ERROR) status = ERROR;
+    }
+
+    if (fd != STDIN_FILENO && fd >= 0) close(fd);
+    delete[] batch.text;
+    delete[] batch.strings;
+    delete[] batch.args;
+    return status;
+}
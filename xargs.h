@@ -0,0 +1,43 @@
+#ifndef XARGS_H
+#define XARGS_H
+
+#include "shell.h"
+
+// Bytes of argument space every batch leaves free, as POSIX asks of xargs
+#define XARGS_HEADROOM 2048
+
+// Longest single argument the kernel takes (MAX_ARG_STRLEN)
+#define XARGS_MAX_ARG_LEN (32 * 4096)
+
+/**
+ * Returns the most argument bytes one batch of xargs may take: ARG_MAX
+ * (sysconf(_SC_ARG_MAX)) less the environment, counted like the arguments,
+ * and XARGS_HEADROOM. An argument takes its chars, its null terminator and
+ * its argv pointer.
+ *
+ * @return size_t
+ */
+size_t xargs_batch_limit();
+
+/**
+ * xargs [-0] [-r] [-a file] [-n max-args] [-s max-chars] [-P max-procs]
+ * [command [initial-arguments]]: reads items from stdin (or file), separated
+ * by blanks and newlines (or by null chars with -0), and runs command (echo
+ * by default) with the initial arguments followed by as many items as fit,
+ * over and over until they run out. A batch is as large as
+ * xargs_batch_limit (or max-chars) allows, and holds at most max-args items.
+ *
+ * Without -r, command runs once even if there are no items. With -P, up to
+ * max-procs batches run at once (through a parallel run, see parallel.h; 0
+ * means as many as there are batches). Commands get /dev/null as stdin.
+ *
+ * Unlike GNU xargs, quotes and backslashes in items are not special, as in
+ * the rest of the shell.
+ *
+ * @param cmd
+ * @return SUCCESS | ERROR (a batch failed, an item is too long or the
+ * arguments were invalid)
+ */
+int builtin_xargs(command* cmd);
+
+#endif  // XARGS_H